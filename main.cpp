@@ -1,772 +1,7208 @@
 #include <iostream>
-#include <fstream>      // For file I/O (ifstream, ofstream)
-#include <sstream>      // For parsing strings (stringstream)
 #include <string>
 #include <vector>
-#include <map>
-#include <iomanip>      // For hex formatting (setw, setfill)
+#include <iomanip>      // For the --bench table (setw, setprecision)
 #include <cstdint>      // For uint32_t (32-bit unsigned integer)
 #include <algorithm>    // For find_if
-#include <set>          // Used for modifying I-format
-#include <bitset>       // For generating debug string
+#include <string_view>
+#include <array>
+#include <atomic>       // For the allocation counter
+#include <charconv>     // For from_chars
+#include <cstdlib>
+#include <new>
+#include <cstring>      // For memcpy
+#include <fcntl.h>      // For open (flat image output)
+#include <sys/mman.h>   // For mmap (flat image output)
+#include <unistd.h>     // For read/write/ftruncate/close
+#include <sys/stat.h>   // For fstat
+#include <cerrno>
+#include <thread>       // For the pass 2 worker threads
+#include <chrono>       // For --bench phase timing
+#include <sys/resource.h> // For getrusage (peak RSS)
+#include <mutex>        // For the --serve job queue
+#include <condition_variable>
+#include <deque>
+#include <csignal>      // For ignoring SIGPIPE in --serve
+#include <sys/socket.h> // For the --serve Unix socket
+#include <sys/un.h>
+#include <sys/uio.h>    // For writev (output writer)
+#include <memory>       // For unique_ptr
+#include <memory_resource> // For the per-run arenas
+#include <unordered_map> // For the compiled expression cache
+#include <map>          // For the .incbin file cache
+#include <climits>      // For LONG_MIN/LONG_MAX (.dword range)
+#include <tuple>        // For the diagnostics sort key
 using namespace std;
 
+//where the fields of an instruction sit among its operands (operand 0 is the mnemonic),
+//0 for a field it does not take
+struct OperandSlots 
+{
+    uint8_t rd, rs1, rs2, imm;
+};
+
 struct InstructionInfo {
     enum class Format 
     { R, I, S, SB, U, UJ };
-    string opcode;
-    string funct3;
-    string funct7;
+    //how the operands are written where the format alone does not say
+    enum class Syntax 
+    {
+        Plain,         //the format's own order: add rd,rs1,rs2 / addi rd,rs1,imm / sw rs2,imm(rs1) / beq rs1,rs2,label / lui rd,imm / jal rd,label
+        Memory,        //loads and jalr: rd, imm(rs1)
+        Shift,         //rd, rs1, 6-bit shamt below a 6-bit funct field
+        ShiftWord,     //rd, rs1, 5-bit shamt
+        System,        //no operands, the whole immediate is fixed
+        Fence,         //pred, succ as sets of i/o/r/w, both iorw when left out
+        Csr,           //rd, csr, rs1 with the csr as a number or a name
+        CsrImmediate,  //rd, csr, 5-bit unsigned value in the rs1 field
+        Atomic,        //rd, rs2, (rs1), aq/rl left 0
+        LoadReserved   //rd, (rs1)
+    };
+    const char* name;
     Format format; 
+    Syntax syntax;
+    uint32_t base;  //opcode | funct3 << 12 | funct7 << 25 | fixed rs2 field << 20, already shifted into place
+    uint32_t mask;  //bits of a word that must equal base for the word to be this instruction
+    OperandSlots slots;
 };
 
-//instructuon set mapp
-map<string, InstructionInfo> instructionMap = {
-    // R-Format
-    { "add",   { "0110011", "000", "0000000", InstructionInfo::Format::R } },
-    { "addw",  { "0111011", "000", "0000000", InstructionInfo::Format::R } },
-    { "and",   { "0110011", "111", "0000000", InstructionInfo::Format::R } },
-    { "or",    { "0110011", "110", "0000000", InstructionInfo::Format::R } },
-    { "sll",   { "0110011", "001", "0000000", InstructionInfo::Format::R } },
-    { "slt",   { "0110011", "010", "0000000", InstructionInfo::Format::R } },
-    { "sra",   { "0110011", "101", "0100000", InstructionInfo::Format::R } },
-    { "srl",   { "0110011", "101", "0000000", InstructionInfo::Format::R } },
-    { "sub",   { "0110011", "000", "0100000", InstructionInfo::Format::R } },
-    { "subw",  { "0111011", "000", "0100000", InstructionInfo::Format::R } },
-    { "xor",   { "0110011", "100", "0000000", InstructionInfo::Format::R } },
-    { "mul",   { "0110011", "000", "0000001", InstructionInfo::Format::R } }, // M Extension
-    { "mulw",  { "0111011", "000", "0000001", InstructionInfo::Format::R } }, // M Extension
-    { "div",   { "0110011", "100", "0000001", InstructionInfo::Format::R } }, // M Extension
-    { "divw",  { "0111011", "100", "0000001", InstructionInfo::Format::R } }, // M Extension
-    { "rem",   { "0110011", "110", "0000001", InstructionInfo::Format::R } }, // M Extension
-    { "remw",  { "0111011", "110", "0000001", InstructionInfo::Format::R } }, // M Extension
-    
-    // I-Format
-    { "addi",  { "0010011", "000", "NULL", InstructionInfo::Format::I } },
-    { "addiw", { "0011011", "000", "NULL", InstructionInfo::Format::I } },
-    { "andi",  { "0010011", "111", "NULL", InstructionInfo::Format::I } },
-    { "ori",   { "0010011", "110", "NULL", InstructionInfo::Format::I } },
-    { "lb",    { "0000011", "000", "NULL", InstructionInfo::Format::I } }, // Load
-    { "ld",    { "0000011", "011", "NULL", InstructionInfo::Format::I } }, // Load
-    { "lh",    { "0000011", "001", "NULL", InstructionInfo::Format::I } }, // Load
-    { "lw",    { "0000011", "010", "NULL", InstructionInfo::Format::I } }, // Load
-    { "jalr",  { "1100111", "000", "NULL", InstructionInfo::Format::I } }, // Load-like syntax
-
-    // S-Format
-    { "sb",    { "0100011", "000", "NULL", InstructionInfo::Format::S } },
-    { "sw",    { "0100011", "010", "NULL", InstructionInfo::Format::S } },
-    { "sh",    { "0100011", "001", "NULL", InstructionInfo::Format::S } },
-    { "sd",    { "0100011", "011", "NULL", InstructionInfo::Format::S } },
-
-    // SB-Format
-    { "beq",   { "1100011", "000", "NULL", InstructionInfo::Format::SB } },
-    { "bne",   { "1100011", "001", "NULL", InstructionInfo::Format::SB } },
-    { "bge",   { "1100011", "101", "NULL", InstructionInfo::Format::SB } },
-    { "blt",   { "1100011", "100", "NULL", InstructionInfo::Format::SB } },
-
-    // U-Format
-    { "auipc", { "0010111", "NULL", "NULL", InstructionInfo::Format::U } },
-    { "lui",   { "0110111", "NULL", "NULL", InstructionInfo::Format::U } },
-
-    // UJ-Format
-    { "jal",   { "1101111", "NULL", "NULL", InstructionInfo::Format::UJ } }
-};
-
-//symbil Table
-map<string, long> symbolTable;
+//pack the fixed fields of an instruction into its base encoding
+constexpr uint32_t encodeBase(uint32_t opcode, uint32_t funct3, uint32_t funct7, uint32_t rs2) 
+{
+    return opcode | (funct3 << 12) | (funct7 << 25) | (rs2 << 20);
+}
 
-//remove leading spaces
-string& ltrim(string& s) 
+//bits an instruction fixes, the fields its format and syntax leave open are 0
+constexpr uint32_t encodingMask(InstructionInfo::Format format, InstructionInfo::Syntax syntax) 
 {
-    s.erase(s.begin(), find_if(s.begin(), s.end(),[](unsigned char ch) 
-        {
-            return !isspace(ch); // points to first non-space char
-        })
-    );
-    return s;
+    using Format = InstructionInfo::Format;
+    using Syntax = InstructionInfo::Syntax;
+    switch (syntax) 
+    {
+        case Syntax::Shift: return 0xFC00707F;         //funct6, shamt[5] is bit 25
+        case Syntax::ShiftWord: return 0xFE00707F;
+        case Syntax::System: return 0xFFFFFFFF;
+        case Syntax::Atomic: return 0xF800707F;        //funct5, aq/rl are bits 26/25
+        case Syntax::LoadReserved: return 0xF9F0707F;  //rs2 is 0 too
+        default: break;
+    }
+    return format == Format::R ? 0xFE00707F : format == Format::U || format == Format::UJ ? 0x7F : 0x707F;
 }
 
-//remove trailing spaces
-string& rtrim(string& s) 
+constexpr OperandSlots operandSlots(InstructionInfo::Format format, InstructionInfo::Syntax syntax) 
 {
-    s.erase(find_if(s.rbegin(), s.rend(),[](unsigned char ch) //reverse iterator
+    using Format = InstructionInfo::Format;
+    using Syntax = InstructionInfo::Syntax;
+    switch (syntax) 
     {
-        return !isspace(ch);
-    }).base(), //converts reverse to normal iterator, points to where trailig spaces begin
-        s.end());
-    return s;
+        case Syntax::Memory: return {1, 3, 0, 2};
+        case Syntax::System: return {0, 0, 0, 0};
+        case Syntax::Fence: return {0, 0, 0, 1};  //pred is operand 1, succ operand 2
+        case Syntax::Csr:
+        case Syntax::CsrImmediate: return {1, 3, 0, 2};
+        case Syntax::Atomic: return {1, 3, 2, 0};
+        case Syntax::LoadReserved: return {1, 2, 0, 0};
+        default: break;
+    }
+    switch (format) 
+    {
+        case Format::R: return {1, 2, 3, 0};
+        case Format::I: return {1, 2, 0, 3};
+        case Format::S: return {0, 3, 1, 2};
+        case Format::SB: return {0, 1, 2, 3};
+        case Format::U:
+        case Format::UJ: return {1, 0, 0, 2};
+    }
+    return {0, 0, 0, 0};
 }
 
-string& trim(string& s) 
+//instruction set table: name, format, syntax, opcode, funct3, funct7, rs2
+//funct3/funct7 are 0 where the format has no such field, rs2 is the fixed rs2 field of
+//an instruction without an rs2 operand (ebreak); a '.' in a mnemonic is '_' here
+//(amoadd_w is amoadd.w); funct7 of the A extension is funct5 << 2 with aq/rl clear
+//the whole assembler works from this one table: lookup, encoding, decoding, the
+//debug string and the --run handlers, so an instruction is added here and nowhere else
+#define RV64I_INSTRUCTIONS(X) \
+    /* R-Format */ \
+    X(add,    R,  Plain,     0b0110011, 0b000, 0b0000000, 0) \
+    X(addw,   R,  Plain,     0b0111011, 0b000, 0b0000000, 0) \
+    X(and,    R,  Plain,     0b0110011, 0b111, 0b0000000, 0) \
+    X(or,     R,  Plain,     0b0110011, 0b110, 0b0000000, 0) \
+    X(sll,    R,  Plain,     0b0110011, 0b001, 0b0000000, 0) \
+    X(sllw,   R,  Plain,     0b0111011, 0b001, 0b0000000, 0) \
+    X(slt,    R,  Plain,     0b0110011, 0b010, 0b0000000, 0) \
+    X(sltu,   R,  Plain,     0b0110011, 0b011, 0b0000000, 0) \
+    X(sra,    R,  Plain,     0b0110011, 0b101, 0b0100000, 0) \
+    X(sraw,   R,  Plain,     0b0111011, 0b101, 0b0100000, 0) \
+    X(srl,    R,  Plain,     0b0110011, 0b101, 0b0000000, 0) \
+    X(srlw,   R,  Plain,     0b0111011, 0b101, 0b0000000, 0) \
+    X(sub,    R,  Plain,     0b0110011, 0b000, 0b0100000, 0) \
+    X(subw,   R,  Plain,     0b0111011, 0b000, 0b0100000, 0) \
+    X(xor,    R,  Plain,     0b0110011, 0b100, 0b0000000, 0) \
+    /* I-Format */ \
+    X(addi,   I,  Plain,     0b0010011, 0b000, 0, 0) \
+    X(addiw,  I,  Plain,     0b0011011, 0b000, 0, 0) \
+    X(andi,   I,  Plain,     0b0010011, 0b111, 0, 0) \
+    X(ori,    I,  Plain,     0b0010011, 0b110, 0, 0) \
+    X(xori,   I,  Plain,     0b0010011, 0b100, 0, 0) \
+    X(slti,   I,  Plain,     0b0010011, 0b010, 0, 0) \
+    X(sltiu,  I,  Plain,     0b0010011, 0b011, 0, 0) \
+    X(slli,   I,  Shift,     0b0010011, 0b001, 0, 0) \
+    X(srli,   I,  Shift,     0b0010011, 0b101, 0, 0) \
+    X(srai,   I,  Shift,     0b0010011, 0b101, 0b0100000, 0) \
+    X(slliw,  I,  ShiftWord, 0b0011011, 0b001, 0, 0) \
+    X(srliw,  I,  ShiftWord, 0b0011011, 0b101, 0, 0) \
+    X(sraiw,  I,  ShiftWord, 0b0011011, 0b101, 0b0100000, 0) \
+    X(lb,     I,  Memory,    0b0000011, 0b000, 0, 0) /* Load */ \
+    X(ld,     I,  Memory,    0b0000011, 0b011, 0, 0) /* Load */ \
+    X(lh,     I,  Memory,    0b0000011, 0b001, 0, 0) /* Load */ \
+    X(lw,     I,  Memory,    0b0000011, 0b010, 0, 0) /* Load */ \
+    X(lbu,    I,  Memory,    0b0000011, 0b100, 0, 0) /* Load */ \
+    X(lhu,    I,  Memory,    0b0000011, 0b101, 0, 0) /* Load */ \
+    X(lwu,    I,  Memory,    0b0000011, 0b110, 0, 0) /* Load */ \
+    X(jalr,   I,  Memory,    0b1100111, 0b000, 0, 0) /* Load-like syntax */ \
+    X(ecall,  I,  System,    0b1110011, 0b000, 0, 0) \
+    X(ebreak, I,  System,    0b1110011, 0b000, 0, 1) \
+    X(fence,  I,  Fence,     0b0001111, 0b000, 0, 0) \
+    /* S-Format */ \
+    X(sb,     S,  Plain,     0b0100011, 0b000, 0, 0) \
+    X(sw,     S,  Plain,     0b0100011, 0b010, 0, 0) \
+    X(sh,     S,  Plain,     0b0100011, 0b001, 0, 0) \
+    X(sd,     S,  Plain,     0b0100011, 0b011, 0, 0) \
+    /* SB-Format */ \
+    X(beq,    SB, Plain,     0b1100011, 0b000, 0, 0) \
+    X(bne,    SB, Plain,     0b1100011, 0b001, 0, 0) \
+    X(bge,    SB, Plain,     0b1100011, 0b101, 0, 0) \
+    X(blt,    SB, Plain,     0b1100011, 0b100, 0, 0) \
+    X(bgeu,   SB, Plain,     0b1100011, 0b111, 0, 0) \
+    X(bltu,   SB, Plain,     0b1100011, 0b110, 0, 0) \
+    /* U-Format */ \
+    X(auipc,  U,  Plain,     0b0010111, 0, 0, 0) \
+    X(lui,    U,  Plain,     0b0110111, 0, 0, 0) \
+    /* UJ-Format */ \
+    X(jal,    UJ, Plain,     0b1101111, 0, 0, 0)
+
+#define RV64M_INSTRUCTIONS(X) \
+    X(mul,    R,  Plain,     0b0110011, 0b000, 0b0000001, 0) \
+    X(mulh,   R,  Plain,     0b0110011, 0b001, 0b0000001, 0) \
+    X(mulhsu, R,  Plain,     0b0110011, 0b010, 0b0000001, 0) \
+    X(mulhu,  R,  Plain,     0b0110011, 0b011, 0b0000001, 0) \
+    X(mulw,   R,  Plain,     0b0111011, 0b000, 0b0000001, 0) \
+    X(div,    R,  Plain,     0b0110011, 0b100, 0b0000001, 0) \
+    X(divu,   R,  Plain,     0b0110011, 0b101, 0b0000001, 0) \
+    X(divw,   R,  Plain,     0b0111011, 0b100, 0b0000001, 0) \
+    X(divuw,  R,  Plain,     0b0111011, 0b101, 0b0000001, 0) \
+    X(rem,    R,  Plain,     0b0110011, 0b110, 0b0000001, 0) \
+    X(remu,   R,  Plain,     0b0110011, 0b111, 0b0000001, 0) \
+    X(remw,   R,  Plain,     0b0111011, 0b110, 0b0000001, 0) \
+    X(remuw,  R,  Plain,     0b0111011, 0b111, 0b0000001, 0)
+
+#define RV64A_INSTRUCTIONS(X) \
+    X(lr_w,      R, LoadReserved, 0b0101111, 0b010, 0b0001000, 0) \
+    X(sc_w,      R, Atomic,       0b0101111, 0b010, 0b0001100, 0) \
+    X(amoswap_w, R, Atomic,       0b0101111, 0b010, 0b0000100, 0) \
+    X(amoadd_w,  R, Atomic,       0b0101111, 0b010, 0b0000000, 0) \
+    X(amoxor_w,  R, Atomic,       0b0101111, 0b010, 0b0010000, 0) \
+    X(amoand_w,  R, Atomic,       0b0101111, 0b010, 0b0110000, 0) \
+    X(amoor_w,   R, Atomic,       0b0101111, 0b010, 0b0100000, 0) \
+    X(amomin_w,  R, Atomic,       0b0101111, 0b010, 0b1000000, 0) \
+    X(amomax_w,  R, Atomic,       0b0101111, 0b010, 0b1010000, 0) \
+    X(amominu_w, R, Atomic,       0b0101111, 0b010, 0b1100000, 0) \
+    X(amomaxu_w, R, Atomic,       0b0101111, 0b010, 0b1110000, 0) \
+    X(lr_d,      R, LoadReserved, 0b0101111, 0b011, 0b0001000, 0) \
+    X(sc_d,      R, Atomic,       0b0101111, 0b011, 0b0001100, 0) \
+    X(amoswap_d, R, Atomic,       0b0101111, 0b011, 0b0000100, 0) \
+    X(amoadd_d,  R, Atomic,       0b0101111, 0b011, 0b0000000, 0) \
+    X(amoxor_d,  R, Atomic,       0b0101111, 0b011, 0b0010000, 0) \
+    X(amoand_d,  R, Atomic,       0b0101111, 0b011, 0b0110000, 0) \
+    X(amoor_d,   R, Atomic,       0b0101111, 0b011, 0b0100000, 0) \
+    X(amomin_d,  R, Atomic,       0b0101111, 0b011, 0b1000000, 0) \
+    X(amomax_d,  R, Atomic,       0b0101111, 0b011, 0b1010000, 0) \
+    X(amominu_d, R, Atomic,       0b0101111, 0b011, 0b1100000, 0) \
+    X(amomaxu_d, R, Atomic,       0b0101111, 0b011, 0b1110000, 0)
+
+#define ZICSR_INSTRUCTIONS(X) \
+    X(csrrw,  I,  Csr,          0b1110011, 0b001, 0, 0) \
+    X(csrrs,  I,  Csr,          0b1110011, 0b010, 0, 0) \
+    X(csrrc,  I,  Csr,          0b1110011, 0b011, 0, 0) \
+    X(csrrwi, I,  CsrImmediate, 0b1110011, 0b101, 0, 0) \
+    X(csrrsi, I,  CsrImmediate, 0b1110011, 0b110, 0, 0) \
+    X(csrrci, I,  CsrImmediate, 0b1110011, 0b111, 0, 0)
+
+#define RISCV_INSTRUCTIONS(X) \
+    RV64I_INSTRUCTIONS(X) \
+    RV64M_INSTRUCTIONS(X) \
+    RV64A_INSTRUCTIONS(X) \
+    ZICSR_INSTRUCTIONS(X)
+
+//indices into instructionTable, one per mnemonic
+enum InstructionId : size_t {
+#define X(name, fmt, syntax, opcode, funct3, funct7, rs2) INSN_##name,
+    RISCV_INSTRUCTIONS(X)
+#undef X
+    INSN_COUNT
+};
+
+//mnemonic as written, the table's identifier with '_' back to '.'
+struct MnemonicText 
 {
-    return ltrim(rtrim(s));
+    char text[12];
+};
+
+constexpr MnemonicText spellMnemonic(const char* id) 
+{
+    MnemonicText mnemonic{};
+    for (size_t i = 0; id[i] && i + 1 < sizeof(mnemonic.text); ++i) mnemonic.text[i] = id[i] == '_' ? '.' : id[i];
+    return mnemonic;
 }
 
-string cleanLine(string line) 
+constexpr MnemonicText mnemonicTexts[] = {
+#define X(name, fmt, syntax, opcode, funct3, funct7, rs2) spellMnemonic(#name),
+    RISCV_INSTRUCTIONS(X)
+#undef X
+};
+
+//instructuon set table, built at compile time
+constexpr InstructionInfo instructionTable[] = {
+#define X(name, fmt, syntax, opcode, funct3, funct7, rs2) \
+    { mnemonicTexts[INSN_##name].text, InstructionInfo::Format::fmt, InstructionInfo::Syntax::syntax, encodeBase(opcode, funct3, funct7, rs2), \
+      encodingMask(InstructionInfo::Format::fmt, InstructionInfo::Syntax::syntax), operandSlots(InstructionInfo::Format::fmt, InstructionInfo::Syntax::syntax) },
+    RISCV_INSTRUCTIONS(X)
+#undef X
+};
+
+//FNV-1a hash of a mnemonic, usable in case labels
+constexpr uint32_t mnemonicHash(string_view s) 
 {
-    size_t commentPos = line.find('#'); //find comments
-    if (commentPos !=string::npos) 
+    uint32_t h = 2166136261u;
+    for (char c : s) 
     {
-        line = line.substr(0, commentPos); //only take part befor comment starts
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619u;
     }
-    return trim(line);
+    return h;
 }
 
-//splits a line into meaningful tokens
-vector<string> parseOperands(const string& line) 
+//find the table entry for a mnemonic, nullptr if unknown
+//a hash collision between two mnemonics is a duplicate case label, so the
+//compiler proves the hash is perfect over the table; however many extensions the
+//table holds, a lookup stays one switch and one compare
+const InstructionInfo* findInstruction(string_view name) 
 {
-    vector<string> tokens;
-    string cleanLine = line;
-    for (char& c : cleanLine) 
-    {
-        //remove punctuation
-        if (c == ',' || c == '(' || c == ')') 
-        {
-            c = ' ';
-        }
-    }
-    stringstream ss(cleanLine);
-    string token;
-    while (ss >> token)
+    size_t id;
+    switch (mnemonicHash(name)) 
     {
-        tokens.push_back(token);
+#define X(name, fmt, syntax, opcode, funct3, funct7, rs2) \
+        case mnemonicHash(mnemonicTexts[INSN_##name].text): id = INSN_##name; break;
+        RISCV_INSTRUCTIONS(X)
+#undef X
+        default: return nullptr;
     }
-    return tokens;
+    const InstructionInfo& info = instructionTable[id];
+    return name == info.name ? &info : nullptr;
 }
 
-int registerToInt(const string& reg) 
-{
-    static const unordered_map<string, int> regMap = {
-        {"zero", 0}, {"ra", 1}, {"sp", 2}, {"gp", 3}, {"tp", 4},
-        {"t0", 5}, {"t1", 6}, {"t2", 7},
-        {"s0", 8}, {"fp", 8}, {"s1", 9},
-        {"a0", 10}, {"a1", 11}, {"a2", 12}, {"a3", 13}, {"a4", 14}, {"a5", 15}, {"a6", 16}, {"a7", 17},
-        {"s2", 18}, {"s3", 19}, {"s4", 20}, {"s5", 21}, {"s6", 22}, {"s7", 23}, {"s8", 24}, {"s9", 25},
-        {"s10", 26}, {"s11", 27},
-        {"t3", 28}, {"t4", 29}, {"t5", 30}, {"t6", 31}
-    };
+//field accessors for the packed base encoding
+constexpr uint32_t opcodeBits(const InstructionInfo& info) { return info.base & 0x7F; }
+constexpr uint32_t funct3Bits(const InstructionInfo& info) { return (info.base >> 12) & 0x7; }
+constexpr uint32_t funct7Bits(const InstructionInfo& info) { return info.base >> 25; }
 
-    if (reg.size() > 1 && reg[0] == 'x') 
-    {
-        // numeric register like x5
-        return stoi(reg.substr(1));
-    }
+//operand holding the branch/jump target label, 0 if the instruction has none
+constexpr size_t labelOperandIndex(const InstructionInfo& info) 
+{
+    return info.format == InstructionInfo::Format::SB ? 3 : info.format == InstructionInfo::Format::UJ ? 2 : 0;
+}
 
-    auto it = regMap.find(reg);
-    if (it != regMap.end()) 
-    {
-        return it->second;
-    }
+//tokens an instruction takes, its mnemonic included; the fence sets are the only
+//operands no slot names
+constexpr size_t operandCount(const InstructionInfo& info) 
+{
+    if (info.syntax == InstructionInfo::Syntax::Fence) return 3;
+    const OperandSlots& slots = info.slots;
+    return 1 + max({slots.rd, slots.rs1, slots.rs2, slots.imm});
+}
 
-    // If not found, return 0 (default to x0)
-    return 0;
+//loads, jalr, stores and the atomics write their rs1 in parentheses
+constexpr bool hasMemoryOperand(const InstructionInfo& info) 
+{
+    using Syntax = InstructionInfo::Syntax;
+    return info.syntax == Syntax::Memory || info.syntax == Syntax::Atomic || info.syntax == Syntax::LoadReserved
+        || info.format == InstructionInfo::Format::S;
 }
 
-//check if no. in hex or dec and convert to long
-//stol is converting from hex/dec to dec long int
-long stringToLong(const string& s) 
+//key of the decode table: the bits that tell the instructions apart, opcode[6:2],
+//funct3, funct7 and bit 20 (ecall/ebreak)
+constexpr size_t decodeKey(uint32_t word) 
 {
-    if (s.rfind("0x", 0) == 0 || s.rfind("0X", 0) == 0)
-        return stol(s, nullptr, 16);
-    else
-        return stol(s, nullptr, 10);
+    return ((word >> 2) & 0x1F) << 11 | ((word >> 12) & 0x7) << 8 | (word >> 25) << 1 | ((word >> 20) & 1);
 }
 
-// Converts 64-bit integer to a hex string with custom pading
-string Hexa(uint64_t value, int num_chars = 0) { // Default to 0
-    stringstream ss;
-    ss << "0x" << uppercase;
-    if (num_chars > 0) {
-        ss << setfill('0') << setw(num_chars);
+//instruction id + 1 per decode key, 0 where nothing decodes
+static_assert(INSN_COUNT < 255, "decode table ids are bytes");
+struct DecodeTable 
+{
+    array<uint8_t, 1 << 16> ids{};
+    bool ambiguous = false;  //two table entries share a key
+};
+
+//built at compile time from instructionTable: an instruction takes every key that agrees
+//with its fixed bits, the key bits its mask leaves open in all combinations
+constexpr DecodeTable makeDecodeTable() 
+{
+    DecodeTable table;
+    for (size_t id = 0; id < INSN_COUNT; ++id) 
+    {
+        const InstructionInfo& info = instructionTable[id];
+        size_t fixed = decodeKey(info.base), open = ~decodeKey(info.mask) & 0xFFFF;
+        for (size_t bits = open; ; bits = (bits - 1) & open) 
+        {
+            size_t key = fixed | bits;
+            if (table.ids[key] != 0) table.ambiguous = true;
+            table.ids[key] = static_cast<uint8_t>(id + 1);
+            if (bits == 0) break;
+        }
     }
-    ss << hex << value;
-    return ss.str();
+    return table;
 }
 
-//the vector type to back to assembly string
-string getCompressedAssembly(vector<string>& operands) {
-    if (operands.empty()) return "";
-    
-    string instName = operands[0];
-    const set<string> loadLike = {"lb", "ld", "lh", "lw", "jalr"};
-    const set<string> storeLike = {"sb", "sw", "sh", "sd"};
+constexpr DecodeTable decodeTable = makeDecodeTable();
+static_assert(!decodeTable.ambiguous, "two instructions decode from the same bits");
 
-    if (loadLike.count(instName)) {
-        //eg lw rd,imm(rs1)
-        return instName + " " + operands[1] + "," + operands[2] + "(" + operands[3] + ")";
-    }
-    if (storeLike.count(instName)) {
-        //eg sw rs2,imm(rs1)
-        return instName + " " + operands[1] + "," + operands[2] + "(" + operands[3] + ")";
-    }
-    if (instName == "jal" && operands.size() == 3) {
-        //eg jal rd, label
-        return instName + " " + operands[1] + "," + operands[2];
-    }
+constexpr uint32_t NO_LABEL = UINT32_MAX;
+constexpr long UNDEFINED_ADDRESS = -1;
 
-    // Default r-type,i type,sb-type
-    //eg add rd,rs1,rs2
-    string result = instName + " " + operands[1];
-    for (size_t i = 2; i < operands.size(); ++i) 
+//bump-pointer arena for the short-lived storage of one assembly (pass 1 chunk lines,
+//tokens and labels); nothing is freed one by one, reset() drops everything at once
+//and keeps a single block as large as the last run needed, so a --serve worker
+//stops allocating after its first jobs
+//not thread safe: each pass 1 chunk has its own
+class Arena : public pmr::memory_resource 
+{
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { release(); }
+
+    void reset() 
     {
-        result += "," + operands[i];
+        if (blocks.size() > 1) 
+        {
+            //next run gets everything in one block
+            release();
+            nextBlockSize = max(nextBlockSize, used);
+        }
+        top = blocks.empty() ? nullptr : blocks.back().data;
+        used = 0;
     }
-    return result;
-}
 
-//to get the # string
-string getDebugString(InstructionInfo& info, vector<string>& operands, long offset = 0) 
-{
-    string opcode = info.opcode;
-    string funct3 = info.funct3;
-    string funct7 = info.funct7;
-    string rd_s = "NULL", rs1_s = "NULL", rs2_s = "NULL", imm_s = "NULL";
-    const set<string> loadLike = {"lb", "ld", "lh", "lw", "jalr"};
-
-    if (info.format == InstructionInfo::Format::R) 
-    {
-        rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-        rs1_s = bitset<5>(registerToInt(operands[2])).to_string();
-        rs2_s = bitset<5>(registerToInt(operands[3])).to_string();
-        //imm_s remains "NULL"
-    } 
-    else if (info.format == InstructionInfo::Format::I) 
-    {
-        if (loadLike.count(operands[0])) 
-        { // lw rd, imm(rs1)
-            rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-            rs1_s = bitset<5>(registerToInt(operands[3])).to_string();
-            imm_s = bitset<12>(stringToLong(operands[2])).to_string();
-        } 
-        else { // addi rd, rs1, imm
-            rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-            rs1_s = bitset<5>(registerToInt(operands[2])).to_string();
-            imm_s = bitset<12>(stringToLong(operands[3])).to_string();
-        }
-        // funct7 remains "NULL"
-    }
-    else if (info.format == InstructionInfo::Format::S) 
-    { // sw rs2, imm(rs1)
-        rs1_s = bitset<5>(registerToInt(operands[3])).to_string();
-        rs2_s = bitset<5>(registerToInt(operands[1])).to_string();
-        imm_s = bitset<12>(stringToLong(operands[2])).to_string();
-        // funct7 remains "NULL"
-    }
-    else if (info.format == InstructionInfo::Format::SB) 
-    { // beq rs1, rs2, label
-        rs1_s = bitset<5>(registerToInt(operands[1])).to_string();
-        rs2_s = bitset<5>(registerToInt(operands[2])).to_string();
-        imm_s = bitset<13>(offset).to_string();
-        // funct7 remains "NULL"
-    }
-    else if (info.format == InstructionInfo::Format::U) 
-    { // lui rd, imm
-        rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-        imm_s = bitset<20>(stringToLong(operands[2])).to_string(); 
-        // funct3 and funct7 remain "NULL"
-    }
-    else if (info.format == InstructionInfo::Format::UJ) 
-    { // jal rd, label
-        rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-        imm_s = bitset<21>(offset).to_string();
-        //funct3 and funct7 remain NULL
-    }
-
-    if (info.format == InstructionInfo::Format::I || info.format == InstructionInfo::Format::U || info.format == InstructionInfo::Format::UJ) {
-        //these don't include rs2
-        //opcode-funct3-funct7-rd-rs1-immediate
-        return "# " + opcode + "-" + funct3 + "-" + funct7 + "-" + rd_s + "-" + rs1_s + "-" + imm_s;
-    } 
-    else 
+    size_t bytesUsed() const { return used; }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override 
     {
-        // R, S, and SB use all 7 fields
-        //opcode-funct3-funct7-rd-rs1-rs2-immediate
-        return "# " + opcode + "-" + funct3 + "-" + funct7 + "-" + rd_s + "-" + rs1_s + "-" + rs2_s + "-" + imm_s;
-    }
-}
-/*
-//create the debug string
-//printing 7 fields for all types
-string getDebugString(InstructionInfo& info, vector<string>& operands, long offset = 0) 
-{
-    string opcode = info.opcode;
-    string funct3 = info.funct3;
-    string funct7 = info.funct7;
-    string rd_s = "NULL", rs1_s = "NULL", rs2_s = "NULL", imm_s = "NULL";
-    const set<string> loadLike = {"lb", "ld", "lh", "lw", "jalr"};
-
-    if (info.format == InstructionInfo::Format::R) {
-        rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-        rs1_s = bitset<5>(registerToInt(operands[2])).to_string();
-        rs2_s = bitset<5>(registerToInt(operands[3])).to_string();
-    } 
-    else if (info.format == InstructionInfo::Format::I) 
-    {
-        if (loadLike.count(operands[0])) 
-        { // lw rd, imm(rs1)
-            rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-            rs1_s = bitset<5>(registerToInt(operands[3])).to_string();
-            imm_s = bitset<12>(stringToLong(operands[2])).to_string();
-        } 
-        else 
-        { // addi rd, rs1, imm
-            rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-            rs1_s = bitset<5>(registerToInt(operands[2])).to_string();
-            imm_s = bitset<12>(stringToLong(operands[3])).to_string();
+        char* start = alignUp(top, alignment);
+        if (blocks.empty() || start + bytes > blocks.back().data + blocks.back().size) 
+        {
+            size_t size = max(nextBlockSize, bytes + alignment);
+            blocks.push_back({static_cast<char*>(::operator new(size)), size});
+            nextBlockSize = size * 2;
+            start = alignUp(blocks.back().data, alignment);
         }
+        top = start + bytes;
+        used += bytes;
+        return start;
     }
-    else if (info.format == InstructionInfo::Format::S) 
-    { // sw rs2, imm(rs1)
-        rs1_s = bitset<5>(registerToInt(operands[3])).to_string();
-        rs2_s = bitset<5>(registerToInt(operands[1])).to_string();
-        imm_s = bitset<12>(stringToLong(operands[2])).to_string();
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+    struct Block { char* data; size_t size; };
+    static char* alignUp(char* p, size_t alignment) 
+    {
+        return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~(alignment - 1));
     }
-    else if (info.format == InstructionInfo::Format::SB) 
-    { // beq rs1, rs2, label
-        rs1_s = bitset<5>(registerToInt(operands[1])).to_string();
-        rs2_s = bitset<5>(registerToInt(operands[2])).to_string();
-        imm_s = bitset<13>(offset).to_string(); //13-bit offset
+    void release() 
+    {
+        for (Block& block : blocks) ::operator delete(block.data);
+        blocks.clear();
+        top = nullptr;
     }
-    else if (info.format == InstructionInfo::Format::U) 
-    { // lui rd, imm
-        rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-        imm_s = bitset<20>(stringToLong(operands[2])).to_string(); 
+
+    vector<Block> blocks;
+    char* top = nullptr;             //next free byte in blocks.back()
+    size_t used = 0;                 //bytes handed out since reset
+    size_t nextBlockSize = 1 << 16;
+};
+
+//label interner: every distinct label name gets a dense id the first time it is seen
+//(defined or referenced), backed by a flat open-addressing hash table, so resolving
+//a label later is one array index
+//pass 1 chunks keep their tables in the chunk's arena, the program's lives on the heap
+struct LabelTable 
+{
+    explicit LabelTable(pmr::memory_resource* memory = pmr::get_default_resource())
+        : names(memory), addresses(memory), slots(memory) {}
+
+    pmr::vector<string_view> names;   //id -> name, views into the source
+    pmr::vector<long> addresses;      //id -> address, UNDEFINED_ADDRESS until defined
+
+    //power-of-two table of (hash, id + 1), 0 marks an empty slot, linear probing
+    struct Slot { uint32_t hash; uint32_t id; };
+    pmr::vector<Slot> slots;
+
+    size_t size() const { return names.size(); }
+
+    uint32_t find(string_view name) const 
+    {
+        if (slots.empty()) return NO_LABEL;
+        uint32_t hash = mnemonicHash(name);
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; slots[i].id != 0; i = (i + 1) & mask) 
+        {
+            if (slots[i].hash == hash && names[slots[i].id - 1] == name) return slots[i].id - 1;
+        }
+        return NO_LABEL;
     }
-    else if (info.format == InstructionInfo::Format::UJ) 
-    { // jal rd, label
-        rd_s = bitset<5>(registerToInt(operands[1])).to_string();
-        imm_s = bitset<21>(offset).to_string(); //21-bit offset
+
+    //forget every label but keep the storage for the next program
+    void clear() 
+    {
+        names.clear();
+        addresses.clear();
+        fill(slots.begin(), slots.end(), Slot{0, 0});
     }
 
-    //opcode-func3-func7-rd-rs1-rs2-imm
-    return "# " + opcode + "-" + funct3 + "-" + funct7 + "-" + rd_s + "-" + rs1_s + "-" + rs2_s + "-" + imm_s;
-}
-*/
-//build machine code for r-format
+    uint32_t intern(string_view name) 
+    {
+        //keep the load factor at or under 1/2
+        if ((names.size() + 1) * 2 > slots.size()) grow();
+        uint32_t hash = mnemonicHash(name);
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        for (; slots[i].id != 0; i = (i + 1) & mask) 
+        {
+            if (slots[i].hash == hash && names[slots[i].id - 1] == name) return slots[i].id - 1;
+        }
+        uint32_t id = static_cast<uint32_t>(names.size());
+        slots[i] = {hash, id + 1};
+        names.push_back(name);
+        addresses.push_back(UNDEFINED_ADDRESS);
+        return id;
+    }
 
-uint32_t assemble_R_format(const InstructionInfo& info, const vector<string>& operands) {
-    uint32_t machineCode = 0;
-    //convert operands to register no.
-    uint32_t rd  = registerToInt(operands[1]);
-    uint32_t rs1 = registerToInt(operands[2]);
-    uint32_t rs2 = registerToInt(operands[3]);
-    
-   //Convert opcode/funct3/funct7 to integer
-   //so that we can use shift operations to generate machine code
-    uint32_t opcode = stoul(info.opcode, nullptr, 2);
-    uint32_t funct3 = stoul(info.funct3, nullptr, 2);
-    uint32_t funct7 = stoul(info.funct7, nullptr, 2);
-
-    machineCode |= opcode;//0-6
-    machineCode |= (rd  << 7);//7-11
-    machineCode |= (funct3 << 12);//12-14
-    machineCode |= (rs1 << 15);//15-19
-    machineCode |= (rs2 << 20);//20-24
-    machineCode |= (funct7 << 25);//25-31
-    return machineCode;
-}
+    void grow() 
+    {
+        pmr::vector<Slot> old(max<size_t>(slots.size() * 2, 64), Slot{0, 0}, slots.get_allocator());
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot& slot : old) 
+        {
+            if (slot.id == 0) continue;
+            size_t i = slot.hash & mask;
+            while (slots[i].id != 0) i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+};
 
-//i-foormat
-uint32_t assemble_I_format(const InstructionInfo& info,const vector<string>& operands) {
-    uint32_t machineCode = 0;
-    uint32_t rd = 0, rs1 = 0;
-    long imm = 0;
-    const set<string> loadLike = {"lb", "ld", "lh", "lw", "jalr"};
-    if (loadLike.count(operands[0])) 
-    { 
-        //lw rd, imm(rs1)
-        rd  = registerToInt(operands[1]);
-        imm = stringToLong(operands[2]);
-        rs1 = registerToInt(operands[3]);
-    } 
-    else 
-    { 
-        //addi rd, rs1, imm
-        rd  = registerToInt(operands[1]);
-        rs1 = registerToInt(operands[2]);
-        imm = stringToLong(operands[3]);
+//ids of every defined label, sorted by name
+vector<uint32_t> definedLabelsByName(const LabelTable& labels) 
+{
+    vector<uint32_t> ids;
+    for (uint32_t id = 0; id < labels.size(); ++id) 
+    {
+        if (labels.addresses[id] != UNDEFINED_ADDRESS) ids.push_back(id);
     }
-    
-    uint32_t opcode = stoul(info.opcode, nullptr, 2);
-    uint32_t funct3 = stoul(info.funct3, nullptr, 2);
-    
-    machineCode |= opcode;//0-6
-    machineCode |= (rd  << 7);//7-11
-    machineCode |= (funct3 << 12);//12-14
-    machineCode |= (rs1 << 15);//15-19
-    machineCode |= (imm << 20);//20-31(imm[11:0])
-    return machineCode;
+    sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) { return labels.names[a] < labels.names[b]; });
+    return ids;
 }
 
-// S-Format
-uint32_t assemble_S_format(const InstructionInfo& info,const vector<string>& operands) 
-{
-    uint32_t machineCode = 0;
-    //[imm[11:5],rs2,rs1,funct3,imm[4:0],opcode]
-    uint32_t rs2 = registerToInt(operands[1]); // sw rs2, imm(rs1)
-    long imm= stringToLong(operands[2]);
-    uint32_t rs1 = registerToInt(operands[3]);
+//build with -DCOUNT_ALLOCATIONS to count every heap allocation, so --fuzz can check the hot
+//path makes none and --bench/--stats can report them per phase; without it nothing is
+//replaced and the counts are not kept
+#ifdef COUNT_ALLOCATIONS
+constexpr bool COUNTS_ALLOCATIONS = true;
+//per thread, so encoder threads never share the counter's cache line
+thread_local size_t heapAllocations = 0;
+//allocations made by parallelFor's worker threads, folded in when each one exits
+atomic<size_t> workerHeapAllocations{0};
 
-    uint32_t opcode = stoul(info.opcode, nullptr, 2);
-    uint32_t funct3 = stoul(info.funct3, nullptr, 2);
+void* countedAlloc(size_t size) noexcept 
+{
+    ++heapAllocations;
+    return malloc(size ? size : 1);
+}
+void* countedAlloc(size_t size, align_val_t align) noexcept 
+{
+    ++heapAllocations;
+    size_t alignment = max(static_cast<size_t>(align), sizeof(void*));
+    void* p = nullptr;
+    return posix_memalign(&p, alignment, size ? size : 1) == 0 ? p : nullptr;
+}
+template <typename... Align>
+void* countedAllocOrThrow(size_t size, Align... align) 
+{
+    if (void* p = countedAlloc(size, align...)) return p;
+    throw bad_alloc();
+}
 
-    uint32_t imm_11_5 = (imm >> 5) & 0x7F;//imm[11:5]
-    uint32_t imm_4_0  = imm & 0x1F;//imm[4:0]
-    
-    machineCode |= opcode;//0-6
-    machineCode |= (imm_4_0 << 7);//7-11 (imm[4:0])
-    machineCode |= (funct3 << 12);//12-14
-    machineCode |= (rs1 << 15);//15-19
-    machineCode |= (rs2 << 20);//20-24
-    machineCode |= (imm_11_5 << 25);//25-31 (imm[11:5])
+//every form of new and delete is replaced, so a block never reaches a free it was not malloc'd for
+void* operator new(size_t size) { return countedAllocOrThrow(size); }
+void* operator new[](size_t size) { return countedAllocOrThrow(size); }
+void* operator new(size_t size, align_val_t align) { return countedAllocOrThrow(size, align); }
+void* operator new[](size_t size, align_val_t align) { return countedAllocOrThrow(size, align); }
+void* operator new(size_t size, const nothrow_t&) noexcept { return countedAlloc(size); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return countedAlloc(size); }
+void* operator new(size_t size, align_val_t align, const nothrow_t&) noexcept { return countedAlloc(size, align); }
+void* operator new[](size_t size, align_val_t align, const nothrow_t&) noexcept { return countedAlloc(size, align); }
+//kept out of line so gcc does not pair the inlined free with new and warn
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t, align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, size_t, align_val_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, const nothrow_t&) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, const nothrow_t&) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, align_val_t, const nothrow_t&) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept { free(p); }
 
-    return machineCode;
+//allocations on this thread plus every finished worker thread
+size_t totalHeapAllocations() 
+{
+    return heapAllocations + workerHeapAllocations.load(memory_order_relaxed);
 }
+#else
+constexpr bool COUNTS_ALLOCATIONS = false;
+#endif
 
+//one timed span of work, see TraceLog
+struct TraceEvent 
+{
+    const char* name;
+    int thread;       //parallelFor worker index, 0 is the main thread
+    int64_t begin;    //microseconds since the log started
+    int64_t duration;
+    size_t items;     //lines, bytes, ... the span worked on, 0 if it has no count
+};
 
-// SB-Format
-uint32_t assemble_SB_format(const InstructionInfo& info,const vector<string>& operands, long currentAddress, const map<string, long>& symbolTable) 
+//--stats / --trace: spans of work per thread, one per phase and per chunk (never per
+//line), so recording is a clock read and a short locked push per chunk; with both
+//options off a span costs one test of `enabled`
+//the log is process wide like the heap counter, spans from any thread land in it
+struct TraceLog 
 {
-    uint32_t machineCode = 0;
+    atomic<bool> enabled{false};
+    chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+    mutex lock;
+    vector<TraceEvent> events;
 
-    uint32_t rs1 = registerToInt(operands[1]);
-    uint32_t rs2 = registerToInt(operands[2]);
-    
-    string label = operands[3];
-    if (symbolTable.find(label) == symbolTable.end()) 
+    void record(const char* name, int thread, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end, size_t items) 
     {
-        cerr << "Error: Undefined label '" << label << "'" << endl;
-        return 0xDEADBEEF;
+        auto micros = [&](chrono::steady_clock::time_point at) { return chrono::duration_cast<chrono::microseconds>(at - origin).count(); };
+        lock_guard<mutex> guard(lock);
+        events.push_back({name, thread, micros(begin), micros(end) - micros(begin), items});
     }
-    long labelAddress = symbolTable.at(label);
-    long offset = labelAddress - currentAddress; 
+};
 
-    uint32_t imm_12 = (offset >> 12) & 1;// imm[12]
-    uint32_t imm_11 = (offset >> 11) & 1;// imm[11]
-    uint32_t imm_10_5 = (offset >> 5) & 0x3F;// imm[10:5]
-    uint32_t imm_4_1 = (offset >> 1) & 0xF;// imm[4:1]
+TraceLog traceLog;
+//parallelFor worker index of this thread, for the trace
+thread_local int traceThread = 0;
 
-    uint32_t opcode = stoul(info.opcode, nullptr, 2);
-    uint32_t funct3 = stoul(info.funct3, nullptr, 2);
+//times the enclosing scope into traceLog, set items before it ends to record a count
+class TraceSpan 
+{
+public:
+    explicit TraceSpan(const char* name, size_t items = 0) : name(name), items(items) 
+    {
+        if (traceLog.enabled.load(memory_order_relaxed)) begin = chrono::steady_clock::now();
+    }
+    ~TraceSpan() { finish(); }
+    //end the span before the scope does
+    void finish() 
+    {
+        if (begin == chrono::steady_clock::time_point()) return;
+        traceLog.record(name, traceThread, begin, chrono::steady_clock::now(), items);
+        begin = chrono::steady_clock::time_point();
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
 
-    machineCode |= opcode;//0-6
-    machineCode |= (imm_11 << 7);//7 (imm[11])
-    machineCode |= (imm_4_1 << 8);//8-11 (imm[4:1])
-    machineCode |= (funct3 << 12);//12-14
-    machineCode |= (rs1 << 15);//15-19
-    machineCode |= (rs2 << 20);//20-24
-    machineCode |= (imm_10_5 << 25);//25-30 (imm[10:5])
-    machineCode |= (imm_12 << 31);//31 (imm[12])
+    const char* name;
+    size_t items;
+private:
+    chrono::steady_clock::time_point begin{};
+};
 
-    return machineCode;
+//remove leading spaces
+string_view ltrim(string_view s) 
+{
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.front()))) s.remove_prefix(1);
+    return s;
 }
 
-//u-format(lui, auipc)
-uint32_t assemble_U_format(const InstructionInfo& info, const vector<string>& operands) {
-    uint32_t machineCode = 0;
+//remove trailing spaces
+string_view rtrim(string_view s) 
+{
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.back()))) s.remove_suffix(1);
+    return s;
+}
 
-    uint32_t rd  = registerToInt(operands[1]);
-    long imm= stringToLong(operands[2]);
-    uint32_t opcode = stoul(info.opcode, nullptr, 2);
-    
-    machineCode |= opcode;//0-6
-    machineCode |= (rd << 7);//7-11
-    machineCode |= (imm << 12);//12-31 (imm[31:12])
-    
-    return machineCode;
+string_view trim(string_view s) 
+{
+    return ltrim(rtrim(s));
 }
 
-//UJ-Format (jal)
-uint32_t assemble_UJ_format(const InstructionInfo& info, const vector<string>& operands, long currentAddress, const map<string, long>& symbolTable) 
+//first '#' outside a string or char literal, npos if the line has no comment
+size_t commentStart(string_view line) 
 {
-    uint32_t machineCode = 0;
-    uint32_t rd = registerToInt(operands[1]);
-    string label = operands[2];
-     if (symbolTable.find(label) == symbolTable.end()) 
-     {
-        cerr << "Error: Undefined label '" << label << "'" << endl;
-        return 0xDEADBEEF;
+    size_t hash = line.find('#');
+    //only a quote before the '#' can hide it
+    if (hash == string_view::npos || line.find_first_of("\"'") > hash) return hash;
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); ++i) 
+    {
+        char c = line[i];
+        if (quote && c == '\\') ++i;
+        else if (quote) quote = c == quote ? 0 : quote;
+        else if (c == '"' || c == '\'') quote = c;
+        else if (c == '#') return i;
     }
-    long labelAddress = symbolTable.at(label);
-    long offset = labelAddress - currentAddress; 
-
-    uint32_t imm_20 = (offset >> 20) & 1;//imm[20]
-    uint32_t imm_19_12 = (offset >> 12) & 0xFF;//imm[19:12]
-    uint32_t imm_11 = (offset >> 11) & 1;     // imm[11]
-    uint32_t imm_10_1 = (offset >> 1) & 0x3FF;  // imm[10:1]
-    
-    uint32_t opcode = stoul(info.opcode, nullptr, 2);
-
-    machineCode |= opcode;//0-6
-    machineCode |= (rd << 7);//7-11
-    machineCode |= (imm_19_12 << 12);//12-19 (imm[19:12])
-    machineCode |= (imm_11 << 20);//20 (imm[11])
-    machineCode |= (imm_10_1 << 21);//21-30 (imm[10:1])
-    machineCode |= (imm_20 << 31);//31 (imm[20])
-    
-    return machineCode;
+    return string_view::npos;
 }
 
-//to stores the offset for branch/jump inst
-long lastOffset = 0; 
-uint32_t assemble(const InstructionInfo& info, const vector<string>& operands, long currentAddress, const map<string, long>& symbolTable) 
+string_view cleanLine(string_view line) 
 {
-   
-   //lastOFfset stores the branch/jump target offset 
-   lastOffset = 0; //reset offset
-    switch (info.format) 
+    size_t commentPos = commentStart(line); //find comments
+    if (commentPos != string_view::npos) 
     {
-        case InstructionInfo::Format::R:
-            return assemble_R_format(info, operands);
-        case InstructionInfo::Format::I:
-            return assemble_I_format(info, operands);
-        case InstructionInfo::Format::S:
-            return assemble_S_format(info, operands);
-        case InstructionInfo::Format::SB:
-        {
-            string label = operands[3];
-            if (symbolTable.count(label))
-            {
-                lastOffset = symbolTable.at(label) - currentAddress;
-            }
-            return assemble_SB_format(info, operands, currentAddress, symbolTable);
-        }
-        case InstructionInfo::Format::U:
-            return assemble_U_format(info, operands);
-        case InstructionInfo::Format::UJ:
-        {
-            string label = operands[2];
-            if (symbolTable.count(label)) 
-            {
-                lastOffset = symbolTable.at(label) - currentAddress;
-            }
-            return assemble_UJ_format(info, operands, currentAddress, symbolTable);
-        }
-        default:
-            cerr << "Error:Unknown instruction format for " << operands[0] << endl;
-            return 0xDEADBEEF; // Error
+        line = line.substr(0, commentPos); //only take part befor comment starts
     }
+    return trim(line);
 }
 
-int main() 
+//operand spans of one line, stored inline so tokenizing never allocates
+constexpr size_t MAX_OPERANDS = 8;
+struct Operands 
 {
-    string inputFilename = "input.asm";
-    string outputFilename = "output.mc";
+    array<string_view, MAX_OPERANDS> tokens;
+    size_t count = 0;
 
-    //build symbol table
-    cout << "Starting Pass 1: Building Symbol Table..." << endl;
-    ifstream inputFile_pass1(inputFilename);
-    string line;
-    long currentAddress = 0x00000000;
-    long dataAddress = 0x10000000;
-    bool inTextSegment = true;
+    //missing operands read as empty instead of running off the end
+    string_view operator[](size_t i) const { return i < count ? tokens[i] : string_view(); }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+};
+
+//abi register names
+#define RISCV_REGISTER_NAMES(X) \
+    X(zero, 0) X(ra, 1) X(sp, 2) X(gp, 3) X(tp, 4) \
+    X(t0, 5) X(t1, 6) X(t2, 7) \
+    X(s0, 8) X(fp, 8) X(s1, 9) \
+    X(a0, 10) X(a1, 11) X(a2, 12) X(a3, 13) X(a4, 14) X(a5, 15) X(a6, 16) X(a7, 17) \
+    X(s2, 18) X(s3, 19) X(s4, 20) X(s5, 21) X(s6, 22) X(s7, 23) X(s8, 24) X(s9, 25) \
+    X(s10, 26) X(s11, 27) \
+    X(t3, 28) X(t4, 29) X(t5, 30) X(t6, 31)
 
-    if (!inputFile_pass1.is_open()) 
+//-1 for anything that is not x0..x31 or an abi name
+int registerToInt(string_view reg) 
+{
+    if (reg.size() > 1 && reg[0] == 'x') 
     {
-        cerr << "Error:Could not open input file " << inputFilename << endl;
-        return 1;
+        // numeric register like x5
+        int num = -1;
+        auto [ptr, ec] = from_chars(reg.data() + 1, reg.data() + reg.size(), num);
+        return ec == errc() && ptr == reg.data() + reg.size() && num >= 0 && num < 32 ? num : -1;
     }
 
-    while (getline(inputFile_pass1, line)) 
-    {
-        line = cleanLine(line);
-        if (line == ".data") 
-        { inTextSegment = false; 
-            continue; }
-        if (line == ".text") 
-        { inTextSegment = true; 
-            continue; }
-        size_t colon = line.find(':');
-        //label found or not
-        //if found,put it in symbol table with current address/data address
-        if (colon != string::npos) 
-        {
-            string label = line.substr(0, colon);
-            label = trim(label);
-            symbolTable[label] = inTextSegment ? currentAddress: dataAddress;
-            line = line.substr(colon + 1);
-            line = trim(line);
-        }
-        if (line.empty()) continue; 
-        if (inTextSegment) 
-        {
-            currentAddress += 4;
-        } 
-        //if inside data segment
-        else 
-        {
-            vector<string> operands = parseOperands(line);
-            if (operands.empty()) continue;
-            string directive = operands[0];
-            //update data address based on directive
-            if (directive == ".byte") dataAddress += 1;
-            else if (directive == ".half") dataAddress += 2;
-            else if (directive == ".word") dataAddress += 4;
-            else if (directive == ".dword") dataAddress += 8;
-            else if (directive == ".asciz") 
-            {
-                size_t firstQuote = line.find('\"');
-                size_t lastQuote = line.rfind('\"');
-                if (firstQuote != string::npos && lastQuote != string::npos && firstQuote != lastQuote) {
-                    string strData = line.substr(firstQuote + 1, lastQuote - firstQuote - 1);
-                    dataAddress += strData.length() + 1;
-                }
-            }
-        }
-    }
-    inputFile_pass1.close();
-    cout << "Pass 1 complete. Symbol Table:" << endl;
-    for (const auto& [label, address]: symbolTable) {
-        cout << "  " << label << ": " << Hexa(address, 0) << endl;
+    //same hash switch as findInstruction, so no table to build at startup
+    switch (mnemonicHash(reg)) 
+    {
+#define X(name, num) case mnemonicHash(#name): return reg == #name ? num : -1;
+        RISCV_REGISTER_NAMES(X)
+#undef X
     }
+    return -1;
+}
 
-    //generate machine Code
-    cout << "Starting Pass 2: Generating Machine Code..." << endl;
-    ifstream inputFile_pass2(inputFilename);
-    ofstream outputFile(outputFilename);
-    
-    if (!inputFile_pass2.is_open() || !outputFile.is_open()) {
-        cerr << "Error:cant open input/output files for Pass 2" << endl;
-        return 1;
+//blanks between the tokens of a line
+constexpr bool isBlank(char c) 
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f' || c == '\n';
+}
+
+//the byte of the escape sequence \c in a char or string literal, -1 if c starts none
+//(\xNN is only read in strings, see decodeString)
+int escapeValue(char c) 
+{
+    switch (c) 
+    {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case '0': return 0;
+        case '\\': case '\'': case '"': return c;
+        default: return -1;
     }
+}
 
-    currentAddress = 0x00000000; //reset text address
-    inTextSegment = true;//start by assuming we are in .text
-
-    while (getline(inputFile_pass2, line)) {
-        string cleaned = cleanLine(line);
-        if (cleaned == ".data") { inTextSegment = false; continue; }
-        if (cleaned == ".text") { inTextSegment = true; continue; }
-
-        //remove labels
-        if (cleaned.find(':') != string::npos)
-         {
-            cleaned = cleaned.substr(cleaned.find(':') + 1);
-            cleaned = trim(cleaned);
-        }
-        if (cleaned.empty()) continue;
-
-        if (inTextSegment)
-         { //only process lines if we're in .text
-            //seperate the instruction operation and operands
-            vector<string> operands = parseOperands(cleaned);
-            if (operands.empty()) continue;
-            //get instruction name that would be first element of operands
-            string instName = operands[0];
-
-
-            if (instructionMap.count(instName))
-             {
-                //get machine code
-                uint32_t machineCode = assemble(instructionMap[instName], operands, currentAddress, symbolTable);
-                //get compressed assembly string
-                string compressedAsm = getCompressedAssembly(operands);
-                //get debug string
-                string debugString = getDebugString(instructionMap[instName], operands, lastOffset);
-
-                //write to output file
-                outputFile << Hexa(currentAddress, 0) << " " << Hexa(machineCode, 8) << " , " << compressedAsm << " " << debugString << endl;
-                
-                //next instruction address
-                currentAddress += 4;
-            } 
-            else 
+//the bytes a string literal's text stands for, escapes decoded (\n \t \r \0 \\ \" \' and
+//\xNN with one or two hex digits; any other \c is c); writes them to out unless it is null
+//and returns how many there are, so sizing and emitting read the text the same way
+size_t decodeString(string_view text, uint8_t* out) 
+{
+    size_t size = 0;
+    for (size_t i = 0; i < text.size(); ++size) 
+    {
+        uint8_t byte = static_cast<uint8_t>(text[i++]);
+        if (byte == '\\' && i < text.size()) 
+        {
+            char c = text[i++];
+            int value = escapeValue(c);
+            if (c == 'x' && i < text.size() && isxdigit(static_cast<unsigned char>(text[i]))) 
             {
-                cerr << "warning-skipping unknown instruction '" << instName << "'" << endl;
+                value = 0;
+                for (int k = 0; k < 2 && i < text.size() && isxdigit(static_cast<unsigned char>(text[i])); ++k, ++i) 
+                {
+                    value = value * 16 + (isdigit(static_cast<unsigned char>(text[i])) ? text[i] - '0' : (text[i] | 0x20) - 'a' + 10);
+                }
             }
+            byte = static_cast<uint8_t>(value >= 0 ? value : c);
         }
+        if (out) out[size] = byte;
     }
+    return size;
+}
 
-    outputFile << Hexa(currentAddress, 0) << " 0xENDDC0DE" << " End of text segment" << endl;
-//data segment
-    inputFile_pass2.clear(); //clear the End-of-File flag
-    inputFile_pass2.seekg(0); //rewind the file to the beginning
-    
-    //now we will work on the data segment
-
-    dataAddress = 0x10000000; //reset data address
-    inTextSegment = true;     //reset flag to find the .data directive
-    bool wroteDataHeader = false;
+//one past the char literal whose quote is at i ('a', '\n')
+size_t charLiteralEnd(string_view line, size_t i) 
+{
+    i += i + 1 < line.size() && line[i + 1] == '\\' ? 3 : 2;
+    return i < line.size() && line[i] == '\'' ? i + 1 : min(i, line.size());
+}
 
-    while (getline(inputFile_pass2, line)) 
+//one past the ')' that closes the '(' at i, the line end if none does
+size_t groupEnd(string_view line, size_t i) 
+{
+    int depth = 0;
+    while (i < line.size()) 
     {
-        string cleaned = cleanLine(line);
-
-        if (cleaned == ".data") { inTextSegment = false; continue; }
-        if (cleaned == ".text") { inTextSegment = true; continue; }
-        //remove labels
-        if (cleaned.find(':') != string::npos) 
+        char c = line[i];
+        if (c == '\'') 
         {
-            cleaned = cleaned.substr(cleaned.find(':') + 1);
-            cleaned = trim(cleaned);
+            i = charLiteralEnd(line, i);
+            continue;
         }
-        if (cleaned.empty()) continue;
+        ++i;
+        if (c == '(') ++depth;
+        else if (c == ')' && --depth == 0) return i;
+    }
+    return i;
+}
 
-        if (!inTextSegment)
-         { //process lines if we're in .data
-            
-            //add a line to separate text and data segment
-            if (!wroteDataHeader) 
-            {
-                outputFile << endl; // Add a blank line for spacing
-                wroteDataHeader = true;
+//the '(' at i holds a base register, as in (a0) or 0(x2)
+bool opensRegister(string_view line, size_t i) 
+{
+    size_t close = line.find(')', i);
+    return close != string_view::npos && registerToInt(trim(line.substr(i + 1, close - i - 1))) >= 0;
+}
+
+//what valueEnd needs to know of a character, as bits
+enum : uint8_t 
+{
+    VALUE_BREAK = 1,     //blanks, ',', parentheses and the char literal quote
+    VALUE_BLANK = 2,
+    VALUE_BINARY = 4,    //an operator that joins the values around it, + and - only with a blank after
+    VALUE_OPERATOR = 8   //any operator, a value ending in one goes on
+};
+
+constexpr array<uint8_t, 256> makeValueChars() 
+{
+    array<uint8_t, 256> chars{};
+    for (unsigned char c : {' ', '\t', '\r', '\v', '\f', '\n'}) chars[c] = VALUE_BREAK | VALUE_BLANK;
+    for (unsigned char c : {',', '(', ')', '\''}) chars[c] = VALUE_BREAK;
+    for (unsigned char c : {'*', '/', '%', '&', '|', '^', '<', '>'}) chars[c] = VALUE_BINARY | VALUE_OPERATOR;
+    for (unsigned char c : {'+', '-', '~'}) chars[c] = VALUE_OPERATOR;
+    return chars;
+}
+
+constexpr auto valueChars = makeValueChars();
+
+inline uint8_t valueChar(char c) { return valueChars[static_cast<unsigned char>(c)]; }
+
+//end of the operand or data value starting at i, i itself if a separator is there
+//a value may be an expression, so a char literal, a parenthesised group and a blank next
+//to a binary operator do not end it: `N * 4` is one value, `.word 1 -2` still two
+//with operandParens, a '(' after a value or around a register (0(x2), (a0), %hi(sym))
+//separates like ',' and so does ')'
+size_t valueEnd(string_view line, size_t i, bool operandParens) 
+{
+    size_t start = i;
+    while (i < line.size()) 
+    {
+        //most characters of a line are none of the ones below
+        while (i < line.size() && !(valueChar(line[i]) & VALUE_BREAK)) ++i;
+        if (i == line.size()) break;
+        char c = line[i];
+        if (c == '\'') 
+        {
+            i = charLiteralEnd(line, i);
+        }
+        else if (c == '(') 
+        {
+            bool group = !operandParens || ((i == start || (valueChar(line[i - 1]) & VALUE_OPERATOR)) && !opensRegister(line, i));
+            if (!group) break;
+            i = groupEnd(line, i);
+        }
+        else if (c == ',' || (c == ')' && operandParens)) 
+        {
+            break;
+        }
+        else if (c == ')') 
+        {
+            ++i;
+        }
+        else 
+        {
+            if (i == start) break;
+            size_t next = i;
+            while (next < line.size() && (valueChar(line[next]) & VALUE_BLANK)) ++next;
+            if (next == line.size()) break;
+            //'+'/'-' only join when a blank follows them too, otherwise they are a sign
+            char d = line[next];
+            bool sign = (d == '+' || d == '-') && next + 1 < line.size() && (valueChar(line[next + 1]) & VALUE_BLANK);
+            if (!(valueChar(d) & VALUE_BINARY) && !sign && !(valueChar(line[i - 1]) & VALUE_OPERATOR)) break;
+            i = next;
+        }
+    }
+    return i;
+}
+
+//splits a line into meaningful tokens
+//tokens past MAX_OPERANDS are dropped, no instruction uses that many
+void parseOperands(string_view line, Operands& operands) 
+{
+    operands.count = 0;
+    size_t i = 0;
+    while (i < line.size() && operands.count < MAX_OPERANDS) 
+    {
+        //punctuation works as a separator, so does a '(' that valueEnd does not take in
+        char c = line[i];
+        size_t end = (valueChar(c) & VALUE_BLANK) || c == ',' || c == ')' ? i : valueEnd(line, i, true);
+        if (end == i) 
+        {
+            ++i;
+            continue;
+        }
+        operands.tokens[operands.count++] = line.substr(i, end - i);
+        i = end;
+    }
+}
+
+//check if no. in hex or dec and convert to long
+//false (value untouched) when the text is not a number or does not fit
+bool stringToLong(string_view s, long& value) 
+{
+    const char* first = s.data();
+    const char* last = s.data() + s.size();
+    bool negative = first != last && *first == '-';
+    if (negative || (first != last && *first == '+')) ++first;
+    int base = 10;
+    if (last - first > 2 && first[0] == '0' && (first[1] == 'x' || first[1] == 'X')) 
+    {
+        first += 2;
+        base = 16;
+    }
+    unsigned long magnitude = 0;
+    auto [ptr, ec] = from_chars(first, last, magnitude, base);
+    if (ec != errc() || ptr != last) return false;
+    value = negative ? static_cast<long>(0 - magnitude) : static_cast<long>(magnitude);
+    return true;
+}
+
+//why an immediate expression has no value
+enum class ExpressionError : uint8_t 
+{
+    None,
+    Syntax,       //not an expression
+    Undefined,    //a name that is neither a constant nor a defined label
+    Divide,       //division or remainder by zero
+    ShiftRange,   //a shift count outside 0..63
+    BadConstant,  //a constant that has no value itself
+    Pending,      //a constant not worked out yet, only while constants are resolved
+    NeedsLayout,  //a label or '.' before pass 1 placed the lines
+    Moves         //link mode: a label address the link still moves
+};
+
+//why an operand could not be encoded
+enum class OperandError : uint8_t { None, BadRegister, BadNumber, BadCsr, BadFence, BadExpression, OutOfRange, Unclosed, Unexpected };
+
+//first operand of a line that could not be encoded: the encoders put 0 in its place and
+//carry on, the caller reports it with its line and column
+struct OperandStatus 
+{
+    OperandError error = OperandError::None;
+    string_view operand;
+    ExpressionError expression = ExpressionError::None;  //BadExpression: why
+    string_view symbol;                                  //and the name it stopped at
+    long value = 0, low = 0, high = 0;                   //OutOfRange: the value and its range
+
+    bool failed() const { return error != OperandError::None; }
+    void fail(OperandError why, string_view what) 
+    {
+        if (failed()) return;
+        error = why;
+        operand = what;
+    }
+    void failExpression(ExpressionError why, string_view what, string_view name) 
+    {
+        if (failed()) return;
+        fail(OperandError::BadExpression, what);
+        expression = why;
+        symbol = name;
+    }
+    void failRange(string_view what, long number, long from, long to) 
+    {
+        if (failed()) return;
+        fail(OperandError::OutOfRange, what);
+        value = number;
+        low = from;
+        high = to;
+    }
+};
+
+uint32_t readRegister(string_view operand, OperandStatus& status) 
+{
+    int reg = registerToInt(operand);
+    if (reg >= 0) return static_cast<uint32_t>(reg);
+    //the tokenizer only leaves a '(' in front of a register it found no ')' for: 4(x2
+    if (!operand.empty() && operand[0] == '(') status.fail(OperandError::Unclosed, operand.substr(0, 1));
+    else status.fail(OperandError::BadRegister, operand);
+    return 0;
+}
+
+long readNumber(string_view operand, OperandStatus& status) 
+{
+    long value = 0;
+    if (!stringToLong(operand, value)) status.fail(OperandError::BadNumber, operand);
+    return value;
+}
+
+//csr names taken where a csr number goes: the counters and the machine-mode registers
+#define RISCV_CSR_NAMES(X) \
+    X(cycle, 0xC00) X(time, 0xC01) X(instret, 0xC02) \
+    X(mstatus, 0x300) X(misa, 0x301) X(mie, 0x304) X(mtvec, 0x305) \
+    X(mscratch, 0x340) X(mepc, 0x341) X(mcause, 0x342) X(mtval, 0x343) X(mip, 0x344) \
+    X(mhartid, 0xF14)
+
+//csr number of a name or a number, 0 and status set if it is neither
+long readCsr(string_view operand, OperandStatus& status) 
+{
+    switch (mnemonicHash(operand)) 
+    {
+#define X(name, num) case mnemonicHash(#name): if (operand == #name) return num; break;
+        RISCV_CSR_NAMES(X)
+#undef X
+    }
+    long value = 0;
+    if (!stringToLong(operand, value)) status.fail(OperandError::BadCsr, operand);
+    return value;
+}
+
+//name of a csr number, nullptr if it has none
+const char* csrName(long number) 
+{
+    switch (number) 
+    {
+#define X(name, num) case num: return #name;
+        RISCV_CSR_NAMES(X)
+#undef X
+    }
+    return nullptr;
+}
+
+//fence predecessor/successor set, i/o/r/w as bits 3..0 ("0" is the empty set)
+long readFenceSet(string_view operand, OperandStatus& status) 
+{
+    long set = 0;
+    for (char c : operand) 
+    {
+        long bit = c == 'i' ? 8 : c == 'o' ? 4 : c == 'r' ? 2 : c == 'w' ? 1 : 0;
+        if (bit == 0 || (set & bit)) 
+        {
+            set = -1;
+            break;
+        }
+        set |= bit;
+    }
+    if (operand == "0") return 0;
+    if (set <= 0) 
+    {
+        status.fail(OperandError::BadFence, operand);
+        return 0;
+    }
+    return set;
+}
+
+//fence set as text, the reverse of readFenceSet; out needs 5 chars
+char* writeFenceSet(char* out, long set) 
+{
+    if (set == 0) *out++ = '0';
+    for (int bit = 3; bit >= 0; --bit) 
+    {
+        if (set & (1 << bit)) *out++ = "wroi"[bit];
+    }
+    return out;
+}
+
+//append "0x" and value in uppercase hex, zero padded to num_chars digits (0 = no padding)
+//nibbles go through a lookup table into a fixed buffer, so nothing is allocated
+void appendHex(string& out, uint64_t value, int num_chars = 0) 
+{
+    static constexpr char digits[] = "0123456789ABCDEF";
+    char buffer[18];
+    char* end = buffer + sizeof(buffer);
+    char* p = end;
+    do 
+    {
+        *--p = digits[value & 0xF];
+        value >>= 4;
+    } while (value != 0 || end - p < num_chars);
+    *--p = 'x';
+    *--p = '0';
+    out.append(p, end - p);
+}
+
+// Converts 64-bit integer to a hex string with custom pading
+string Hexa(uint64_t value, int num_chars = 0) { // Default to 0
+    string text;
+    appendHex(text, value, num_chars);
+    return text;
+}
+
+//the operand spans back to assembly string
+//eg lw rd,imm(rs1) / add rd,rs1,rs2 / amoadd.w rd,rs2,(rs1)
+void appendCompressedAssembly(string& out, const InstructionInfo& info, const Operands& operands) 
+{
+    out += operands[0];
+    if (operands.size() == 1) return;  //ecall, fence
+    out += ' ';
+    out += operands[1];
+    if (hasMemoryOperand(info)) 
+    {
+        //eg lw rd,imm(rs1) / sw rs2,imm(rs1), only the imm is left out before the parenthesis
+        for (size_t i = 2; i <= 3 && i < operands.size(); ++i) 
+        {
+            bool base = i == info.slots.rs1;
+            if (!base || i - 1 != info.slots.imm) out += ',';
+            //an unclosed base keeps its '(' and is listed as written
+            bool wrap = base && (operands[i].empty() || operands[i][0] != '(');
+            if (wrap) out += '(';
+            out += operands[i];
+            if (wrap) out += ')';
+        }
+        return;
+    }
+
+    // Default r-type,i type,sb-type,jal
+    for (size_t i = 2; i < operands.size(); ++i) 
+    {
+        out += ',';
+        out += operands[i];
+    }
+}
+
+//low `width` bits of value as 0/1 characters, msb first
+void appendBits(string& out, uint64_t value, int width) 
+{
+    for (int bit = width - 1; bit >= 0; --bit) 
+    {
+        out += ((value >> bit) & 1) ? '1' : '0';
+    }
+}
+
+//"# opcode-funct3-funct7-" part of the debug string, fixed per instruction
+struct DebugPrefix 
+{
+    char text[24];
+    size_t length;
+};
+
+constexpr DebugPrefix makeDebugPrefix(const InstructionInfo& info) 
+{
+    DebugPrefix prefix{};
+    size_t n = 0;
+    auto put = [&](const char* s) { while (*s) prefix.text[n++] = *s++; };
+    auto putBits = [&](uint32_t value, int width) {
+        for (int bit = width - 1; bit >= 0; --bit) prefix.text[n++] = ((value >> bit) & 1) ? '1' : '0';
+    };
+    //U and UJ have no funct3, only R has a funct7
+    bool hasFunct3 = info.format != InstructionInfo::Format::U && info.format != InstructionInfo::Format::UJ;
+    bool hasFunct7 = info.format == InstructionInfo::Format::R;
+    put("# ");
+    putBits(opcodeBits(info), 7);
+    put("-");
+    if (hasFunct3) putBits(funct3Bits(info), 3); else put("NULL");
+    put("-");
+    if (hasFunct7) putBits(funct7Bits(info), 7); else put("NULL");
+    put("-");
+    prefix.length = n;
+    return prefix;
+}
+
+template <size_t... I>
+constexpr array<DebugPrefix, sizeof...(I)> makeDebugPrefixes(index_sequence<I...>) 
+{
+    return {{ makeDebugPrefix(instructionTable[I])... }};
+}
+
+constexpr auto debugPrefixes = makeDebugPrefixes(make_index_sequence<INSN_COUNT>());
+
+//fields of one instruction, the ones its format does not have stay 0
+struct Decoded 
+{
+    const InstructionInfo* info = nullptr;  //nullptr if the word is no known instruction
+    uint32_t rd = 0, rs1 = 0, rs2 = 0;  //rs1 is the 5-bit value of a csr*i
+    long imm = 0;  //I/S sign extended, U the 20-bit field, SB/UJ the byte offset, a shift its
+                   //shamt, a csr its number, fence pred << 4 | succ, ecall/ebreak the fixed field
+};
+
+//values an immediate operand may take: 12-bit signed for I/S, 20 bits for U (written
+//unsigned or negative), a shamt 6 or 5 bits, a csr number 12 bits unsigned; false where
+//there is no operand to check (a label offset, fence sets, ecall/ebreak)
+bool immediateRange(const InstructionInfo& info, long& low, long& high) 
+{
+    using Syntax = InstructionInfo::Syntax;
+    if (labelOperandIndex(info)) return false;
+    switch (info.syntax) 
+    {
+        case Syntax::Shift: low = 0; high = 63; return true;
+        case Syntax::ShiftWord: low = 0; high = 31; return true;
+        case Syntax::Csr:
+        case Syntax::CsrImmediate: low = 0; high = 4095; return true;
+        case Syntax::Fence:
+        case Syntax::System: return false;
+        default: break;
+    }
+    switch (info.format) 
+    {
+        case InstructionInfo::Format::I:
+        case InstructionInfo::Format::S: low = -2048; high = 2047; return true;
+        case InstructionInfo::Format::U: low = -(1L << 19); high = (1L << 20) - 1; return true;
+        default: return false;
+    }
+}
+
+//the immediate the operands give: the label offset of a branch/jump, a csr by name or
+//number, a fence's two sets, a number for the rest
+long readImmediate(const InstructionInfo& info, const Operands& operands, size_t i, long offset, OperandStatus& status) 
+{
+    using Syntax = InstructionInfo::Syntax;
+    if (labelOperandIndex(info)) return offset;
+    switch (info.syntax) 
+    {
+        case Syntax::Csr:
+        case Syntax::CsrImmediate:
+            return readCsr(operands[i], status);
+        case Syntax::Fence: 
+        {
+            if (operands.size() == 1) return 0xFF;  //fence = fence iorw,iorw
+            long pred = readFenceSet(operands[1], status);
+            return pred << 4 | readFenceSet(operands[2], status);
+        }
+        default:
+            return readNumber(operands[i], status);
+    }
+}
+
+//the fields the operands give, in decodeWord's terms, so the encoders, the debug string
+//and --verify read them the same way; a bad operand reads as 0, so does one out of range
+//(the word and its listing agree on what was encoded), and the first one in operand order
+//goes into status
+Decoded readOperands(const InstructionInfo& info, const Operands& operands, long offset, OperandStatus& status) 
+{
+    Decoded fields;
+    fields.info = &info;
+    const OperandSlots& slots = info.slots;
+    for (size_t i = 1; i <= 3; ++i) 
+    {
+        if (i == slots.rd) fields.rd = readRegister(operands[i], status);
+        else if (i == slots.rs2) fields.rs2 = readRegister(operands[i], status);
+        else if (i == slots.rs1 && info.syntax == InstructionInfo::Syntax::CsrImmediate) 
+        {
+            long uimm = readNumber(operands[i], status);
+            if (uimm < 0 || uimm > 31) 
+            {
+                status.failRange(operands[i], uimm, 0, 31);
+                uimm = 0;
+            }
+            fields.rs1 = static_cast<uint32_t>(uimm);
+        }
+        else if (i == slots.rs1) fields.rs1 = readRegister(operands[i], status);
+        else if (i == slots.imm) 
+        {
+            fields.imm = readImmediate(info, operands, i, offset, status);
+            long low, high;
+            if (immediateRange(info, low, high) && (fields.imm < low || fields.imm > high)) 
+            {
+                status.failRange(operands[i], fields.imm, low, high);
+                fields.imm = 0;
+            }
+        }
+    }
+    if (info.syntax == InstructionInfo::Syntax::System) fields.imm = info.base >> 20;
+    return fields;
+}
+
+//to get the # string
+//opcode-funct3-funct7-rd-rs1-imm for I/U/UJ, opcode-funct3-funct7-rd-rs1-rs2-imm for R/S/SB
+void appendDebugString(string& out, const InstructionInfo& info, const Operands& operands, long offset = 0) 
+{
+    const DebugPrefix& prefix = debugPrefixes[&info - instructionTable];
+    out.append(prefix.text, prefix.length);
+
+    OperandStatus ignored;  //assemble() reported bad operands already, they show as 0 here too
+    Decoded fields = readOperands(info, operands, offset, ignored);
+    auto reg = [&](uint32_t r) { appendBits(out, r, 5); out += '-'; };
+    auto null = [&]() { out += "NULL-"; };
+    switch (info.format) 
+    {
+        case InstructionInfo::Format::R: // add rd, rs1, rs2
+            reg(fields.rd); reg(fields.rs1); reg(fields.rs2);
+            out += "NULL";
+            break;
+        case InstructionInfo::Format::I: // addi rd, rs1, imm / lw rd, imm(rs1)
+            reg(fields.rd); reg(fields.rs1);
+            appendBits(out, fields.imm, 12);
+            break;
+        case InstructionInfo::Format::S: // sw rs2, imm(rs1)
+            null(); reg(fields.rs1); reg(fields.rs2);
+            appendBits(out, fields.imm, 12);
+            break;
+        case InstructionInfo::Format::SB: // beq rs1, rs2, label
+            null(); reg(fields.rs1); reg(fields.rs2);
+            appendBits(out, offset, 13);
+            break;
+        case InstructionInfo::Format::U: // lui rd, imm
+            reg(fields.rd); null();
+            appendBits(out, fields.imm, 20);
+            break;
+        case InstructionInfo::Format::UJ: // jal rd, label
+            reg(fields.rd); null();
+            appendBits(out, offset, 21);
+            break;
+    }
+}
+
+//build machine code for r-format
+//(atomics put rs1 in parentheses but are R-format underneath, aq/rl stay 0)
+uint32_t assemble_R_format(const InstructionInfo& info, const Decoded& fields) {
+    uint32_t machineCode = 0;
+    //opcode/funct3/funct7 are already in place in info.base
+    machineCode |= info.base;//opcode 0-6, funct3 12-14, funct7 25-31
+    machineCode |= (fields.rd  << 7);//7-11
+    machineCode |= (fields.rs1 << 15);//15-19
+    machineCode |= (fields.rs2 << 20);//20-24
+    return machineCode;
+}
+
+//i-foormat
+//the immediate only gets the bits the instruction leaves open, a shamt stays out of
+//funct6/funct7 and ecall/ebreak keep their fixed field
+uint32_t assemble_I_format(const InstructionInfo& info, const Decoded& fields) {
+    uint32_t machineCode = 0;
+    uint32_t imm = static_cast<uint32_t>(fields.imm) & (~info.mask >> 20);
+    
+    machineCode |= info.base;//opcode 0-6, funct3 12-14
+    machineCode |= (fields.rd  << 7);//7-11
+    machineCode |= ((fields.rs1 & 0x1F) << 15);//15-19 (a csr*i value may be wider)
+    machineCode |= (imm << 20);//20-31(imm[11:0])
+    return machineCode;
+}
+
+// S-Format
+uint32_t assemble_S_format(const InstructionInfo& info, const Decoded& fields) 
+{
+    uint32_t machineCode = 0;
+    //[imm[11:5],rs2,rs1,funct3,imm[4:0],opcode]
+    uint32_t imm_11_5 = (fields.imm >> 5) & 0x7F;//imm[11:5]
+    uint32_t imm_4_0  = fields.imm & 0x1F;//imm[4:0]
+    
+    machineCode |= info.base;//opcode 0-6, funct3 12-14
+    machineCode |= (imm_4_0 << 7);//7-11 (imm[4:0])
+    machineCode |= (fields.rs1 << 15);//15-19
+    machineCode |= (fields.rs2 << 20);//20-24
+    machineCode |= (imm_11_5 << 25);//25-31 (imm[11:5])
+
+    return machineCode;
+}
+
+
+// SB-Format with a known offset
+uint32_t encodeSB(const InstructionInfo& info, uint32_t rs1, uint32_t rs2, long offset) 
+{
+    uint32_t machineCode = 0;
+
+    uint32_t imm_12 = (offset >> 12) & 1;// imm[12]
+    uint32_t imm_11 = (offset >> 11) & 1;// imm[11]
+    uint32_t imm_10_5 = (offset >> 5) & 0x3F;// imm[10:5]
+    uint32_t imm_4_1 = (offset >> 1) & 0xF;// imm[4:1]
+
+    machineCode |= info.base;//opcode 0-6, funct3 12-14
+    machineCode |= (imm_11 << 7);//7 (imm[11])
+    machineCode |= (imm_4_1 << 8);//8-11 (imm[4:1])
+    machineCode |= (rs1 << 15);//15-19
+    machineCode |= (rs2 << 20);//20-24
+    machineCode |= (imm_10_5 << 25);//25-30 (imm[10:5])
+    machineCode |= (imm_12 << 31);//31 (imm[12])
+
+    return machineCode;
+}
+
+//u-format(lui, auipc)
+uint32_t assemble_U_format(const InstructionInfo& info, const Decoded& fields) {
+    uint32_t machineCode = 0;
+
+    machineCode |= info.base;//0-6
+    machineCode |= (fields.rd << 7);//7-11
+    machineCode |= (static_cast<uint32_t>(fields.imm) & 0xFFFFF) << 12;//12-31 (imm[31:12])
+    
+    return machineCode;
+}
+
+//UJ-Format (jal)
+uint32_t assemble_UJ_format(const InstructionInfo& info, const Decoded& fields) 
+{
+    uint32_t machineCode = 0;
+    long offset = fields.imm;
+
+    uint32_t imm_20 = (offset >> 20) & 1;//imm[20]
+    uint32_t imm_19_12 = (offset >> 12) & 0xFF;//imm[19:12]
+    uint32_t imm_11 = (offset >> 11) & 1;     // imm[11]
+    uint32_t imm_10_1 = (offset >> 1) & 0x3FF;  // imm[10:1]
+    
+    machineCode |= info.base;//0-6
+    machineCode |= (fields.rd << 7);//7-11
+    machineCode |= (imm_19_12 << 12);//12-19 (imm[19:12])
+    machineCode |= (imm_11 << 20);//20 (imm[11])
+    machineCode |= (imm_10_1 << 21);//21-30 (imm[10:1])
+    machineCode |= (imm_20 << 31);//31 (imm[20])
+    
+    return machineCode;
+}
+
+//offset receives the branch/jump target offset (0 for everything else),
+//so the debug string can show it without any shared state
+//target is the interned id of the label operand; an undefined label is reported by
+//encodeTextLines and encodes as offset 0
+//status receives the first operand that is no register or number where one belongs
+uint32_t assemble(const InstructionInfo& info, const Operands& operands, long currentAddress, const LabelTable& labels, uint32_t target, long& offset, OperandStatus& status) 
+{
+    offset = 0;
+    if (labelOperandIndex(info) && target != NO_LABEL && labels.addresses[target] != UNDEFINED_ADDRESS) offset = labels.addresses[target] - currentAddress;
+    Decoded fields = readOperands(info, operands, offset, status);
+    switch (info.format) 
+    {
+        case InstructionInfo::Format::R:
+            return assemble_R_format(info, fields);
+        case InstructionInfo::Format::I:
+            return assemble_I_format(info, fields);
+        case InstructionInfo::Format::S:
+            return assemble_S_format(info, fields);
+        case InstructionInfo::Format::SB:
+            return encodeSB(info, fields.rs1, fields.rs2, offset);
+        case InstructionInfo::Format::U:
+            return assemble_U_format(info, fields);
+        case InstructionInfo::Format::UJ:
+            return assemble_UJ_format(info, fields);
+    }
+    return 0; //every format returns above
+}
+
+//low `width` bits of value as a signed number
+constexpr long signExtend(uint32_t value, int width) 
+{
+    return static_cast<long>(static_cast<int64_t>(static_cast<uint64_t>(value) << (64 - width)) >> (64 - width));
+}
+
+//the reverse of assemble(): look the word up in decodeTable, then pull out its fields
+Decoded decodeWord(uint32_t word) 
+{
+    using Syntax = InstructionInfo::Syntax;
+    Decoded decoded;
+    uint8_t id = decodeTable.ids[decodeKey(word)];
+    if (id == 0) return decoded;
+    const InstructionInfo& info = instructionTable[id - 1];
+    if ((word & info.mask) != info.base) return decoded;
+    decoded.info = &info;
+    uint32_t rd = (word >> 7) & 0x1F, rs1 = (word >> 15) & 0x1F, rs2 = (word >> 20) & 0x1F;
+    switch (info.format) 
+    {
+        case InstructionInfo::Format::R:
+            decoded.rd = rd; decoded.rs1 = rs1;
+            if (info.syntax != Syntax::LoadReserved) decoded.rs2 = rs2;
+            break;
+        case InstructionInfo::Format::I:
+            decoded.rd = rd; decoded.rs1 = rs1;
+            decoded.imm = signExtend(word >> 20, 12);
+            //the syntaxes whose field is no signed immediate
+            if (info.syntax == Syntax::Shift || info.syntax == Syntax::ShiftWord) decoded.imm = (word >> 20) & (~info.mask >> 20);
+            else if (info.syntax == Syntax::Csr || info.syntax == Syntax::CsrImmediate || info.syntax == Syntax::System) decoded.imm = word >> 20;
+            else if (info.syntax == Syntax::Fence) decoded.imm = (word >> 20) & 0xFF;
+            if (info.syntax == Syntax::System || info.syntax == Syntax::Fence) decoded.rd = decoded.rs1 = 0;
+            break;
+        case InstructionInfo::Format::S:
+            decoded.rs1 = rs1; decoded.rs2 = rs2;
+            decoded.imm = signExtend((word >> 25) << 5 | ((word >> 7) & 0x1F), 12);
+            break;
+        case InstructionInfo::Format::SB:
+            decoded.rs1 = rs1; decoded.rs2 = rs2;
+            decoded.imm = signExtend((word >> 31) << 12 | ((word >> 7) & 1) << 11 | ((word >> 25) & 0x3F) << 5 | ((word >> 8) & 0xF) << 1, 13);
+            break;
+        case InstructionInfo::Format::U:
+            decoded.rd = rd;
+            decoded.imm = word >> 12;
+            break;
+        case InstructionInfo::Format::UJ:
+            decoded.rd = rd;
+            decoded.imm = signExtend((word >> 31) << 20 | ((word >> 12) & 0xFF) << 12 | ((word >> 20) & 1) << 11 | ((word >> 21) & 0x3FF) << 1, 21);
+            break;
+    }
+    return decoded;
+}
+
+//word with its immediate field set to imm the way its format lays it out (the 20-bit field
+//for U, the byte offset for SB/UJ, as decodeWord reads it back); the linker patches with it
+uint32_t withImmediate(uint32_t word, long imm) 
+{
+    const InstructionInfo* info = decodeWord(word).info;
+    uint32_t value = static_cast<uint32_t>(imm);
+    if (!info) return word;
+    switch (info->format) 
+    {
+        case InstructionInfo::Format::R:
+            return word;
+        case InstructionInfo::Format::I:
+            return (word & 0x000FFFFF) | (value & 0xFFF) << 20;
+        case InstructionInfo::Format::S:
+            return (word & 0x01FFF07F) | ((value >> 5) & 0x7F) << 25 | (value & 0x1F) << 7;
+        case InstructionInfo::Format::SB:
+            return (word & 0x01FFF07F) | ((value >> 12) & 1) << 31 | ((value >> 5) & 0x3F) << 25
+                | ((value >> 1) & 0xF) << 8 | ((value >> 11) & 1) << 7;
+        case InstructionInfo::Format::U:
+            return (word & 0xFFF) | (value & 0xFFFFF) << 12;
+        case InstructionInfo::Format::UJ:
+            return (word & 0xFFF) | ((value >> 20) & 1) << 31 | ((value >> 1) & 0x3FF) << 21
+                | ((value >> 11) & 1) << 20 | ((value >> 12) & 0xFF) << 12;
+    }
+    return word;
+}
+
+//a decoded word's fields as operands in the order its syntax writes them (registers as
+//xN, csrs by name where they have one, the rest in decimal), so they print and
+//assemble like source operands; text holds their characters
+Operands decodedOperands(const Decoded& decoded, char (&text)[MAX_OPERANDS][24]) 
+{
+    using Syntax = InstructionInfo::Syntax;
+    const InstructionInfo& info = *decoded.info;
+    Operands operands;
+    operands.tokens[operands.count++] = info.name;
+    auto put = [&](char* end) {
+        char* start = text[operands.count];
+        operands.tokens[operands.count++] = string_view(start, end - start);
+    };
+    auto number = [&](long value, bool reg) {
+        char* at = text[operands.count];
+        if (reg) *at++ = 'x';
+        put(to_chars(at, text[operands.count] + sizeof(text[0]), value).ptr);
+    };
+    const OperandSlots& slots = info.slots;
+    for (size_t i = 1; i <= 3; ++i) 
+    {
+        if (i == slots.rd) number(decoded.rd, true);
+        else if (i == slots.rs2) number(decoded.rs2, true);
+        else if (i == slots.rs1) number(decoded.rs1, info.syntax != Syntax::CsrImmediate);
+        else if (i != slots.imm) continue;
+        else if (info.syntax == Syntax::Fence) 
+        {
+            put(writeFenceSet(text[operands.count], decoded.imm >> 4));
+            put(writeFenceSet(text[operands.count], decoded.imm & 0xF));
+        }
+        else if ((info.syntax == Syntax::Csr || info.syntax == Syntax::CsrImmediate) && csrName(decoded.imm)) 
+        {
+            operands.tokens[operands.count++] = csrName(decoded.imm);
+        }
+        else number(decoded.imm, false);
+    }
+    return operands;
+}
+
+//decoded word as assembly in the listing's operand style (lw x5,-8(x6)), branch and
+//jump targets as byte offsets
+void appendDisassembly(string& out, const Decoded& decoded) 
+{
+    if (!decoded.info) 
+    {
+        out += "unknown";
+        return;
+    }
+    char text[MAX_OPERANDS][24];
+    appendCompressedAssembly(out, *decoded.info, decodedOperands(decoded, text));
+}
+
+//does the decoded word say what the operands do; offset is the branch/jump offset the
+//label means. An immediate that does not fit its field (or a register past x31) comes
+//back as something else, so it fails too
+bool decodesTo(const Decoded& decoded, const InstructionInfo& info, const Operands& operands, long offset) 
+{
+    if (decoded.info != &info) return false;
+    OperandStatus status;
+    Decoded fields = readOperands(info, operands, offset, status);
+    if (status.failed()) return false;
+    //lui/auipc take the 20 bits as written or as a negative number
+    bool immediate = decoded.imm == fields.imm
+        || (info.format == InstructionInfo::Format::U && decoded.imm - (1L << 20) == fields.imm);
+    return decoded.rd == fields.rd && decoded.rs1 == fields.rs1 && decoded.rs2 == fields.rs2 && immediate;
+}
+
+//venus memory model
+constexpr long TEXT_BASE = 0x00000000;
+constexpr long DATA_BASE = 0x10000000;
+
+//how a branch/jump whose target is out of range gets rewritten, see relaxBranches
+enum class Relaxation : uint8_t 
+{
+    None,               //the instruction as written, 4 bytes
+    BranchOverJump,     //inverted branch over `jal x0, target`, 8 bytes
+    BranchOverFarJump,  //inverted branch over `auipc x6, hi` + `jalr x0, lo(x6)`, 12 bytes
+    FarJump             //jal rd as `auipc rd, hi` + `jalr rd, lo(rd)` (x6 holds the address for jal x0), 8 bytes
+};
+
+constexpr long relaxedSize(Relaxation relaxation) 
+{
+    return relaxation == Relaxation::None ? 4 : relaxation == Relaxation::BranchOverFarJump ? 12 : 8;
+}
+
+//pseudo-instructions that stand for more than one base instruction; the one-to-one
+//aliases (mv, j, ret, bgt, ...) are rewritten while tokenizing and never show up here
+enum class Pseudo : uint8_t 
+{
+    None,
+    Li,    //li rd, value: addi, or lui/addiw followed by slli/addi pairs, see liSequence
+    La,    //la rd, label: `auipc rd, hi` + `addi rd, rd, lo`, 8 bytes
+    Call,  //call label: `auipc x1, hi` + `jalr x1, lo(x1)`, 8 bytes
+    Tail   //tail label: `auipc x6, hi` + `jalr x0, lo(x6)`, 8 bytes
+};
+
+//longest expansion of one line: li of a 64-bit value
+constexpr size_t MAX_EXPANDED_WORDS = 8;
+
+//one instruction of `li rd, value`
+struct LiStep 
+{
+    InstructionId id;  //lui, addiw, addi or slli
+    long imm;
+};
+
+//the instructions `li` builds value with, returns how many
+//32-bit values take lui + addiw (lui sign extends, addiw wraps), wider ones build the
+//upper bits the same way and shift in the rest 12 bits at a time with slli/addi pairs,
+//skipping zero runs; pass 1 sizes a li line with the same function pass 2 expands it with
+size_t liSequence(long value, LiStep (&steps)[MAX_EXPANDED_WORDS], size_t count = 0) 
+{
+    long lo = ((value & 0xFFF) ^ 0x800) - 0x800;
+    if (value == static_cast<int32_t>(value)) 
+    {
+        long hi = ((value - lo) >> 12) & 0xFFFFF;
+        if (hi) steps[count++] = {INSN_lui, hi};
+        if (lo || !hi) steps[count++] = {hi ? INSN_addiw : INSN_addi, lo};
+        return count;
+    }
+    //unsigned so value - lo cannot overflow near the ends of the range
+    long upper = static_cast<long>(static_cast<uint64_t>(value) - static_cast<uint64_t>(lo)) >> 12;
+    int shift = 12 + __builtin_ctzl(static_cast<unsigned long>(upper));
+    count = liSequence(upper >> (shift - 12), steps, count);
+    steps[count++] = {INSN_slli, shift};
+    if (lo) steps[count++] = {INSN_addi, lo};
+    return count;
+}
+
+//one tokenized source line, built once and shared by both passes
+//label/text/tokens are views into the source buffer owned by Program
+struct SourceLine 
+{
+    int lineNo;          //1-based line number in the input file
+    bool inText;         //segment the line belongs to
+    Relaxation relaxation = Relaxation::None;  //set by relaxBranches
+    Pseudo pseudo = Pseudo::None;              //set by pass 1, info is nullptr for these
+    string_view label;   //label defined on this line (empty if none)
+    string_view text;    //cleaned line with the label removed
+    size_t firstToken;   //operand span inside Program::tokens
+    size_t tokenCount;
+    long address;        //filled in by pass 1
+    long size = 0;       //data lines: bytes the directive takes (the boundary for .align), BAD_DIRECTIVE if unusable
+                         //pseudo lines: bytes the expansion takes
+    const InstructionInfo* info = nullptr; //text lines: resolved by pass 1, nullptr if unknown
+    uint32_t labelId = NO_LABEL;   //interned id of `label`
+    uint32_t targetId = NO_LABEL;  //interned id of the branch/jump target operand
+};
+
+//whole input file, mapped read-only when it is a regular file and read into
+//memory otherwise (pipes, stdin); lines and tokens are views into it
+struct SourceBuffer 
+{
+    const char* mapped = nullptr;
+    size_t mappedSize = 0;
+    string owned;
+
+    SourceBuffer() = default;
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+    ~SourceBuffer() { reset(); }
+
+    void reset() 
+    {
+        if (mapped) munmap(const_cast<char*>(mapped), mappedSize);
+        mapped = nullptr;
+        mappedSize = 0;
+        owned.clear();
+    }
+
+    string_view view() const 
+    {
+        return mapped ? string_view(mapped, mappedSize) : string_view(owned);
+    }
+};
+
+enum class Severity : uint8_t { Note, Warning, Error };
+
+//one message and the place it points at; line 0 is the whole input, column 0 the whole line
+struct Diagnostic 
+{
+    Severity severity;
+    int line;
+    int column;
+    string message;
+};
+
+//warnings and errors for the user, kept in the order they were reported and printed in
+//source order (see formatDiagnostics)
+//callers only build a message once something is wrong and nothing is formatted until it
+//is printed; past `limit` errors the messages are dropped behind one note and only the
+//count goes on, so a file full of errors costs little more than a clean one
+struct Diagnostics 
+{
+    vector<Diagnostic> entries;
+    size_t errors = 0;
+    size_t limit = 0;        //errors kept, 0 keeps them all
+    bool truncated = false;  //the note about dropped errors is out
+
+    void note(int line, int column, string message) { add(Severity::Note, line, column, move(message)); }
+    void warning(int line, int column, string message) { add(Severity::Warning, line, column, move(message)); }
+    void error(int line, int column, string message) { add(Severity::Error, line, column, move(message)); }
+    void add(Severity severity, int line, int column, string message) 
+    {
+        if (severity == Severity::Error) ++errors;
+        if (limit && errors > limit) 
+        {
+            truncate();
+            return;
+        }
+        entries.push_back({severity, line, column, move(message)});
+    }
+    //the limit is reached, later phases can stop
+    bool full() const { return limit && errors >= limit; }
+    //other's messages after ours, under our limit; errors other dropped still count
+    void append(const Diagnostics& other) 
+    {
+        size_t before = errors;
+        for (const Diagnostic& entry : other.entries) 
+        {
+            if (entry.severity != Severity::Note) add(entry.severity, entry.line, entry.column, entry.message);
+        }
+        errors = before + other.errors;
+        if (limit && errors > limit) truncate();
+    }
+    void truncate() 
+    {
+        if (truncated) return;
+        truncated = true;
+        entries.push_back({Severity::Note, 0, 0, "too many errors, stopping (--max-errors=" + to_string(limit) + ")"});
+    }
+    void clear() 
+    {
+        entries.clear();
+        errors = 0;
+        truncated = false;
+    }
+};
+
+constexpr const char* severityNames[] = {"note", "warning", "error"};
+
+//text as a JSON string, quotes included
+void appendJsonString(string& out, string_view text) 
+{
+    out += '"';
+    for (char c : text) 
+    {
+        if (c == '"' || c == '\\') 
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) 
+        {
+            static constexpr char digits[] = "0123456789abcdef";
+            out += "\\u00";
+            out += digits[(c >> 4) & 0xF];
+            out += digits[c & 0xF];
+        }
+        else out += c;
+    }
+    out += '"';
+}
+
+//indices of diagnostics.entries in source order, by line and then column whichever pass
+//reported them; a note stays right after the message it belongs to, and the line 0
+//note about dropped errors stays last
+vector<size_t> sourceOrder(const Diagnostics& diagnostics) 
+{
+    const vector<Diagnostic>& entries = diagnostics.entries;
+    vector<size_t> leaders;  //entries that start a group, the notes after one belong to it
+    for (size_t i = 0; i < entries.size(); ++i) 
+    {
+        bool trailing = entries[i].severity == Severity::Note && entries[i].line == 0;
+        if (entries[i].severity != Severity::Note || i == 0 || trailing) leaders.push_back(i);
+    }
+    stable_sort(leaders.begin(), leaders.end(), [&](size_t a, size_t b) {
+        auto key = [&](size_t i) {
+            bool trailing = entries[i].severity == Severity::Note && entries[i].line == 0;
+            return make_tuple(trailing, entries[i].line, entries[i].column);
+        };
+        return key(a) < key(b);
+    });
+    vector<size_t> order;
+    order.reserve(entries.size());
+    for (size_t leader : leaders) 
+    {
+        order.push_back(leader);
+        for (size_t i = leader + 1; i < entries.size() && entries[i].severity == Severity::Note && entries[i].line != 0; ++i) order.push_back(i);
+    }
+    return order;
+}
+
+//the messages of diagnostics in source order, one per line, as "file:line:column: error:
+//message" (the line and column only when known) or, with json, as one JSON object per line
+string formatDiagnostics(const Diagnostics& diagnostics, string_view file, bool json) 
+{
+    string out;
+    for (size_t index : sourceOrder(diagnostics)) 
+    {
+        const Diagnostic& entry = diagnostics.entries[index];
+        const char* severity = severityNames[static_cast<int>(entry.severity)];
+        if (json) 
+        {
+            out += "{\"file\":";
+            appendJsonString(out, file);
+            out += ",\"line\":" + to_string(entry.line) + ",\"column\":" + to_string(entry.column) + ",\"severity\":\"";
+            out += severity;
+            out += "\",\"message\":";
+            appendJsonString(out, entry.message);
+            out += "}\n";
+            continue;
+        }
+        out += file;
+        if (entry.line) out += ':' + to_string(entry.line);
+        if (entry.line && entry.column) out += ':' + to_string(entry.column);
+        out += ": ";
+        out += severity;
+        out += ": ";
+        out += entry.message;
+        out += '\n';
+    }
+    return out;
+}
+
+//1-based column of `at` on its line of text, 0 if `at` does not point into text (a token
+//made up along the way, like the x0 of an alias); only called once something is wrong
+int columnOf(string_view text, const char* at) 
+{
+    uintptr_t begin = reinterpret_cast<uintptr_t>(text.data()), p = reinterpret_cast<uintptr_t>(at);
+    if (p < begin || p > begin + text.size()) return 0;
+    size_t offset = p - begin;
+    size_t newline = offset ? text.rfind('\n', offset - 1) : string_view::npos;
+    return static_cast<int>(offset - (newline == string_view::npos ? 0 : newline + 1)) + 1;
+}
+
+//how the linker patches a word that refers to a symbol, see linkFiles
+enum class RelocationType : uint8_t 
+{
+    Branch,      //SB offset to the symbol
+    Jump,        //UJ offset to the symbol
+    PcRelative,  //auipc + the I-type word after it (la/call/tail, far jumps)
+    AbsoluteHi,  //%hi(symbol) in a lui
+    AbsoluteLo   //%lo(symbol) in an I or S-type immediate
+};
+
+//one word of a file assembled for linking whose value depends on where a symbol lands
+struct Relocation 
+{
+    long address;        //of the word, in the file's own layout
+    uint32_t symbol;     //label id in the file's symbols
+    RelocationType type;
+    int lineNo;          //source line, for the linker's errors
+};
+
+//value of an immediate expression, with the label addresses it adds up: the difference
+//of two labels in one segment cancels out, anything left moves when a link places the file
+struct ExpressionValue 
+{
+    long value = 0;
+    int textLabels = 0;   //.text label addresses added minus subtracted
+    int dataLabels = 0;   //same for .data
+    bool scaled = false;  //a label address went through anything but + and -
+
+    bool movesInLink() const { return textLabels || dataLabels || scaled; }
+};
+
+//one .equ/.set constant; worked out before pass 1 when it needs no label, so it can size
+//lines, and once pass 1 has placed every line otherwise
+struct Constant 
+{
+    enum class State : uint8_t { Pending, Known, NeedsLayout, Failed };
+
+    string_view expression;  //view into the source
+    int lineNo = 0;
+    int column = 0;          //of the expression
+    long address = 0;        //of its own line, for '.'
+    bool inText = true;
+    State state = State::Pending;
+    ExpressionValue value;
+};
+
+//.equ/.set constants, by interned name
+struct ConstantTable 
+{
+    LabelTable names;
+    vector<Constant> entries;  //by name id
+
+    void clear() 
+    {
+        names.clear();
+        entries.clear();
+    }
+};
+
+enum class ExpressionOp : uint8_t 
+{
+    Number, Symbol, Here,  //push a value
+    Negate, Not,           //unary
+    Multiply, Divide, Remainder, Add, Subtract, ShiftLeft, ShiftRight, And, Xor, Or
+};
+
+//one step of a compiled expression, run on a value stack
+struct ExpressionStep 
+{
+    ExpressionOp op;
+    uint32_t begin = 0, length = 0;  //Symbol: the name's span in the expression text
+    long value = 0;                  //Number
+};
+
+//deepest value stack a compiled expression may need
+constexpr size_t MAX_EXPRESSION_DEPTH = 32;
+
+//an expression in postfix order, compiled once per distinct text; names stay spans of the
+//text, so any identical text resolves them against its own program
+struct CompiledExpression 
+{
+    string text;
+    vector<ExpressionStep> steps;
+    bool valid = false;
+};
+
+//recursive descent over an expression with C's operators and precedence: unary - ~ +,
+//then * / %, + -, << >>, &, ^, |; operands are numbers (decimal, 0x, 0b), char
+//literals, parenthesised groups, names and '.'
+struct ExpressionCompiler 
+{
+    string_view text;
+    vector<ExpressionStep>& steps;
+    size_t pos = 0;
+    size_t depth = 0, maxDepth = 0;  //value stack the steps need
+    int nesting = 0;
+    bool ok = true;
+
+    char peek() 
+    {
+        while (pos < text.size() && isBlank(text[pos])) ++pos;
+        return pos < text.size() ? text[pos] : 0;
+    }
+
+    void push(ExpressionStep step) 
+    {
+        if (step.op <= ExpressionOp::Here) maxDepth = max(maxDepth, ++depth);
+        else if (step.op > ExpressionOp::Not) --depth;
+        steps.push_back(step);
+    }
+
+    //binary operator at pos, its precedence (higher binds tighter), 0 if there is none
+    int binaryOperator(ExpressionOp& op, size_t& length) 
+    {
+        char c = peek();
+        char d = pos + 1 < text.size() ? text[pos + 1] : 0;
+        length = 1;
+        switch (c) 
+        {
+            case '*': op = ExpressionOp::Multiply; return 6;
+            case '/': op = ExpressionOp::Divide; return 6;
+            case '%': op = ExpressionOp::Remainder; return 6;
+            case '+': op = ExpressionOp::Add; return 5;
+            case '-': op = ExpressionOp::Subtract; return 5;
+            case '<': length = 2; op = ExpressionOp::ShiftLeft; return d == '<' ? 4 : 0;
+            case '>': length = 2; op = ExpressionOp::ShiftRight; return d == '>' ? 4 : 0;
+            case '&': op = ExpressionOp::And; return 3;
+            case '^': op = ExpressionOp::Xor; return 2;
+            case '|': op = ExpressionOp::Or; return 1;
+        }
+        return 0;
+    }
+
+    void expression(int minimum) 
+    {
+        unary();
+        ExpressionOp op;
+        size_t length;
+        for (int precedence; ok && (precedence = binaryOperator(op, length)) >= minimum && precedence; ) 
+        {
+            pos += length;
+            expression(precedence + 1);
+            push({op});
+        }
+    }
+
+    void unary() 
+    {
+        //deep nesting is a bad expression, not a deep stack
+        if (++nesting > 64) ok = false;
+        char c = peek();
+        if (!ok) return;
+        if (c == '-' || c == '~' || c == '+') 
+        {
+            ++pos;
+            unary();
+            if (c != '+') push({c == '-' ? ExpressionOp::Negate : ExpressionOp::Not});
+        }
+        else operand();
+        --nesting;
+    }
+
+    void operand() 
+    {
+        char c = peek();
+        size_t start = pos;
+        auto isName = [](char ch, bool first) {
+            return isalpha(static_cast<unsigned char>(ch)) || ch == '_' || ch == '.' || ch == '$'
+                || (!first && isdigit(static_cast<unsigned char>(ch)));
+        };
+        if (c == '(') 
+        {
+            ++pos;
+            expression(1);
+            if (peek() != ')') ok = false;
+            ++pos;
+        }
+        else if (c == '\'') 
+        {
+            size_t end = charLiteralEnd(text, pos);
+            string_view literal = text.substr(pos + 1, end - pos - 2);
+            long value = literal.size() == 1 ? static_cast<unsigned char>(literal[0]) : -1;
+            if (literal.size() == 2 && literal[0] == '\\') value = escapeValue(literal[1]);
+            if (end > text.size() || text[end - 1] != '\'' || value < 0) ok = false;
+            push({ExpressionOp::Number, 0, 0, value});
+            pos = end;
+        }
+        else if (isdigit(static_cast<unsigned char>(c))) 
+        {
+            while (pos < text.size() && isName(text[pos], false)) ++pos;
+            string_view digits = text.substr(start, pos - start);
+            int base = 10;
+            if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X' || digits[1] == 'b' || digits[1] == 'B')) 
+            {
+                base = digits[1] == 'x' || digits[1] == 'X' ? 16 : 2;
+                digits.remove_prefix(2);
+            }
+            unsigned long value = 0;
+            auto [ptr, ec] = from_chars(digits.data(), digits.data() + digits.size(), value, base);
+            if (ec != errc() || ptr != digits.data() + digits.size()) ok = false;
+            push({ExpressionOp::Number, 0, 0, static_cast<long>(value)});
+        }
+        else if (c && isName(c, true)) 
+        {
+            while (pos < text.size() && isName(text[pos], false)) ++pos;
+            if (pos - start == 1 && c == '.') push({ExpressionOp::Here});
+            else push({ExpressionOp::Symbol, static_cast<uint32_t>(start), static_cast<uint32_t>(pos - start)});
+        }
+        else ok = false;
+    }
+};
+
+//text compiled to postfix steps, cached by text; each thread has its own cache, so
+//pass 2's workers never wait on each other, and a lookup of a cached text allocates nothing
+const CompiledExpression& compileExpression(string_view text) 
+{
+    thread_local unordered_map<uint32_t, CompiledExpression> cache;
+    uint32_t hash = mnemonicHash(text);
+    auto found = cache.find(hash);
+    if (found != cache.end() && found->second.text == text) return found->second;
+    //generated sources can have any number of distinct expressions
+    if (cache.size() >= 65536) cache.clear();
+    //a hash collision just replaces the older text
+    CompiledExpression& compiled = cache[hash];
+    compiled.text = text;
+    compiled.steps.clear();
+    ExpressionCompiler compiler{text, compiled.steps};
+    compiler.expression(1);
+    compiled.valid = compiler.ok && compiler.peek() == 0 && compiler.maxDepth <= MAX_EXPRESSION_DEPTH;
+    return compiled;
+}
+
+//.incbin files by path, read once when pass 1 sizes the line and copied from the same
+//bytes by pass 2; a file that cannot be read stays nullptr, so it is not tried again
+struct IncludedFiles 
+{
+    const SourceBuffer* open(string_view path);
+    void clear() { files.clear(); }
+
+private:
+    mutex lock;  //pass 1 chunks size their .incbin lines in parallel
+    map<string, unique_ptr<SourceBuffer>, less<>> files;
+};
+
+//in-memory intermediate representation of the whole input file
+//everything one assembly touches lives here, so programs assemble independently
+struct Program 
+{
+    SourceBuffer source;         //whole input file, read once
+    vector<SourceLine> lines;
+    vector<string_view> tokens;  //operand pool, every line points into it
+    long textEnd = TEXT_BASE;    //address after the last emitted instruction
+    long dataEnd = DATA_BASE;    //address after the last data byte
+    LabelTable symbols;          //every label, by interned id
+    Diagnostics diagnostics;
+    vector<unique_ptr<Arena>> chunkArenas;  //pass 1 scratch, one per chunk, rewound by every pass 1
+    size_t relaxedBranches = 0;  //branches/jumps pass 1 had to rewrite to reach their target
+    bool relocatable = false;    //one file of a link: labels it does not define are left to the linker
+    vector<Relocation> relocations;  //filled by pass 2 when relocatable, in address order
+    ConstantTable constants;     //.equ/.set, see collectConstants
+    mutable IncludedFiles includedFiles;  //.incbin files, shared by pass 1 and pass 2
+
+    //ready for the next source, keeping the storage of the vectors
+    void reset() 
+    {
+        source.reset();
+        lines.clear();
+        tokens.clear();
+        relocations.clear();
+        textEnd = TEXT_BASE;
+        dataEnd = DATA_BASE;
+        relaxedBranches = 0;
+        symbols.clear();
+        constants.clear();
+        includedFiles.clear();
+        diagnostics.clear();
+    }
+};
+
+//column of token on entry's line, the statement's column for a token that is not in the
+//source (an operand an alias or relaxation spelled out)
+int tokenColumn(const Program& program, const SourceLine& entry, string_view token) 
+{
+    string_view source = program.source.view();
+    int column = token.empty() ? 0 : columnOf(source, token.data());
+    return column ? column : columnOf(source, entry.text.data());
+}
+
+//where an expression is evaluated: labels only have addresses once pass 1 placed every
+//line, and '.' is the address of the line the expression is on
+struct ExpressionSite 
+{
+    bool laidOut = false;
+    long address = 0;
+    bool inText = true;
+};
+
+//value of an expression, or why it has none and the name it stopped at (a view of text)
+struct ExpressionResult 
+{
+    ExpressionValue value;
+    ExpressionError error = ExpressionError::None;
+    string_view symbol;
+};
+
+//value of the expression in text; a name is a .equ/.set constant of program, or else one
+//of its labels; arithmetic wraps at 64 bits, >> is arithmetic and a shift count is taken
+//modulo 64
+ExpressionResult evaluateExpression(string_view text, const Program& program, const ExpressionSite& site) 
+{
+    ExpressionResult result;
+    const CompiledExpression& compiled = compileExpression(text);
+    if (!compiled.valid) 
+    {
+        result.error = ExpressionError::Syntax;
+        return result;
+    }
+    auto fail = [&](ExpressionError why, string_view name) {
+        result.error = why;
+        result.symbol = name;
+        return result;
+    };
+    //a label's address, counted in the segment it belongs to
+    auto address = [](long at, bool inText) {
+        ExpressionValue value;
+        value.value = at;
+        (inText ? value.textLabels : value.dataLabels) = 1;
+        return value;
+    };
+
+    ExpressionValue stack[MAX_EXPRESSION_DEPTH];
+    size_t top = 0;
+    for (const ExpressionStep& step : compiled.steps) 
+    {
+        switch (step.op) 
+        {
+            case ExpressionOp::Number:
+                stack[top] = ExpressionValue();
+                stack[top++].value = step.value;
+                continue;
+            case ExpressionOp::Here:
+                if (!site.laidOut) return fail(ExpressionError::NeedsLayout, ".");
+                stack[top++] = address(site.address, site.inText);
+                continue;
+            case ExpressionOp::Symbol: 
+            {
+                string_view name = text.substr(step.begin, step.length);
+                uint32_t id = program.constants.names.find(name);
+                if (id != NO_LABEL) 
+                {
+                    const Constant& constant = program.constants.entries[id];
+                    switch (constant.state) 
+                    {
+                        case Constant::State::Known: stack[top++] = constant.value; continue;
+                        case Constant::State::Failed: return fail(ExpressionError::BadConstant, name);
+                        case Constant::State::Pending: return fail(ExpressionError::Pending, name);
+                        case Constant::State::NeedsLayout: return fail(ExpressionError::NeedsLayout, name);
+                    }
+                }
+                if (!site.laidOut) return fail(ExpressionError::NeedsLayout, name);
+                uint32_t label = program.symbols.find(name);
+                if (label == NO_LABEL || program.symbols.addresses[label] == UNDEFINED_ADDRESS) return fail(ExpressionError::Undefined, name);
+                long at = program.symbols.addresses[label];
+                stack[top++] = address(at, at < DATA_BASE);
+                continue;
+            }
+            case ExpressionOp::Negate:
+            case ExpressionOp::Not: 
+            {
+                ExpressionValue& a = stack[top - 1];
+                bool negate = step.op == ExpressionOp::Negate;
+                a.value = negate ? static_cast<long>(0 - static_cast<uint64_t>(a.value)) : ~a.value;
+                a.scaled |= !negate && a.movesInLink();
+                a.textLabels = negate ? -a.textLabels : 0;
+                a.dataLabels = negate ? -a.dataLabels : 0;
+                continue;
+            }
+            default:
+                break;
+        }
+
+        ExpressionValue b = stack[--top];
+        ExpressionValue& a = stack[top - 1];
+        uint64_t x = static_cast<uint64_t>(a.value), y = static_cast<uint64_t>(b.value);
+        bool additive = step.op == ExpressionOp::Add || step.op == ExpressionOp::Subtract;
+        switch (step.op) 
+        {
+            case ExpressionOp::Add: x += y; break;
+            case ExpressionOp::Subtract: x -= y; break;
+            case ExpressionOp::Multiply: x *= y; break;
+            case ExpressionOp::Divide:
+            case ExpressionOp::Remainder:
+                if (b.value == 0) return fail(ExpressionError::Divide, string_view());
+                //-1 on its own, the one quotient that overflows
+                if (b.value == -1) x = step.op == ExpressionOp::Divide ? 0 - x : 0;
+                else x = static_cast<uint64_t>(step.op == ExpressionOp::Divide ? a.value / b.value : a.value % b.value);
+                break;
+            case ExpressionOp::ShiftLeft:
+            case ExpressionOp::ShiftRight:
+                if (y > 63) return fail(ExpressionError::ShiftRange, string_view());
+                x = step.op == ExpressionOp::ShiftLeft ? x << y : static_cast<uint64_t>(a.value >> y);
+                break;
+            case ExpressionOp::And: x &= y; break;
+            case ExpressionOp::Xor: x ^= y; break;
+            case ExpressionOp::Or: x |= y; break;
+            default: break;
+        }
+        int sign = step.op == ExpressionOp::Subtract ? -1 : 1;
+        a.scaled = additive ? a.scaled || b.scaled : a.movesInLink() || b.movesInLink();
+        a.textLabels = additive ? a.textLabels + sign * b.textLabels : 0;
+        a.dataLabels = additive ? a.dataLabels + sign * b.dataLabels : 0;
+        a.value = static_cast<long>(x);
+    }
+    result.value = stack[0];
+    return result;
+}
+
+//value of an immediate operand or data value on entry's line: a number, or an expression
+//over constants, labels, '.' and char literals; text that is no expression goes to
+//status as `kind`, any other problem as BadExpression, and the value reads as 0
+long evaluateOperand(const Program& program, const SourceLine& entry, string_view operand, OperandError kind, OperandStatus& status) 
+{
+    long value = 0;
+    if (stringToLong(operand, value)) return value;
+    ExpressionResult result = evaluateExpression(operand, program, ExpressionSite{true, entry.address, entry.inText});
+    //a file assembled for a link has no final label addresses, only distances inside one segment;
+    //a name it does not define may be another file's export, which the link places too
+    if (result.error == ExpressionError::None && program.relocatable && result.value.movesInLink()) result.error = ExpressionError::Moves;
+    if (result.error == ExpressionError::Undefined && program.relocatable) result.error = ExpressionError::Moves;
+    if (result.error == ExpressionError::Syntax) status.fail(kind, operand);
+    else if (result.error != ExpressionError::None) status.failExpression(result.error, operand, result.symbol);
+    return result.error == ExpressionError::None ? result.value.value : 0;
+}
+
+//value of a number or an expression before pass 1 placed any line, for the operands that
+//size a line (li, .zero/.space/.align): constants work, a label or '.' is NeedsLayout
+ExpressionError valueBeforeLayout(const Program& program, string_view text, long& value) 
+{
+    if (stringToLong(text, value)) return ExpressionError::None;
+    ExpressionResult result = evaluateExpression(text, program, ExpressionSite());
+    if (result.error == ExpressionError::None) value = result.value.value;
+    return result.error;
+}
+
+//what is wrong with the expression text, see ExpressionError
+string expressionMessage(ExpressionError why, string_view text, string_view symbol) 
+{
+    string quoted = "'" + string(text) + "'";
+    switch (why) 
+    {
+        case ExpressionError::Undefined: return "undefined symbol '" + string(symbol) + "'" + (symbol == text ? "" : " in " + quoted);
+        case ExpressionError::Divide: return "division by zero in " + quoted;
+        case ExpressionError::ShiftRange: return "shift count outside 0..63 in " + quoted;
+        case ExpressionError::BadConstant: return "constant '" + string(symbol) + "' has no value";
+        case ExpressionError::Pending: return "constant '" + string(symbol) + "' depends on itself";
+        case ExpressionError::NeedsLayout: return quoted + " needs a label address, which is not known yet here";
+        case ExpressionError::Moves: return quoted + " depends on where the link places its labels";
+        default: return "bad expression " + quoted;
+    }
+}
+
+//open the input ("-" is stdin): mmap regular files, fall back to large read() calls
+bool readSource(const string& filename, SourceBuffer& source) 
+{
+    bool fromStdin = filename == "-";
+    int fd = fromStdin ? STDIN_FILENO : open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) 
+    {
+        size_t size = static_cast<size_t>(info.st_size);
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) 
+        {
+            //the chunks of pass 1 read the whole file, start paging it in now
+            madvise(map, size, MADV_WILLNEED);
+            source.mapped = static_cast<const char*>(map);
+            source.mappedSize = size;
+            if (!fromStdin) close(fd);
+            return true;
+        }
+    }
+
+    constexpr size_t BLOCK = 1 << 20;
+    bool ok = true;
+    for (;;) 
+    {
+        size_t used = source.owned.size();
+        source.owned.resize(used + BLOCK);
+        ssize_t got = read(fd, &source.owned[used], BLOCK);
+        if (got < 0 && errno == EINTR) got = 0;
+        else if (got <= 0) 
+        {
+            ok = got == 0;
+            source.owned.resize(used);
+            break;
+        }
+        source.owned.resize(used + static_cast<size_t>(got));
+    }
+    if (!fromStdin) close(fd);
+    return ok;
+}
+
+const SourceBuffer* IncludedFiles::open(string_view path) 
+{
+    lock_guard<mutex> guard(lock);
+    auto found = files.find(path);
+    if (found != files.end()) return found->second.get();
+    //"-" would be stdin, which may be the source itself
+    auto file = make_unique<SourceBuffer>();
+    if (path == "-" || !readSource(string(path), *file)) file.reset();
+    return files.emplace(string(path), move(file)).first->second.get();
+}
+
+//streaming line scanner: hands out views of each line (without the '\n'),
+//finding line ends with memchr
+struct LineScanner 
+{
+    string_view rest;
+
+    bool next(string_view& line) 
+    {
+        if (rest.empty()) return false;
+        const void* eol = memchr(rest.data(), '\n', rest.size());
+        size_t length = eol ? static_cast<const char*>(eol) - rest.data() : rest.size();
+        line = rest.substr(0, length);
+        rest.remove_prefix(eol ? length + 1 : length);
+        return true;
+    }
+};
+
+//number of '\n' in text
+size_t countNewlines(string_view text) 
+{
+    size_t count = 0;
+    const char* p = text.data();
+    const char* end = p + text.size();
+    while (const void* hit = memchr(p, '\n', end - p)) 
+    {
+        ++count;
+        p = static_cast<const char*>(hit) + 1;
+    }
+    return count;
+}
+
+//write the whole buffer, retrying short writes
+bool writeAll(int fd, const void* data, size_t size) 
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) 
+    {
+        ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        p += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+//output file written in large blocks: text collects in a buffer that goes to write()
+//once it passes BLOCK bytes, and a large piece goes out together with the buffer in
+//one writev instead of being copied; with no file descriptor everything stays in the
+//buffer for take() (the library keeps its output in memory)
+class OutputWriter 
+{
+public:
+    static constexpr size_t BLOCK = 1 << 20;
+
+    explicit OutputWriter(int fd = -1) : fd(fd) {}
+
+    //format straight into this, then call flushIfFull
+    string& buffer() { return pending; }
+
+    void flushIfFull() 
+    {
+        if (fd >= 0 && pending.size() >= BLOCK) flush();
+    }
+
+    void write(string_view text) 
+    {
+        if (fd < 0 || pending.size() + text.size() < BLOCK) 
+        {
+            pending += text;
+            return;
+        }
+        iovec pieces[2] = {{&pending[0], pending.size()}, {const_cast<char*>(text.data()), text.size()}};
+        writePieces(pieces, 2);
+        pending.clear();
+    }
+
+    //false once any write failed
+    bool flush() 
+    {
+        if (fd >= 0 && !pending.empty()) 
+        {
+            iovec piece = {&pending[0], pending.size()};
+            writePieces(&piece, 1);
+            pending.clear();
+        }
+        return ok;
+    }
+
+    string take() { return move(pending); }
+
+    //bytes handed to the file so far, pending ones included
+    uint64_t size() const { return written + pending.size(); }
+
+private:
+    void writePieces(iovec* pieces, int count) 
+    {
+        TraceSpan span("write");
+        for (int i = 0; i < count; ++i) span.items += pieces[i].iov_len;
+        written += span.items;
+        while (ok && count > 0) 
+        {
+            ssize_t done = writev(fd, pieces, count);
+            if (done < 0 && errno == EINTR) continue;
+            if (done <= 0) 
+            {
+                ok = false;
+                break;
+            }
+            //skip what a short write took
+            size_t left = static_cast<size_t>(done);
+            while (count > 0 && left >= pieces->iov_len) 
+            {
+                left -= pieces->iov_len;
+                ++pieces;
+                --count;
+            }
+            if (count > 0) 
+            {
+                pieces->iov_base = static_cast<char*>(pieces->iov_base) + left;
+                pieces->iov_len -= left;
+            }
+        }
+    }
+
+    int fd;
+    string pending;
+    uint64_t written = 0;
+    bool ok = true;
+};
+
+//copy a line's operand spans back into a fixed array
+Operands lineOperands(const Program& program, const SourceLine& entry) 
+{
+    Operands operands;
+    operands.count = entry.tokenCount;
+    copy_n(program.tokens.begin() + entry.firstToken, entry.tokenCount, operands.tokens.begin());
+    return operands;
+}
+
+constexpr long BAD_DIRECTIVE = -1;
+
+constexpr bool isValueSeparator(char c) 
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f' || c == ',';
+}
+
+//element size of .byte/.half/.word/.dword, 0 for every other directive
+int dataValueWidth(string_view directive) 
+{
+    if (directive == ".byte") return 1;
+    if (directive == ".half") return 2;
+    if (directive == ".word") return 4;
+    if (directive == ".dword") return 8;
+    return 0;
+}
+
+//.align N aligns to 2^N bytes (as in the RISC-V gnu assembler), .balign N to N bytes
+constexpr bool isAlignDirective(string_view directive) 
+{
+    return directive == ".align" || directive == ".balign";
+}
+
+//the text after the directive, where its values start
+string_view directiveArguments(const SourceLine& entry, string_view directive) 
+{
+    return entry.text.substr(min(entry.text.size(), static_cast<size_t>(directive.data() + directive.size() - entry.text.data())));
+}
+
+//text between the first and last double quote, false if there is no such pair or the
+//last one is escaped (\"), so the string never ends
+bool quotedText(const SourceLine& entry, string_view& text) 
+{
+    size_t firstQuote = entry.text.find('\"');
+    size_t lastQuote = entry.text.rfind('\"');
+    if (firstQuote == string::npos || firstQuote == lastQuote) return false;
+    size_t backslashes = 0;
+    while (lastQuote - backslashes > firstQuote + 1 && entry.text[lastQuote - backslashes - 1] == '\\') ++backslashes;
+    if (backslashes % 2) return false;
+    text = entry.text.substr(firstQuote + 1, lastQuote - firstQuote - 1);
+    return true;
+}
+
+//number of comma/space separated values in a list, an expression being one value
+//emptyAt is the comma of an empty value (one with no value since the comma or the start
+//before it, or the last comma with nothing after it), npos if there is none
+size_t countDataValues(string_view values, size_t& emptyAt) 
+{
+    size_t count = 0;
+    emptyAt = string_view::npos;
+    size_t lastComma = string_view::npos;
+    bool valueSinceComma = false;
+    for (size_t i = 0; i < values.size(); ) 
+    {
+        size_t end = valueEnd(values, i, false);
+        if (end != i) 
+        {
+            ++count;
+            valueSinceComma = true;
+        }
+        else if (values[i] == ',') 
+        {
+            if (!valueSinceComma && emptyAt == string_view::npos) emptyAt = i;
+            lastComma = i;
+            valueSinceComma = false;
+        }
+        i = max(end, i + 1);
+    }
+    if (lastComma != string_view::npos && !valueSinceComma && emptyAt == string_view::npos) emptyAt = lastComma;
+    return count;
+}
+
+//size in bytes of a data directive, the same wherever the line lands, so pass 1 works it
+//out once per line; for .align it is the boundary instead
+//BAD_DIRECTIVE if an operand is unusable (an empty value in a list, an unterminated
+//string, missing .incbin file, negative .zero count, a count that needs a label), which
+//badDirectiveMessage then explains
+long dataDirectiveSize(const Program& program, const SourceLine& entry, const Operands& operands) 
+{
+    string_view directive = operands[0];
+    if (int width = dataValueWidth(directive)) 
+    {
+        size_t emptyAt;
+        size_t count = countDataValues(directiveArguments(entry, directive), emptyAt);
+        return emptyAt == string_view::npos ? static_cast<long>(count) * width : BAD_DIRECTIVE;
+    }
+    if (directive == ".asciz") 
+    {
+        string_view text;
+        return quotedText(entry, text) ? static_cast<long>(decodeString(text, nullptr)) + 1 : BAD_DIRECTIVE; //string plus null terminator
+    }
+    if (directive == ".zero" || directive == ".space" || isAlignDirective(directive)) 
+    {
+        long count;
+        if (valueBeforeLayout(program, operands[1], count) != ExpressionError::None) return BAD_DIRECTIVE;
+        if (directive == ".align") return count >= 0 && count <= 16 ? 1L << count : BAD_DIRECTIVE;
+        if (directive == ".balign") return count > 0 && count <= 65536 && (count & (count - 1)) == 0 ? count : BAD_DIRECTIVE;
+        return count >= 0 ? count : BAD_DIRECTIVE;
+    }
+    if (directive == ".incbin") 
+    {
+        //paths are relative to the working directory, pass 2 copies the bytes read here
+        string_view path;
+        const SourceBuffer* file = quotedText(entry, path) ? program.includedFiles.open(path) : nullptr;
+        return file ? static_cast<long>(file->view().size()) : BAD_DIRECTIVE;
+    }
+    return 0;
+}
+
+//why pass 1 could not size a data line (dataDirectiveSize gave BAD_DIRECTIVE), with the
+//text the message points at in at
+string badDirectiveMessage(const Program& program, const SourceLine& entry, string_view& at) 
+{
+    string_view directive = program.tokens[entry.firstToken];
+    string_view arguments = directiveArguments(entry, directive);
+    at = entry.text;
+    if (dataValueWidth(directive)) 
+    {
+        size_t emptyAt;
+        countDataValues(arguments, emptyAt);
+        at = arguments.substr(emptyAt, 1);
+        return "empty value in " + string(directive);
+    }
+    if (directive == ".asciz" || directive == ".incbin") 
+    {
+        size_t quote = arguments.find('"');
+        string_view path;
+        if (quote == string_view::npos) return "expected a quoted " + string(directive == ".asciz" ? "string" : "file name") + " after " + string(directive);
+        at = arguments.substr(quote, 1);
+        if (!quotedText(entry, path)) return "unterminated string";
+        at = path;
+        return "cannot open '" + string(path) + "'";
+    }
+    return "bad operand in '" + string(entry.text) + "'";
+}
+
+//bytes a data line placed at entry.address takes, padding included for .align
+long dataLineSize(const SourceLine& entry, string_view directive) 
+{
+    if (entry.size <= 0) return 0;
+    if (isAlignDirective(directive)) return ((entry.address + entry.size - 1) & ~(entry.size - 1)) - entry.address;
+    return entry.size;
+}
+
+//run fn(0) .. fn(count - 1) on `jobs` threads, each thread claiming the next index
+//from a shared counter; the calling thread is one of the workers
+template <typename Fn>
+void parallelFor(size_t count, int jobs, Fn fn) 
+{
+    atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1, memory_order_relaxed)) < count; ) fn(i);
+    };
+    vector<thread> threads;
+    for (int t = 1; t < jobs && static_cast<size_t>(t) < count; ++t) 
+    {
+        threads.emplace_back([&, t]() {
+            traceThread = t;
+            worker();
+#ifdef COUNT_ALLOCATIONS
+            workerHeapAllocations.fetch_add(heapAllocations, memory_order_relaxed);
+#endif
+        });
+    }
+    worker();
+    for (thread& t : threads) t.join();
+}
+
+//pass 1 location counters
+struct Location 
+{
+    long text = 0;
+    long data = 0;
+
+    Location& operator+=(const Location& other) 
+    {
+        text += other.text;
+        data += other.data;
+        return *this;
+    }
+};
+
+//give one line its address and advance the counters past it
+//an unknown instruction is an error and takes no space, so labels and pass 2 agree on
+//every address after it; data lines and pseudo-instructions use the size pass 1 stored
+//in entry.size (a pseudo-instruction that ends up in .data is nothing there)
+void placeLine(SourceLine& entry, string_view mnemonic, Location& location) 
+{
+    if (entry.tokenCount == 0) return;
+    bool pseudo = entry.pseudo != Pseudo::None;
+    if (entry.inText) 
+    {
+        entry.address = location.text;
+        if (entry.info || pseudo) location.text += pseudo ? entry.size : 4;
+    }
+    else 
+    {
+        entry.address = location.data;
+        location.data += pseudo ? 0 : dataLineSize(entry, mnemonic);
+    }
+}
+
+//one slice of the source, tokenized and sized on its own
+//segment sizes do not depend on where a line lands, so a chunk can size itself as
+//byte counts and an exclusive prefix scan over chunks turns those into addresses;
+//.align is the exception, a chunk holding one is placed line by line during the scan
+//everything a chunk allocates comes from its arena and is dropped with it
+struct Pass1Chunk 
+{
+    explicit Pass1Chunk(Arena& arena)
+        : lines(&arena), tokens(&arena), labels(&arena), labelRemap(&arena), definitions(&arena), unknown(&arena), badDirectives(&arena) {}
+
+    string_view source;           //whole lines
+    pmr::vector<SourceLine> lines;     //firstToken and lineNo are chunk-relative until fixup
+    pmr::vector<string_view> tokens;
+    int lineCount = 0;            //source lines in the slice
+    size_t headLines = 0;         //lines before the first .text/.data, they inherit the segment
+    bool switchesSegment = false;
+    bool endsInText = true;       //segment after the last .text/.data
+    Location headAsText;          //head sized as if it were .text
+    Location headAsData;          //head sized as if it were .data
+    Location rest;                //everything after the first switch
+    bool aligns = false;          //has an .align, so its size depends on its start address
+    LabelTable labels;            //chunk-local label ids, remapped to program.symbols ids at fixup
+
+    //filled by the prefix scan
+    bool startsInText = true;
+    Location start;
+    int firstLineNo = 0;
+    size_t lineIndex = 0;
+    size_t tokenIndex = 0;
+
+    pmr::vector<uint32_t> labelRemap;  //chunk-local id -> program.symbols id
+
+    //filled by the fixup, merged in order afterwards
+    struct Definition 
+    {
+        uint32_t id;
+        uint32_t line;  //chunk line index
+        long address;
+    };
+    pmr::vector<Definition> definitions;
+    pmr::vector<uint32_t> unknown;        //chunk line index of every unknown instruction
+    pmr::vector<uint32_t> badDirectives;  //and of every data directive with a bad operand
+};
+
+//end of the first statement on a line: the first ';' outside a string or char literal,
+//npos if none
+size_t statementEnd(string_view line) 
+{
+    if (line.empty() || !memchr(line.data(), ';', line.size())) return string_view::npos;
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); ++i) 
+    {
+        char c = line[i];
+        if (quote && c == '\\') ++i;
+        else if (quote) quote = c == quote ? 0 : quote;
+        else if (c == '"' || c == '\'') quote = c;
+        else if (c == ';') return i;
+    }
+    return string_view::npos;
+}
+
+//the ':' that ends a label at the start of a statement, npos if it has none
+//(a ':' in a string or char literal is no label)
+size_t labelColon(string_view statement) 
+{
+    size_t colon = statement.find(':');
+    if (colon == string_view::npos) return colon;
+    return statement.substr(0, colon).find_first_of("\"'") == string_view::npos ? colon : string_view::npos;
+}
+
+//rewrite a pseudo-instruction that is a single base instruction into it, in place
+//the new tokens are literals or the line's own operands, so they live as long as the
+//source; lines that match no alias (or have the wrong operand count) are left alone
+void rewriteAlias(Operands& operands) 
+{
+    string_view op = operands[0];
+    string_view a = operands[1], b = operands[2], c = operands[3];
+    size_t count = operands.size() - 1;
+    auto to = [&](initializer_list<string_view> tokens) {
+        operands.count = 0;
+        for (string_view token : tokens) operands.tokens[operands.count++] = token;
+    };
+    switch (mnemonicHash(op)) 
+    {
+        case mnemonicHash("nop"):    if (op == "nop" && count == 0) to({"addi", "x0", "x0", "0"}); break;
+        case mnemonicHash("mv"):     if (op == "mv" && count == 2) to({"addi", a, b, "0"}); break;
+        case mnemonicHash("neg"):    if (op == "neg" && count == 2) to({"sub", a, "x0", b}); break;
+        case mnemonicHash("negw"):   if (op == "negw" && count == 2) to({"subw", a, "x0", b}); break;
+        case mnemonicHash("sext.w"): if (op == "sext.w" && count == 2) to({"addiw", a, b, "0"}); break;
+        case mnemonicHash("sltz"):   if (op == "sltz" && count == 2) to({"slt", a, b, "x0"}); break;
+        case mnemonicHash("sgtz"):   if (op == "sgtz" && count == 2) to({"slt", a, "x0", b}); break;
+        case mnemonicHash("j"):      if (op == "j" && count == 1) to({"jal", "x0", a}); break;
+        case mnemonicHash("jal"):    if (op == "jal" && count == 1) to({"jal", "x1", a}); break;
+        case mnemonicHash("jr"):     if (op == "jr" && count == 1) to({"jalr", "x0", "0", a}); break;
+        case mnemonicHash("jalr"):   if (op == "jalr" && count == 1) to({"jalr", "x1", "0", a}); break;
+        case mnemonicHash("ret"):    if (op == "ret" && count == 0) to({"jalr", "x0", "0", "x1"}); break;
+        case mnemonicHash("beqz"):   if (op == "beqz" && count == 2) to({"beq", a, "x0", b}); break;
+        case mnemonicHash("bnez"):   if (op == "bnez" && count == 2) to({"bne", a, "x0", b}); break;
+        case mnemonicHash("blez"):   if (op == "blez" && count == 2) to({"bge", "x0", a, b}); break;
+        case mnemonicHash("bgez"):   if (op == "bgez" && count == 2) to({"bge", a, "x0", b}); break;
+        case mnemonicHash("bltz"):   if (op == "bltz" && count == 2) to({"blt", a, "x0", b}); break;
+        case mnemonicHash("bgtz"):   if (op == "bgtz" && count == 2) to({"blt", "x0", a, b}); break;
+        case mnemonicHash("bgt"):    if (op == "bgt" && count == 3) to({"blt", b, a, c}); break;
+        case mnemonicHash("ble"):    if (op == "ble" && count == 3) to({"bge", b, a, c}); break;
+        case mnemonicHash("bgtu"):   if (op == "bgtu" && count == 3) to({"bltu", b, a, c}); break;
+        case mnemonicHash("bleu"):   if (op == "bleu" && count == 3) to({"bgeu", b, a, c}); break;
+        case mnemonicHash("not"):    if (op == "not" && count == 2) to({"xori", a, b, "-1"}); break;
+        case mnemonicHash("seqz"):   if (op == "seqz" && count == 2) to({"sltiu", a, b, "1"}); break;
+        case mnemonicHash("snez"):   if (op == "snez" && count == 2) to({"sltu", a, "x0", b}); break;
+        case mnemonicHash("csrr"):   if (op == "csrr" && count == 2) to({"csrrs", a, b, "x0"}); break;
+        case mnemonicHash("csrw"):   if (op == "csrw" && count == 2) to({"csrrw", "x0", a, b}); break;
+        case mnemonicHash("csrs"):   if (op == "csrs" && count == 2) to({"csrrs", "x0", a, b}); break;
+        case mnemonicHash("csrc"):   if (op == "csrc" && count == 2) to({"csrrc", "x0", a, b}); break;
+        case mnemonicHash("csrwi"):  if (op == "csrwi" && count == 2) to({"csrrwi", "x0", a, b}); break;
+        case mnemonicHash("csrsi"):  if (op == "csrsi" && count == 2) to({"csrrsi", "x0", a, b}); break;
+        case mnemonicHash("csrci"):  if (op == "csrci" && count == 2) to({"csrrci", "x0", a, b}); break;
+        case mnemonicHash("rdcycle"):   if (op == "rdcycle" && count == 1) to({"csrrs", a, "cycle", "x0"}); break;
+        case mnemonicHash("rdtime"):    if (op == "rdtime" && count == 1) to({"csrrs", a, "time", "x0"}); break;
+        case mnemonicHash("rdinstret"): if (op == "rdinstret" && count == 1) to({"csrrs", a, "instret", "x0"}); break;
+        case mnemonicHash("li"): 
+            //a 12-bit li is a plain addi, anything wider is Pseudo::Li
+            if (op == "li" && count == 2) 
+            {
+                long value;
+                if (stringToLong(b, value) && value >= -2048 && value <= 2047) to({"addi", a, "x0", b});
+            }
+            break;
+    }
+}
+
+//operands every pseudo-instruction takes, what rewriteAlias and findPseudo match on;
+//lets a known pseudo with the wrong count be told apart from an unknown mnemonic
+struct PseudoArity 
+{
+    string_view name;
+    size_t operands;
+};
+constexpr PseudoArity pseudoArities[] = {
+    {"nop", 0}, {"ret", 0},
+    {"j", 1}, {"jr", 1}, {"call", 1}, {"tail", 1}, {"rdcycle", 1}, {"rdtime", 1}, {"rdinstret", 1},
+    {"mv", 2}, {"neg", 2}, {"negw", 2}, {"sext.w", 2}, {"sltz", 2}, {"sgtz", 2}, {"not", 2}, {"seqz", 2}, {"snez", 2},
+    {"beqz", 2}, {"bnez", 2}, {"blez", 2}, {"bgez", 2}, {"bltz", 2}, {"bgtz", 2},
+    {"csrr", 2}, {"csrw", 2}, {"csrs", 2}, {"csrc", 2}, {"csrwi", 2}, {"csrsi", 2}, {"csrci", 2},
+    {"li", 2}, {"la", 2}, {"lla", 2},
+    {"bgt", 3}, {"ble", 3}, {"bgtu", 3}, {"bleu", 3},
+};
+
+//the pseudo-instruction entry of a mnemonic, nullptr if it names none
+const PseudoArity* findPseudoArity(string_view name) 
+{
+    for (const PseudoArity& pseudo : pseudoArities) 
+    {
+        if (pseudo.name == name) return &pseudo;
+    }
+    return nullptr;
+}
+
+//lw rd, (rs1) and sw rs2, (rs1) leave the offset out: the base lands in the imm slot, so
+//when a '(' is right in front of it the base moves on and the offset reads as 0
+void fillOmittedOffset(string_view line, const InstructionInfo& info, Operands& operands) 
+{
+    bool offsetForm = info.syntax == InstructionInfo::Syntax::Memory || info.format == InstructionInfo::Format::S;
+    size_t imm = info.slots.imm, base = info.slots.rs1;
+    if (!offsetForm || operands.size() < base || operands.size() == MAX_OPERANDS || base != imm + 1) return;
+    //an unclosed (rs1 keeps its '(', the base check reports it
+    size_t at = operands[imm].data() - line.data();
+    while (at > 0 && (valueChar(line[at - 1]) & VALUE_BLANK)) --at;
+    bool unclosed = operands[imm][0] == '(' && operands.size() == base;  //(4+4)(a1) starts with '(' as well
+    if (!unclosed && (at == 0 || line[at - 1] != '(')) return;
+    //operands after the base move along with it, for the unexpected operand check
+    copy_backward(operands.tokens.begin() + imm, operands.tokens.begin() + operands.count, operands.tokens.begin() + operands.count + 1);
+    operands.tokens[imm] = "0";
+    ++operands.count;
+}
+
+//which multi-instruction pseudo the line is, with the bytes its expansion takes
+Pseudo findPseudo(const Program& program, const Operands& operands, long& size) 
+{
+    string_view op = operands[0];
+    size_t count = operands.size() - 1;
+    size = 8;
+    if ((op == "la" || op == "lla") && count == 2) return Pseudo::La;
+    if (op == "call" && count == 1) return Pseudo::Call;
+    if (op == "tail" && count == 1) return Pseudo::Tail;
+    size = 0;
+    if (op != "li" || count != 2) return Pseudo::None;
+    //a value that is not a number is sized as 0 here and reported by pass 2; one that needs
+    //a label takes lui + addiw, pass 2 checks it fits in 32 bits
+    long value = 0;
+    if (valueBeforeLayout(program, operands[2], value) == ExpressionError::NeedsLayout) 
+    {
+        size = 8;
+        return Pseudo::Li;
+    }
+    LiStep steps[MAX_EXPANDED_WORDS];
+    size = 4 * static_cast<long>(liSequence(value, steps));
+    return Pseudo::Li;
+}
+
+//operand holding the label of a pseudo-instruction, 0 if it has none
+constexpr size_t pseudoLabelIndex(Pseudo pseudo) 
+{
+    return pseudo == Pseudo::La ? 2 : pseudo == Pseudo::Call || pseudo == Pseudo::Tail ? 1 : 0;
+}
+
+//%hi(sym) / %lo(sym) operand, folded into one token by foldRelocation
+constexpr bool isRelocation(string_view operand) 
+{
+    return operand.size() > 4 && operand[0] == '%' && (operand.substr(1, 3) == "hi(" || operand.substr(1, 3) == "lo(");
+}
+
+string_view relocationSymbol(string_view operand) 
+{
+    operand.remove_prefix(4);
+    if (!operand.empty() && operand.back() == ')') operand.remove_suffix(1);
+    return operand;
+}
+
+//a base instruction whose targetId is the symbol of a %hi/%lo operand
+bool isRelocationLine(const SourceLine& entry) 
+{
+    return entry.info && labelOperandIndex(*entry.info) == 0 && entry.targetId != NO_LABEL;
+}
+
+//parseOperands splits %hi(sym) / %lo(sym) at the parentheses, join the two tokens back
+//into one operand (a view of the line); returns its position, 0 if the line has none
+size_t foldRelocation(string_view line, Operands& operands) 
+{
+    for (size_t k = 1; k + 1 < operands.count; ++k) 
+    {
+        if (operands.tokens[k][0] != '%' || (operands.tokens[k] != "%hi" && operands.tokens[k] != "%lo")) continue;
+        const char* first = operands.tokens[k].data();
+        const char* last = operands.tokens[k + 1].data() + operands.tokens[k + 1].size();
+        if (last < line.data() + line.size() && *last == ')') ++last;
+        operands.tokens[k] = string_view(first, last - first);
+        copy(operands.tokens.begin() + k + 2, operands.tokens.begin() + operands.count, operands.tokens.begin() + k + 1);
+        --operands.count;
+        return k;
+    }
+    return 0;
+}
+
+//split the chunk into lines, tokenize each one exactly once and size the chunk
+//program gives the constants that size lines, nothing else of it is touched
+void tokenizeChunk(Pass1Chunk& chunk, const Program& program) 
+{
+    //one entry per line unless ';' puts several statements on one, so the line table
+    //rarely regrows; every token is at least one character and a separator, which bounds
+    //the token pool (the arena only touches the pages that get used)
+    chunk.lines.reserve(countNewlines(chunk.source) + 1);
+    chunk.tokens.reserve(chunk.source.size() / 2 + 1);
+    bool segmentKnown = false;
+    bool inTextSegment = true;
+    int lineNo = 0;
+    LineScanner scanner{chunk.source};
+    string_view line;
+    Operands operands;
+    while (scanner.next(line)) 
+    {
+        ++lineNo;
+        string_view rest = cleanLine(line);
+        //every statement of the line gets its own entry with the line's number
+        do 
+        {
+            size_t end = statementEnd(rest);
+            string_view cleaned = trim(rest.substr(0, end));
+            rest = end == string_view::npos ? string_view() : rest.substr(end + 1);
+
+            if (cleaned == ".data" || cleaned == ".text") 
+            {
+                if (!segmentKnown) chunk.headLines = chunk.lines.size();
+                segmentKnown = true;
+                inTextSegment = cleaned == ".text";
+                continue;
+            }
+
+            SourceLine entry{lineNo, inTextSegment, Relaxation::None, Pseudo::None, {}, {}, chunk.tokens.size(), 0, 0};
+            size_t colon = labelColon(cleaned);
+            if (colon != string_view::npos) 
+            {
+                entry.label = trim(cleaned.substr(0, colon));
+                cleaned = trim(cleaned.substr(colon + 1));
+            }
+            if (entry.label.empty() && cleaned.empty()) continue;
+
+            parseOperands(cleaned, operands);
+            size_t relocation = foldRelocation(cleaned, operands);
+            //head lines might turn out to be .text, so they get looked up too
+            //aliases become their base instruction before the tokens are stored; only a
+            //line that is no base instruction, or has one operand (jal/jalr), can be one
+            if (inTextSegment && !operands.empty()) entry.info = findInstruction(operands[0]);
+            if (inTextSegment && !operands.empty() && (!entry.info || operands.size() == 2)) 
+            {
+                rewriteAlias(operands);
+                entry.info = findInstruction(operands[0]);
+                if (!entry.info) entry.pseudo = findPseudo(program, operands, entry.size);
+            }
+            if (entry.info) fillOmittedOffset(cleaned, *entry.info, operands);
+            chunk.tokens.insert(chunk.tokens.end(), operands.tokens.begin(), operands.tokens.begin() + operands.count);
+            entry.tokenCount = operands.count;
+            entry.text = cleaned;
+            if (!entry.info && entry.pseudo == Pseudo::None && !operands.empty()) 
+            {
+                entry.size = dataDirectiveSize(program, entry, operands);
+                chunk.aligns |= isAlignDirective(operands[0]);
+            }
+            if (!entry.label.empty()) entry.labelId = chunk.labels.intern(entry.label);
+            size_t target = entry.info ? labelOperandIndex(*entry.info) : pseudoLabelIndex(entry.pseudo);
+            if (target && operands.size() > target) 
+            {
+                entry.targetId = chunk.labels.intern(operands[target]);
+            }
+            else if (entry.info && relocation) 
+            {
+                entry.targetId = chunk.labels.intern(relocationSymbol(operands[relocation]));
+            }
+            chunk.lines.push_back(entry);
+        } while (!rest.empty());
+    }
+    chunk.lineCount = lineNo;
+    chunk.switchesSegment = segmentKnown;
+    chunk.endsInText = inTextSegment;
+    if (!segmentKnown) chunk.headLines = chunk.lines.size();
+
+    for (size_t i = 0; i < chunk.lines.size(); ++i) 
+    {
+        SourceLine& entry = chunk.lines[i];
+        string_view mnemonic = entry.tokenCount ? chunk.tokens[entry.firstToken] : string_view();
+        if (i < chunk.headLines) 
+        {
+            SourceLine asText = entry, asData = entry;
+            asText.inText = true;
+            asData.inText = false;
+            placeLine(asText, mnemonic, chunk.headAsText);
+            placeLine(asData, mnemonic, chunk.headAsData);
+        }
+        else 
+        {
+            placeLine(entry, mnemonic, chunk.rest);
+        }
+    }
+}
+
+//now that the chunk's start segment and addresses are known, give every line its final
+//segment, address and line number and copy it into the program's line table
+void fixupChunk(Pass1Chunk& chunk, Program& program) 
+{
+    Location location = chunk.start;
+    for (size_t i = 0; i < chunk.lines.size(); ++i) 
+    {
+        SourceLine entry = chunk.lines[i];
+        string_view mnemonic = entry.tokenCount ? chunk.tokens[entry.firstToken] : string_view();
+        if (i < chunk.headLines) entry.inText = chunk.startsInText;
+        if (!entry.inText && (entry.info || entry.pseudo != Pseudo::None)) 
+        {
+            entry.info = nullptr;
+            entry.pseudo = Pseudo::None;
+            entry.size = 0;
+        }
+        entry.lineNo += chunk.firstLineNo;
+        entry.firstToken += chunk.tokenIndex;
+        if (entry.labelId != NO_LABEL) entry.labelId = chunk.labelRemap[entry.labelId];
+        bool instruction = entry.info || entry.pseudo != Pseudo::None;
+        entry.targetId = instruction && entry.targetId != NO_LABEL ? chunk.labelRemap[entry.targetId] : NO_LABEL;
+
+        if (entry.labelId != NO_LABEL) 
+        {
+            chunk.definitions.push_back({entry.labelId, static_cast<uint32_t>(i), entry.inText ? location.text : location.data});
+        }
+        if (entry.inText && entry.tokenCount && !instruction) chunk.unknown.push_back(static_cast<uint32_t>(i));
+        if (!entry.inText && entry.size == BAD_DIRECTIVE) chunk.badDirectives.push_back(static_cast<uint32_t>(i));
+        placeLine(entry, mnemonic, location);
+        program.lines[chunk.lineIndex + i] = entry;
+    }
+    copy(chunk.tokens.begin(), chunk.tokens.end(), program.tokens.begin() + chunk.tokenIndex);
+}
+
+//reach of a branch (13-bit) and a jal (21-bit) offset
+constexpr bool fitsSB(long offset) { return offset >= -4096 && offset <= 4094; }
+constexpr bool fitsUJ(long offset) { return offset >= -(1L << 20) && offset <= (1L << 20) - 2; }
+
+//rewrite every beq/bne/blt/bge and jal whose target is out of range (see Relaxation)
+//and move the lines and labels after it; runs once pass 1 has placed every line
+//growing one instruction can push others out of range, so this iterates until nothing
+//grows; lines only ever grow, which bounds the rounds. A line's address is its pass 1
+//address plus the growth of the relaxed branches before it, summed by a Fenwick tree
+//over the branches, and each round only measures again the branches whose span holds a
+//branch that grew in the round before. The line table is shifted once at the end
+void relaxBranches(Program& program) 
+{
+    TraceSpan span("relax", program.lines.size());
+    vector<SourceLine>& lines = program.lines;
+    LabelTable& symbols = program.symbols;
+    auto isBranch = [&](const SourceLine& entry) {
+        return entry.inText && entry.info && labelOperandIndex(*entry.info) != 0
+            && entry.targetId != NO_LABEL && symbols.addresses[entry.targetId] != UNDEFINED_ADDRESS;
+    };
+    auto fits = [](const InstructionInfo& info, long offset) {
+        return info.format == InstructionInfo::Format::SB ? fitsSB(offset) : fitsUJ(offset);
+    };
+
+    //nearly every program is in range as laid out, that costs one scan
+    bool inRange = true;
+    for (const SourceLine& entry : lines) 
+    {
+        if (isBranch(entry) && !fits(*entry.info, symbols.addresses[entry.targetId] - entry.address)) 
+        {
+            inRange = false;
+            break;
+        }
+    }
+    if (inRange) return;
+
+    //line holding each label's first definition (the one it keeps), NO_LINE if that is in .data
+    constexpr uint32_t NO_LINE = UINT32_MAX;
+    vector<uint32_t> labelLine(symbols.size(), NO_LINE);
+    for (size_t i = lines.size(); i-- > 0; ) 
+    {
+        const SourceLine& entry = lines[i];
+        if (entry.labelId != NO_LABEL) labelLine[entry.labelId] = entry.inText ? static_cast<uint32_t>(i) : NO_LINE;
+    }
+    struct Branch 
+    {
+        uint32_t line;
+        uint32_t targetLine;
+        Relaxation relaxation;
+    };
+    vector<Branch> branches;
+    for (size_t i = 0; i < lines.size(); ++i) 
+    {
+        if (isBranch(lines[i])) branches.push_back({static_cast<uint32_t>(i), 0, Relaxation::None});
+    }
+    for (Branch& branch : branches) branch.targetLine = labelLine[lines[branch.line].targetId];
+
+    //growth of the first n branches
+    vector<long> tree(branches.size() + 1, 0);
+    auto grow = [&](size_t branch, long bytes) {
+        for (size_t i = branch + 1; i < tree.size(); i += i & (0 - i)) tree[i] += bytes;
+    };
+    auto growthBefore = [&](size_t count) {
+        long bytes = 0;
+        for (size_t i = count; i > 0; i -= i & (0 - i)) bytes += tree[i];
+        return bytes;
+    };
+    auto growthBeforeLine = [&](uint32_t line) {
+        auto it = lower_bound(branches.begin(), branches.end(), line, [](const Branch& b, uint32_t l) { return b.line < l; });
+        return growthBefore(it - branches.begin());
+    };
+
+    //smallest rewrite at or above the current one that reaches the target
+    auto needed = [&](size_t b) {
+        const Branch& branch = branches[b];
+        const SourceLine& entry = lines[branch.line];
+        long from = entry.address + growthBefore(b);
+        long to = symbols.addresses[entry.targetId] + (branch.targetLine == NO_LINE ? 0 : growthBeforeLine(branch.targetLine));
+        bool forward = branch.targetLine != NO_LINE && branch.targetLine > branch.line;
+        auto reaches = [&](Relaxation relaxation) {
+            //a forward target moves with the branch's own growth
+            long target = to + (forward ? relaxedSize(relaxation) - relaxedSize(branch.relaxation) : 0);
+            switch (relaxation) 
+            {
+                case Relaxation::None: return fits(*entry.info, target - from);
+                case Relaxation::BranchOverJump: return fitsUJ(target - (from + 4));
+                default: return true; //auipc + jalr reach +-2GB
+            }
+        };
+        if (entry.info->format == InstructionInfo::Format::UJ) 
+        {
+            return branch.relaxation == Relaxation::None && reaches(Relaxation::None) ? Relaxation::None : Relaxation::FarJump;
+        }
+        for (Relaxation relaxation : {Relaxation::None, Relaxation::BranchOverJump}) 
+        {
+            if (branch.relaxation <= relaxation && reaches(relaxation)) return relaxation;
+        }
+        return Relaxation::BranchOverFarJump;
+    };
+
+    vector<uint32_t> work(branches.size());
+    for (size_t b = 0; b < branches.size(); ++b) work[b] = static_cast<uint32_t>(b);
+    vector<uint32_t> grown;  //lines that grew this round, in order
+    while (!work.empty()) 
+    {
+        grown.clear();
+        for (uint32_t b : work) 
+        {
+            Relaxation relaxation = needed(b);
+            if (relaxation == branches[b].relaxation) continue;
+            grow(b, relaxedSize(relaxation) - relaxedSize(branches[b].relaxation));
+            branches[b].relaxation = relaxation;
+            grown.push_back(branches[b].line);
+        }
+        work.clear();
+        for (size_t b = 0; b < branches.size() && !grown.empty(); ++b) 
+        {
+            //growth at a line in [low, high) changes this branch's offset
+            const Branch& branch = branches[b];
+            uint32_t low = branch.targetLine == NO_LINE ? 0 : min(branch.line, branch.targetLine);
+            uint32_t high = branch.targetLine == NO_LINE ? branch.line : max(branch.line, branch.targetLine);
+            auto it = lower_bound(grown.begin(), grown.end(), low);
+            if (it != grown.end() && *it < high) work.push_back(static_cast<uint32_t>(b));
+        }
+    }
+
+    //shift every text line and label by the growth before it
+    long growth = 0;
+    size_t next = 0;
+    for (size_t i = 0; i < lines.size(); ++i) 
+    {
+        SourceLine& entry = lines[i];
+        if (entry.labelId != NO_LABEL && labelLine[entry.labelId] == i) symbols.addresses[entry.labelId] += growth;
+        if (!entry.inText) continue;
+        entry.address += growth;
+        if (next < branches.size() && branches[next].line == i) 
+        {
+            entry.relaxation = branches[next].relaxation;
+            growth += relaxedSize(entry.relaxation) - 4;
+            program.relaxedBranches += entry.relaxation != Relaxation::None;
+            ++next;
+            //jal x0 and the inverted branch have no register of their own for the address
+            //of a far target, so auipc + jalr borrows t1 and whatever it held is lost
+            Operands operands = lineOperands(program, entry);
+            bool scratch = entry.relaxation == Relaxation::BranchOverFarJump
+                || (entry.relaxation == Relaxation::FarJump && registerToInt(operands[1]) == 0);
+            if (scratch) 
+            {
+                string_view target = operands[labelOperandIndex(*entry.info)];
+                program.diagnostics.warning(entry.lineNo, tokenColumn(program, entry, target),
+                    "'" + string(target) + "' is out of reach of jal, the jump goes through t1 (x6) and overwrites it");
+            }
+        }
+    }
+    program.textEnd += growth;
+}
+
+//.macro arguments and parameters are separated by commas or blanks
+void splitArguments(string_view text, vector<string_view>& out) 
+{
+    out.clear();
+    size_t i = 0;
+    while (i < text.size()) 
+    {
+        if (isValueSeparator(text[i])) 
+        {
+            ++i;
+            continue;
+        }
+        size_t start = i;
+        while (i < text.size() && !isValueSeparator(text[i])) ++i;
+        out.push_back(text.substr(start, i - start));
+    }
+}
+
+//one .macro definition, views into the source
+struct Macro 
+{
+    vector<string_view> params;
+    vector<string_view> defaults;  //value after '=' in the parameter list, empty if none
+    vector<string_view> body;      //cleaned lines between .macro and .endm
+    int lineNo = 0;                //line of its .macro
+};
+
+//textual .macro/.endm expansion, see expandMacros
+struct MacroExpander 
+{
+    static constexpr int MAX_DEPTH = 32;
+
+    Diagnostics& diagnostics;
+    LabelTable names;     //macro name -> index into macros
+    vector<Macro> macros;
+    size_t expansions = 0;  //value of \@
+    int lineNo = 0;         //source line being expanded, for errors
+    string_view sourceLine; //and its text
+
+    explicit MacroExpander(Diagnostics& diagnostics) : diagnostics(diagnostics) {}
+
+    //append the statements of one line to out, expanding every macro use in it
+    void expandLine(string_view line, string& out, int depth) 
+    {
+        string_view rest = line;
+        bool first = true;
+        do 
+        {
+            size_t end = statementEnd(rest);
+            string_view statement = trim(rest.substr(0, end));
+            rest = end == string_view::npos ? string_view() : rest.substr(end + 1);
+            if (!first) out += "; ";
+            first = false;
+
+            //a label in front of a use stays in front of the expansion; a ':' in a string
+            //is no label, so the text after it is never taken for a use
+            string_view label, use = statement;
+            size_t colon = labelColon(statement);
+            if (colon != string_view::npos) 
+            {
+                label = statement.substr(0, colon + 1);
+                use = trim(statement.substr(colon + 1));
+            }
+            size_t nameEnd = min(use.find_first_of(" \t"), use.size());
+            uint32_t id = names.find(use.substr(0, nameEnd));
+            if (id == NO_LABEL) 
+            {
+                out += statement;
+                continue;
+            }
+            if (depth == MAX_DEPTH) 
+            {
+                diagnostics.error(lineNo, columnOf(sourceLine, use.data()), "macro '" + string(use.substr(0, nameEnd)) + "' nested too deeply");
+                continue;
+            }
+            out += label;
+            if (!label.empty()) out += ' ';
+            invoke(macros[id], use.substr(0, nameEnd), use.substr(nameEnd), out, depth + 1);
+        } while (!rest.empty());
+    }
+
+    //the body with \param replaced by the arguments, each line expanded again so
+    //macros can use macros
+    //every parameter without a default needs an argument and there may be no more arguments
+    //than parameters; a use that has too few is an error and expands to nothing, so the
+    //body does not report the hole as some other mistake, one with too many expands without them
+    void invoke(const Macro& macro, string_view name, string_view argumentText, string& out, int depth) 
+    {
+        vector<string_view> arguments;
+        splitArguments(argumentText, arguments);
+        size_t required = 0;
+        for (size_t k = 0; k < macro.params.size(); ++k) 
+        {
+            if (!macro.defaults[k].data()) required = k + 1;
+        }
+        if (arguments.size() < required || arguments.size() > macro.params.size()) 
+        {
+            size_t expected = arguments.size() < required ? required : macro.params.size();
+            string message = "macro '" + string(name) + "' expects " + (required < macro.params.size() ? "at " + string(arguments.size() < required ? "least " : "most ") : "")
+                + to_string(expected) + (expected == 1 ? " argument" : " arguments") + ", got " + to_string(arguments.size());
+            const char* at = arguments.size() > macro.params.size() ? arguments[macro.params.size()].data() : name.data();
+            diagnostics.error(lineNo, columnOf(sourceLine, at), move(message));
+            if (arguments.size() < required) return;
+            arguments.resize(macro.params.size());
+        }
+        string number = to_string(expansions++);
+        string text;
+        for (size_t line = 0; line < macro.body.size(); ++line) 
+        {
+            string_view body = macro.body[line];
+            text.clear();
+            for (size_t i = 0; i < body.size(); ) 
+            {
+                if (body[i] != '\\' || i + 1 == body.size()) 
+                {
+                    text += body[i++];
+                    continue;
+                }
+                if (body[i + 1] == '@') 
+                {
+                    text += number;
+                    i += 2;
+                    continue;
+                }
+                size_t end = i + 1;
+                while (end < body.size() && (isalnum(static_cast<unsigned char>(body[end])) || body[end] == '_')) ++end;
+                auto param = find(macro.params.begin(), macro.params.end(), body.substr(i + 1, end - i - 1));
+                if (param == macro.params.end()) 
+                {
+                    text += body[i++];
+                    continue;
+                }
+                size_t k = param - macro.params.begin();
+                text += k < arguments.size() ? arguments[k] : macro.defaults[k];
+                i = end;
+            }
+            if (line) out += "; ";
+            expandLine(text, out, depth);
+        }
+    }
+};
+
+//expand .macro/.endm before pass 1, which only ever sees the expanded source
+//a definition turns into blank lines and a use into the body on the use's own line,
+//statements joined with ';', so every line keeps its number; in the body \param is the
+//argument (or the default from `param=value`) and \@ counts expansions, for labels local
+//to one use; macros are defined before they are used, like in GNU as
+//sources without ".macro" are left alone, the check is one scan for the word
+void expandMacros(Program& program) 
+{
+    string_view source = program.source.view();
+    if (source.find(".macro") == string_view::npos) return;
+    TraceSpan span("macros");
+
+    MacroExpander expander(program.diagnostics);
+    string out;
+    out.reserve(source.size() + source.size() / 4);
+    LineScanner scanner{source};
+    string_view line;
+    vector<string_view> words;
+    uint32_t defining = NO_LABEL;
+    bool redefining = false;  //the body of a second .macro of a name, which is dropped
+    int lineNo = 0, definedAt = 0;
+    while (scanner.next(line)) 
+    {
+        ++lineNo;
+        string_view cleaned = cleanLine(line);
+        if (defining != NO_LABEL) 
+        {
+            if (cleaned == ".endm") defining = NO_LABEL;
+            else if (!cleaned.empty() && !redefining) expander.macros[defining].body.push_back(cleaned);
+        }
+        else if (cleaned.substr(0, 6) == ".macro" && (cleaned.size() == 6 || isValueSeparator(cleaned[6]))) 
+        {
+            splitArguments(cleaned.substr(6), words);
+            if (words.empty()) 
+            {
+                program.diagnostics.error(lineNo, columnOf(line, cleaned.data()), "bad operand in '" + string(cleaned) + "'");
+            }
+            else 
+            {
+                //a macro defined twice keeps its first definition, same as labels
+                defining = expander.names.intern(words[0]);
+                definedAt = lineNo;
+                redefining = defining < expander.macros.size();
+                if (redefining) 
+                {
+                    string name(words[0]);
+                    program.diagnostics.error(lineNo, columnOf(line, words[0].data()), "macro '" + name + "' already defined");
+                    program.diagnostics.note(expander.macros[defining].lineNo, 0, "first definition of '" + name + "' is here");
+                }
+                else 
+                {
+                    Macro& macro = expander.macros.emplace_back();
+                    macro.lineNo = lineNo;
+                    for (size_t k = 1; k < words.size(); ++k) 
+                    {
+                        size_t equals = words[k].find('=');
+                        macro.params.push_back(words[k].substr(0, equals));
+                        macro.defaults.push_back(equals == string_view::npos ? string_view() : words[k].substr(equals + 1));
+                    }
+                }
+            }
+        }
+        else if (cleaned == ".endm") 
+        {
+            program.diagnostics.error(lineNo, columnOf(line, cleaned.data()), ".endm without .macro");
+        }
+        else if (!cleaned.empty()) 
+        {
+            expander.lineNo = lineNo;
+            expander.sourceLine = line;
+            expander.expandLine(cleaned, out, 0);
+        }
+        out += '\n';
+    }
+    if (defining != NO_LABEL) 
+    {
+        program.diagnostics.error(definedAt, 0, ".macro '" + string(expander.names.names[defining]) + "' has no .endm");
+    }
+    program.source.reset();
+    program.source.owned = move(out);
+}
+
+//.equ/.set directive a statement starts with, empty if it is neither
+string_view constantDirective(string_view statement) 
+{
+    string_view directive = statement.substr(0, 4);
+    bool known = directive == ".equ" || directive == ".set";
+    return known && (statement.size() == 4 || isBlank(statement[4])) ? directive : string_view();
+}
+
+//work out every constant that can be: before layout (laidOut false) the ones that need no
+//label, after it the rest, '.' being the address of the constant's own line; each round
+//takes the constants whose names all have values, until a round adds none, so a use may
+//come before its definition; what fails is reported at the constant's line
+void resolveConstants(Program& program, bool laidOut) 
+{
+    ConstantTable& constants = program.constants;
+    if (constants.entries.empty()) return;
+    if (laidOut) 
+    {
+        for (const SourceLine& entry : program.lines) 
+        {
+            if (entry.tokenCount < 2 || constantDirective(program.tokens[entry.firstToken]).empty()) continue;
+            uint32_t id = constants.names.find(program.tokens[entry.firstToken + 1]);
+            if (id == NO_LABEL || constants.entries[id].lineNo != entry.lineNo) continue;
+            constants.entries[id].address = entry.address;
+            constants.entries[id].inText = entry.inText;
+        }
+        for (Constant& constant : constants.entries) 
+        {
+            if (constant.state == Constant::State::NeedsLayout) constant.state = Constant::State::Pending;
+        }
+    }
+    for (bool progress = true; progress; ) 
+    {
+        progress = false;
+        for (Constant& constant : constants.entries) 
+        {
+            if (constant.state != Constant::State::Pending) continue;
+            ExpressionResult result = evaluateExpression(constant.expression, program, ExpressionSite{laidOut, constant.address, constant.inText});
+            if (result.error == ExpressionError::Pending) continue;
+            progress = true;
+            constant.value = result.value;
+            constant.state = result.error == ExpressionError::None ? Constant::State::Known
+                : result.error == ExpressionError::NeedsLayout ? Constant::State::NeedsLayout : Constant::State::Failed;
+            if (constant.state != Constant::State::Failed) continue;
+            int column = result.symbol.empty() ? constant.column : columnOf(program.source.view(), result.symbol.data());
+            program.diagnostics.error(constant.lineNo, column ? column : constant.column, expressionMessage(result.error, constant.expression, result.symbol));
+        }
+    }
+    //what is left waits on itself, before layout possibly on a label through another constant
+    for (size_t id = 0; id < constants.entries.size(); ++id) 
+    {
+        Constant& constant = constants.entries[id];
+        if (constant.state != Constant::State::Pending) continue;
+        constant.state = laidOut ? Constant::State::Failed : Constant::State::NeedsLayout;
+        if (laidOut) program.diagnostics.error(constant.lineNo, constant.column, expressionMessage(ExpressionError::Pending, constant.expression, constants.names.names[id]));
+    }
+}
+
+//.equ NAME, expr / .set NAME, expr: every constant is gathered before pass 1 and the
+//ones that need no label are worked out, so li and .zero/.space/.align can use them to
+//size their lines; a name is defined once, and constants come before labels of the same name
+//sources without either directive are left alone, the check is one scan for each
+void collectConstants(Program& program) 
+{
+    program.constants.clear();
+    string_view source = program.source.view();
+    if (source.find(".equ") == string_view::npos && source.find(".set") == string_view::npos) return;
+    TraceSpan span("constants");
+
+    ConstantTable& constants = program.constants;
+    LineScanner scanner{source};
+    string_view line;
+    int lineNo = 0;
+    while (scanner.next(line)) 
+    {
+        ++lineNo;
+        string_view rest = cleanLine(line);
+        //statements and labels as tokenizeChunk splits them
+        do 
+        {
+            size_t end = statementEnd(rest);
+            string_view statement = trim(rest.substr(0, end));
+            rest = end == string_view::npos ? string_view() : rest.substr(end + 1);
+            size_t colon = labelColon(statement);
+            if (colon != string_view::npos) statement = trim(statement.substr(colon + 1));
+            if (constantDirective(statement).empty()) continue;
+
+            string_view arguments = ltrim(statement.substr(4));
+            string_view name = arguments.substr(0, min(arguments.find_first_of(", \t"), arguments.size()));
+            string_view expression = ltrim(arguments.substr(name.size()));
+            if (!expression.empty() && expression[0] == ',') expression = ltrim(expression.substr(1));
+            if (name.empty() || expression.empty()) 
+            {
+                program.diagnostics.error(lineNo, columnOf(source, statement.data()), "bad operand in '" + string(statement) + "'");
+                continue;
+            }
+            uint32_t id = constants.names.intern(name);
+            if (id < constants.entries.size()) 
+            {
+                program.diagnostics.error(lineNo, columnOf(source, name.data()), "constant '" + string(name) + "' already defined on line " + to_string(constants.entries[id].lineNo));
+                continue;
+            }
+            Constant constant;
+            constant.expression = expression;
+            constant.lineNo = lineNo;
+            constant.column = columnOf(source, expression.data());
+            constants.entries.push_back(constant);
+        } while (!rest.empty());
+    }
+    resolveConstants(program, false);
+}
+
+//tokenize the source, assign an address to every line and record label addresses
+//runs on `jobs` threads: chunks are tokenized and sized in parallel, an exclusive
+//prefix scan over the chunk sizes fixes each chunk's start addresses, and the
+//chunks are then fixed up in parallel; label ids and addresses are merged into
+//program.symbols in source order, and out of range branches are relaxed last
+//returns the number of heap allocations made while tokenizing
+size_t runPass1(Program& program, int jobs) 
+{
+    expandMacros(program);
+    collectConstants(program);
+
+    //cut the source at line ends, about 8 chunks per thread but none under 64KB
+    string_view source = program.source.view();
+    size_t chunkCount = jobs <= 1 ? 1 : min<size_t>(static_cast<size_t>(jobs) * 8, source.size() / 65536 + 1);
+    while (program.chunkArenas.size() < chunkCount) program.chunkArenas.push_back(make_unique<Arena>());
+    vector<Pass1Chunk> chunks;
+    chunks.reserve(chunkCount);
+    size_t begin = 0;
+    for (size_t i = 0; i < chunkCount; ++i) 
+    {
+        program.chunkArenas[i]->reset();
+        chunks.emplace_back(*program.chunkArenas[i]);
+        size_t end = i + 1 == chunkCount ? source.size() : max(begin, source.size() * (i + 1) / chunkCount);
+        if (end < source.size()) 
+        {
+            end = source.find('\n', end);
+            end = end == string_view::npos ? source.size() : end + 1;
+        }
+        chunks[i].source = source.substr(begin, end - begin);
+        begin = end;
+    }
+
+    atomic<size_t> tokenizeAllocations{0};
+    parallelFor(chunkCount, jobs, [&](size_t i) {
+        TraceSpan span("tokenize");
+#ifdef COUNT_ALLOCATIONS
+        size_t before = heapAllocations;
+        tokenizeChunk(chunks[i], program);
+        tokenizeAllocations.fetch_add(heapAllocations - before, memory_order_relaxed);
+#else
+        tokenizeChunk(chunks[i], program);
+#endif
+        span.items = chunks[i].lines.size();
+    });
+
+    //exclusive prefix scan over the chunk summaries
+    TraceSpan scan("prefix scan", chunkCount);
+    Location location{TEXT_BASE, DATA_BASE};
+    bool inTextSegment = true;
+    int lineNo = 0;
+    size_t lineCount = 0, tokenCount = 0;
+    for (Pass1Chunk& chunk : chunks) 
+    {
+        chunk.startsInText = inTextSegment;
+        chunk.start = location;
+        chunk.firstLineNo = lineNo;
+        chunk.lineIndex = lineCount;
+        chunk.tokenIndex = tokenCount;
+
+        if (chunk.aligns) 
+        {
+            //same walk as fixupChunk, addresses only
+            for (size_t i = 0; i < chunk.lines.size(); ++i) 
+            {
+                SourceLine entry = chunk.lines[i];
+                if (i < chunk.headLines) entry.inText = inTextSegment;
+                placeLine(entry, entry.tokenCount ? chunk.tokens[entry.firstToken] : string_view(), location);
+            }
+        }
+        else 
+        {
+            location += inTextSegment ? chunk.headAsText : chunk.headAsData;
+            location += chunk.rest;
+        }
+        if (chunk.switchesSegment) inTextSegment = chunk.endsInText;
+        lineNo += chunk.lineCount;
+        lineCount += chunk.lines.size();
+        tokenCount += chunk.tokens.size();
+    }
+    program.textEnd = location.text;
+    program.dataEnd = location.data;
+
+    //give every chunk-local label its global id, in source order
+    for (Pass1Chunk& chunk : chunks) 
+    {
+        chunk.labelRemap.resize(chunk.labels.size());
+        for (size_t id = 0; id < chunk.labels.size(); ++id) 
+        {
+            chunk.labelRemap[id] = program.symbols.intern(chunk.labels.names[id]);
+        }
+    }
+
+    program.lines.resize(lineCount);
+    program.tokens.resize(tokenCount);
+    scan.finish();
+    parallelFor(chunkCount, jobs, [&](size_t i) {
+        TraceSpan span("fixup", chunks[i].lines.size());
+        fixupChunk(chunks[i], program);
+    });
+
+    //a label defined twice keeps its first definition, the second is an error
+    TraceSpan merge("merge labels", program.symbols.size());
+    vector<int> firstLine;  //line of each label's first definition, once there is a second one
+    for (const Pass1Chunk& chunk : chunks) 
+    {
+        for (const Pass1Chunk::Definition& definition : chunk.definitions) 
+        {
+            long& address = program.symbols.addresses[definition.id];
+            if (address == UNDEFINED_ADDRESS) 
+            {
+                address = definition.address;
+                continue;
+            }
+            if (firstLine.empty()) 
+            {
+                firstLine.assign(program.symbols.size(), 0);
+                for (const SourceLine& entry : program.lines) 
+                {
+                    if (entry.labelId != NO_LABEL && !firstLine[entry.labelId]) firstLine[entry.labelId] = entry.lineNo;
+                }
+            }
+            const SourceLine& entry = program.lines[chunk.lineIndex + definition.line];
+            string name(entry.label);
+            program.diagnostics.error(entry.lineNo, tokenColumn(program, entry, entry.label), "label '" + name + "' already defined");
+            program.diagnostics.note(firstLine[definition.id], 0, "first definition of '" + name + "' is here");
+        }
+        //a directive pass 1 does not know is ignored, an instruction it does not know is an error
+        for (uint32_t i : chunk.unknown) 
+        {
+            const SourceLine& entry = program.lines[chunk.lineIndex + i];
+            string_view name = program.tokens[entry.firstToken];
+            int column = tokenColumn(program, entry, name);
+            if (name == ".globl" || name == ".global") continue; //exports, only a link reads them
+            if (!constantDirective(name).empty()) continue;      //read by collectConstants
+            if (name[0] == '.') program.diagnostics.warning(entry.lineNo, column, "ignoring directive '" + string(name) + "' in .text");
+            else if (const PseudoArity* pseudo = findPseudoArity(name)) 
+            {
+                size_t got = entry.tokenCount - 1;
+                program.diagnostics.error(entry.lineNo, column, "'" + string(name) + "' expects " + to_string(pseudo->operands)
+                    + (pseudo->operands == 1 ? " operand" : " operands") + ", got " + to_string(got));
+            }
+            else program.diagnostics.error(entry.lineNo, column, "unknown instruction '" + string(name) + "'");
+        }
+        for (uint32_t i : chunk.badDirectives) 
+        {
+            const SourceLine& entry = program.lines[chunk.lineIndex + i];
+            string_view at;
+            string message = badDirectiveMessage(program, entry, at);
+            program.diagnostics.error(entry.lineNo, tokenColumn(program, entry, at), move(message));
+        }
+    }
+    merge.finish();
+    relaxBranches(program);
+    resolveConstants(program, true);
+    return tokenizeAllocations.load();
+}
+
+//encoded text and data segments, ready to be loaded as-is
+struct Image 
+{
+    vector<uint32_t> text;  //one word per instruction, starting at TEXT_BASE
+    vector<uint8_t> data;   //raw bytes, starting at DATA_BASE
+};
+
+//append value as `bytes` little-endian bytes
+void putLE(vector<uint8_t>& out, uint64_t value, int bytes) 
+{
+    for (int i = 0; i < bytes; ++i) out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+//overwrite `bytes` little-endian bytes at offset
+void patchLE(vector<uint8_t>& out, size_t offset, uint64_t value, int bytes) 
+{
+    for (int i = 0; i < bytes; ++i) out[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+//append value as an unsigned/signed LEB128 number, 7 bits per byte
+void putULEB(vector<uint8_t>& out, uint64_t value) 
+{
+    do 
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out.push_back(value ? byte | 0x80 : byte);
+    } while (value);
+}
+
+void putSLEB(vector<uint8_t>& out, int64_t value) 
+{
+    bool more = true;
+    while (more) 
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+        out.push_back(more ? byte | 0x80 : byte);
+    }
+}
+
+//value of each character as a digit, 0xFF for anything that is not one
+constexpr array<uint8_t, 256> makeDigitValues() 
+{
+    array<uint8_t, 256> values{};
+    for (size_t c = 0; c < values.size(); ++c) values[c] = 0xFF;
+    for (int d = 0; d < 10; ++d) values['0' + d] = static_cast<uint8_t>(d);
+    for (int d = 0; d < 6; ++d) values['a' + d] = values['A' + d] = static_cast<uint8_t>(10 + d);
+    return values;
+}
+
+constexpr auto digitValues = makeDigitValues();
+
+//parse `count` decimal or 0x values (with an optional sign) straight into consecutive
+//little-endian `width`-byte slots of out, one pass over the list with no per-value call,
+//stream or allocation
+//a value that is not a plain number is evaluated as an expression on entry's line (see
+//evaluateOperand); a value must fit the slot as a signed or an unsigned number, as in gas
+//(.byte takes -128..255); stops at the first one without a value or out of range and
+//returns false, status says why
+bool parseDataValues(const Program& program, const SourceLine& entry, string_view values, int width, size_t count, uint8_t* out, OperandStatus& status) 
+{
+    const char* p = values.data();
+    const char* end = p + values.size();
+    //.dword takes every 64-bit value
+    long low = width < 8 ? -(1L << (8 * width - 1)) : LONG_MIN;
+    long high = width < 8 ? (1L << (8 * width)) - 1 : LONG_MAX;
+    for (size_t k = 0; k < count; ++k, out += width) 
+    {
+        while (p < end && isValueSeparator(*p)) ++p;
+        const char* start = p;
+        bool negative = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) ++p;
+        uint64_t base = 10;
+        if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) 
+        {
+            p += 2;
+            base = 16;
+        }
+        const char* digits = p;
+        uint64_t value = 0;
+        bool overflow = false;
+        for (uint64_t digit; p < end && (digit = digitValues[static_cast<unsigned char>(*p)]) < base; ++p) 
+        {
+            overflow |= __builtin_mul_overflow(value, base, &value) | __builtin_add_overflow(value, digit, &value);
+        }
+        size_t at = start - values.data();
+        //more than 64 bits is not a number, as for an immediate
+        if (overflow) 
+        {
+            status.fail(OperandError::BadNumber, string_view(start, valueEnd(values, at, false) - at));
+            return false;
+        }
+        //a blank after a number may still be inside an expression (1 + 2)
+        if (p == digits || (p < end && *p != ',' && valueEnd(values, at, false) != static_cast<size_t>(p - values.data()))) 
+        {
+            p = values.data() + valueEnd(values, at, false);
+            long number = evaluateOperand(program, entry, string_view(start, p - start), OperandError::BadNumber, status);
+            if (!status.failed() && (number < low || number > high)) status.failRange(string_view(start, p - start), number, low, high);
+            if (status.failed()) return false;
+            value = static_cast<uint64_t>(number);
+        }
+        else 
+        {
+            if (width < 8 && (negative ? value > 0 - static_cast<uint64_t>(low) : value > static_cast<uint64_t>(high))) 
+            {
+                status.failRange(string_view(start, p - start), negative ? static_cast<long>(0 - value) : static_cast<long>(value), low, high);
+                return false;
+            }
+            if (negative) value = 0 - value;
+        }
+        for (int b = 0; b < width; ++b) out[b] = static_cast<uint8_t>(value >> (8 * b));
+    }
+    return true;
+}
+
+//write the dataLineSize(entry, directive) bytes of one data line to out, which the
+//caller has zeroed (.zero, .space, .align and the .asciz terminator rely on that)
+//false with the value in status if a value list holds something that has no value
+bool emitDataBytes(const Program& program, const SourceLine& entry, string_view directive, uint8_t* out, OperandStatus& status) 
+{
+    long size = dataLineSize(entry, directive);
+    string_view text;
+    if (int width = dataValueWidth(directive)) 
+    {
+        return parseDataValues(program, entry, directiveArguments(entry, directive), width, static_cast<size_t>(size / width), out, status);
+    }
+    else if (directive == ".asciz" && size > 0 && quotedText(entry, text)) 
+    {
+        decodeString(text, out);
+    }
+    else if (directive == ".incbin" && size > 0 && quotedText(entry, text)) 
+    {
+        //the bytes pass 1 sized the line with, the file is not read again
+        if (const SourceBuffer* file = program.includedFiles.open(text)) memcpy(out, file->view().data(), min<size_t>(size, file->view().size()));
+    }
+    return true;
+}
+
+//flat little-endian image: .text at file offset TEXT_BASE, .data at DATA_BASE,
+//written through one mmap of the output file so the gap stays a sparse hole
+//stdout ("-") cannot be mapped, so there the zero gap is written out in blocks
+bool writeFlatImage(const string& filename, const Image& image) 
+{
+    size_t textBytes = image.text.size() * 4;
+    size_t fileSize = image.data.empty() ? textBytes : DATA_BASE + image.data.size();
+    if (filename == "-") 
+    {
+        vector<uint8_t> text;
+        text.reserve(textBytes);
+        for (uint32_t word : image.text) putLE(text, word, 4);
+        if (!writeAll(STDOUT_FILENO, text.data(), text.size())) return false;
+        if (image.data.empty()) return true;
+        vector<uint8_t> zeros(1 << 20);
+        for (size_t at = textBytes; at < static_cast<size_t>(DATA_BASE); at += zeros.size()) 
+        {
+            if (!writeAll(STDOUT_FILENO, zeros.data(), min(zeros.size(), DATA_BASE - at))) return false;
+        }
+        return writeAll(STDOUT_FILENO, image.data.data(), image.data.size());
+    }
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = ftruncate(fd, static_cast<off_t>(fileSize)) == 0;
+    if (ok && fileSize > 0) 
+    {
+        void* map = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ok = map != MAP_FAILED;
+        if (ok) 
+        {
+            uint8_t* bytes = static_cast<uint8_t*>(map);
+            for (size_t i = 0; i < image.text.size(); ++i) 
+            {
+                for (int b = 0; b < 4; ++b) bytes[TEXT_BASE + i * 4 + b] = static_cast<uint8_t>(image.text[i] >> (8 * b));
+            }
+            if (!image.data.empty()) memcpy(bytes + DATA_BASE, image.data.data(), image.data.size());
+            ok = munmap(map, fileSize) == 0;
+        }
+    }
+    return close(fd) == 0 && ok;
+}
+
+//one row of the .text address -> source line map: the words from address up to the
+//next row (or the end of the map) came from line of file
+struct LineRow 
+{
+    long address;
+    uint32_t file;  //index into LineMap::files
+    int line;
+};
+
+//.text address -> source line map of an assembly, or of every file of a link laid out
+//one after the other; a run of words from one line (a pseudo-instruction, a relaxed
+//branch, the statements of a line split by ;) is a single row
+struct LineMap 
+{
+    vector<string> files;
+    vector<LineRow> rows;   //ascending addresses
+    long end = TEXT_BASE;   //address after the last row's words
+
+    //the rows of program's .text, moved to textBase
+    void add(const Program& program, string name, long textBase) 
+    {
+        uint32_t file = static_cast<uint32_t>(files.size());
+        files.push_back(move(name));
+        for (const SourceLine& entry : program.lines) 
+        {
+            if (!entry.inText || (!entry.info && entry.pseudo == Pseudo::None)) continue;
+            long size = entry.pseudo != Pseudo::None ? entry.size : relaxedSize(entry.relaxation);
+            if (size == 0) continue;
+            long address = entry.address - TEXT_BASE + textBase;
+            bool sameLine = !rows.empty() && rows.back().file == file && rows.back().line == entry.lineNo;
+            if (!sameLine) rows.push_back({address, file, entry.lineNo});
+        }
+        end = program.textEnd - TEXT_BASE + textBase;
+    }
+
+    //row holding address, nullptr outside the map
+    const LineRow* find(long address) const 
+    {
+        if (address < TEXT_BASE || address >= end) return nullptr;
+        auto after = upper_bound(rows.begin(), rows.end(), address, [](long at, const LineRow& row) { return at < row.address; });
+        return after == rows.begin() ? nullptr : &*(after - 1);
+    }
+};
+
+//--line-map file: "linemap 1", then for each file a "file NAME" line followed by its rows
+//as "ADDRESS LINE" deltas from the row before (the address from TEXT_BASE and on across
+//files, the line from 0 at each file), and "end SIZE", the bytes the last row covers
+string lineMapText(const LineMap& map) 
+{
+    string out = "linemap 1\n";
+    long address = TEXT_BASE;
+    int line = 0;
+    uint32_t file = UINT32_MAX;
+    for (const LineRow& row : map.rows) 
+    {
+        if (row.file != file) 
+        {
+            file = row.file;
+            line = 0;
+            out += "file ";
+            out += map.files[file];
+            out += '\n';
+        }
+        out += to_string(row.address - address);
+        out += ' ';
+        out += to_string(row.line - line);
+        out += '\n';
+        address = row.address;
+        line = row.line;
+    }
+    out += "end " + to_string(map.end - address) + '\n';
+    return out;
+}
+
+//DWARF 4 .debug_line unit for map: one sequence over .text, four bytes per address step,
+//a line and address step that fit go in one special opcode byte
+vector<uint8_t> buildDebugLine(const LineMap& map) 
+{
+    constexpr int LINE_BASE = -5, LINE_RANGE = 14, OPCODE_BASE = 13;
+    //standard opcodes
+    enum { DW_LNS_copy = 1, DW_LNS_advance_pc, DW_LNS_advance_line, DW_LNS_set_file };
+    //extended opcodes, after a 0 byte and their length
+    enum { DW_LNE_end_sequence = 1, DW_LNE_set_address };
+
+    vector<uint8_t> out;
+    putLE(out, 0, 4);       //unit_length, patched below
+    putLE(out, 4, 2);       //version
+    putLE(out, 0, 4);       //header_length, patched below
+    size_t headerStart = out.size();
+    out.push_back(4);       //minimum_instruction_length
+    out.push_back(1);       //maximum_operations_per_instruction
+    out.push_back(1);       //default_is_stmt
+    out.push_back(static_cast<uint8_t>(LINE_BASE));
+    out.push_back(LINE_RANGE);
+    out.push_back(OPCODE_BASE);
+    const uint8_t operandCounts[OPCODE_BASE - 1] = {0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1};
+    out.insert(out.end(), operandCounts, operandCounts + sizeof(operandCounts));
+    out.push_back(0);       //no include_directories
+    for (const string& file : map.files) 
+    {
+        out.insert(out.end(), file.begin(), file.end());
+        out.push_back(0);
+        out.insert(out.end(), {0, 0, 0});  //directory, mtime, length
+    }
+    out.push_back(0);
+    patchLE(out, 6, out.size() - headerStart, 4);
+
+    out.insert(out.end(), {0, 9, DW_LNE_set_address});
+    putLE(out, TEXT_BASE, 8);
+    long address = TEXT_BASE;
+    long line = 1;
+    uint32_t file = 0;
+    for (const LineRow& row : map.rows) 
+    {
+        if (row.file != file) 
+        {
+            file = row.file;
+            out.push_back(DW_LNS_set_file);
+            putULEB(out, file + 1);
+        }
+        long lineStep = row.line - line;
+        long addressStep = (row.address - address) / 4;
+        if (lineStep < LINE_BASE || lineStep >= LINE_BASE + LINE_RANGE) 
+        {
+            out.push_back(DW_LNS_advance_line);
+            putSLEB(out, lineStep);
+            lineStep = 0;
+        }
+        long special = lineStep - LINE_BASE + LINE_RANGE * addressStep + OPCODE_BASE;
+        if (special > 255) 
+        {
+            out.push_back(DW_LNS_advance_pc);
+            putULEB(out, addressStep);
+            special = lineStep - LINE_BASE + OPCODE_BASE;
+        }
+        out.push_back(static_cast<uint8_t>(special));
+        address = row.address;
+        line = row.line;
+    }
+    out.push_back(DW_LNS_advance_pc);
+    putULEB(out, (map.end - address) / 4);
+    out.insert(out.end(), {0, 1, DW_LNE_end_sequence});
+    patchLE(out, 0, out.size() - 4, 4);
+    return out;
+}
+
+//--symbols file: every defined label as "ADDRESS SIZE TYPE NAME" sorted by address, like
+//nm -nS; the size runs to the next label of the segment (or its end), the type is t/d
+//for .text/.data, upper case for the first globalCount ids (the globals of a link)
+string symbolFileText(const LabelTable& symbols, size_t globalCount, long textEnd, long dataEnd) 
+{
+    vector<uint32_t> ids = definedLabelsByName(symbols);
+    stable_sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) { return symbols.addresses[a] < symbols.addresses[b]; });
+    string out;
+    for (size_t i = 0; i < ids.size(); ++i) 
+    {
+        long address = symbols.addresses[ids[i]];
+        bool inData = address >= DATA_BASE;
+        long next = inData ? dataEnd : textEnd;
+        if (i + 1 < ids.size() && (symbols.addresses[ids[i + 1]] >= DATA_BASE) == inData) next = symbols.addresses[ids[i + 1]];
+        appendHex(out, address, 8);
+        out += ' ';
+        appendHex(out, max(0L, next - address), 8);
+        out += ' ';
+        char type = inData ? 'd' : 't';
+        out += ids[i] < globalCount ? static_cast<char>(toupper(type)) : type;
+        out += ' ';
+        out += symbols.names[ids[i]];
+        out += '\n';
+    }
+    return out;
+}
+
+//minimal ELF64 RISC-V executable: two PT_LOAD segments and
+//.text/.data/.symtab/.strtab/.shstrtab sections, built in memory and written once
+//the first globalCount ids of symbols are the globals of a link (see symbolFileText)
+//with lines it also carries DWARF: .debug_line, and a .debug_info/.debug_abbrev compile
+//unit pointing at it, which is what addr2line and debuggers look for first
+vector<uint8_t> buildElf(const Image& image, const LabelTable& symbols, size_t globalCount, const LineMap* lines = nullptr) 
+{
+    constexpr uint64_t PAGE = 0x1000;
+    constexpr int EHDR_SIZE = 64, PHDR_SIZE = 56, SHDR_SIZE = 64, SYM_SIZE = 24;
+    //section indices, the debug sections only with lines
+    enum { SEC_NULL, SEC_TEXT, SEC_DATA, SEC_SYMTAB, SEC_STRTAB, SEC_SHSTRTAB, SEC_DEBUG_LINE, SEC_DEBUG_INFO, SEC_DEBUG_ABBREV, SEC_COUNT };
+    int sectionCount = lines ? SEC_COUNT : SEC_DEBUG_LINE;
+
+    auto alignTo = [](vector<uint8_t>& out, uint64_t align) {
+        out.resize((out.size() + align - 1) / align * align);
+    };
+
+    vector<uint8_t> out;
+    out.resize(EHDR_SIZE + 2 * PHDR_SIZE);
+
+    alignTo(out, PAGE);
+    uint64_t textOffset = out.size();
+    for (uint32_t word : image.text) putLE(out, word, 4);
+    uint64_t textSize = out.size() - textOffset;
+
+    alignTo(out, PAGE);
+    uint64_t dataOffset = out.size();
+    out.insert(out.end(), image.data.begin(), image.data.end());
+    uint64_t dataSize = image.data.size();
+
+    //index 0 is the reserved null symbol; ELF wants every local before the first global,
+    //whose index goes in the sh_info of .symtab
+    string strtab(1, '\0');
+    alignTo(out, 8);
+    uint64_t symtabOffset = out.size();
+    out.resize(out.size() + SYM_SIZE);
+    uint64_t entry = TEXT_BASE;
+    vector<uint32_t> ids = definedLabelsByName(symbols);
+    auto firstGlobal = stable_partition(ids.begin(), ids.end(), [&](uint32_t id) { return id >= globalCount; });
+    uint32_t firstGlobalIndex = static_cast<uint32_t>(1 + (firstGlobal - ids.begin()));
+    for (uint32_t id : ids) 
+    {
+        string_view label = symbols.names[id];
+        long address = symbols.addresses[id];
+        bool inData = address >= DATA_BASE;
+        uint8_t binding = id < globalCount ? 1 : 0;   //STB_GLOBAL, STB_LOCAL
+        putLE(out, strtab.size(), 4);                  //st_name
+        out.push_back(binding << 4 | (inData ? 1 : 2)); //st_info: binding, STT_OBJECT/STT_FUNC
+        out.push_back(0);                              //st_other
+        putLE(out, inData ? SEC_DATA : SEC_TEXT, 2);   //st_shndx
+        putLE(out, address, 8);                        //st_value
+        putLE(out, 0, 8);                              //st_size
+        strtab += label;
+        strtab += '\0';
+        if (label == "_start") entry = address;
+    }
+    uint64_t symtabSize = out.size() - symtabOffset;
+
+    uint64_t strtabOffset = out.size();
+    out.insert(out.end(), strtab.begin(), strtab.end());
+
+    const char shstrtab[] = "\0.text\0.data\0.symtab\0.strtab\0.shstrtab\0.debug_line\0.debug_info\0.debug_abbrev";
+    const uint32_t shName[SEC_COUNT] = {0, 1, 7, 13, 21, 29, 39, 51, 63};
+    uint64_t shstrtabOffset = out.size();
+    uint64_t shstrtabSize = lines ? sizeof(shstrtab) : shName[SEC_DEBUG_LINE];
+    out.insert(out.end(), shstrtab, shstrtab + shstrtabSize);
+
+    //one compile unit over all of .text, named after the first file, with its lines
+    //at offset 0 of .debug_line
+    uint64_t debugLineOffset = out.size(), debugLineSize = 0;
+    uint64_t debugInfoOffset = 0, debugInfoSize = 0, debugAbbrevOffset = 0, debugAbbrevSize = 0;
+    if (lines) 
+    {
+        vector<uint8_t> program = buildDebugLine(*lines);
+        out.insert(out.end(), program.begin(), program.end());
+        debugLineSize = program.size();
+
+        //abbreviation 1: DW_TAG_compile_unit without children, DW_AT_name string, DW_AT_stmt_list
+        //sec_offset, DW_AT_low_pc addr, DW_AT_high_pc data8 (a length), DW_AT_language data2
+        const uint8_t abbrev[] = {1, 0x11, 0, 0x03, 0x08, 0x10, 0x17, 0x11, 0x01, 0x12, 0x07, 0x13, 0x05, 0, 0, 0};
+        debugAbbrevOffset = out.size();
+        out.insert(out.end(), abbrev, abbrev + sizeof(abbrev));
+        debugAbbrevSize = sizeof(abbrev);
+
+        debugInfoOffset = out.size();
+        putLE(out, 0, 4);        //unit_length, patched below
+        putLE(out, 4, 2);        //version
+        putLE(out, 0, 4);        //debug_abbrev_offset
+        out.push_back(8);        //address_size
+        out.push_back(1);        //abbreviation code
+        string name = lines->files.empty() ? string() : lines->files.front();
+        out.insert(out.end(), name.begin(), name.end());
+        out.push_back(0);
+        putLE(out, 0, 4);                             //DW_AT_stmt_list
+        putLE(out, TEXT_BASE, 8);                     //DW_AT_low_pc
+        putLE(out, lines->end - TEXT_BASE, 8);        //DW_AT_high_pc
+        putLE(out, 0x8001, 2);                        //DW_AT_language: DW_LANG_Mips_Assembler
+        debugInfoSize = out.size() - debugInfoOffset;
+        patchLE(out, debugInfoOffset, debugInfoSize - 4, 4);
+    }
+
+    alignTo(out, 8);
+    uint64_t shOffset = out.size();
+    auto section = [&](int index, uint32_t type, uint64_t flags, uint64_t addr, uint64_t offset,
+                       uint64_t size, uint32_t link, uint32_t info, uint64_t align, uint64_t entsize) {
+        putLE(out, shName[index], 4);
+        putLE(out, type, 4);
+        putLE(out, flags, 8);
+        putLE(out, addr, 8);
+        putLE(out, offset, 8);
+        putLE(out, size, 8);
+        putLE(out, link, 4);
+        putLE(out, info, 4);
+        putLE(out, align, 8);
+        putLE(out, entsize, 8);
+    };
+    //sh_type: 1 PROGBITS, 2 SYMTAB, 3 STRTAB; sh_flags: 1 WRITE, 2 ALLOC, 4 EXECINSTR
+    out.resize(out.size() + SHDR_SIZE);
+    section(SEC_TEXT, 1, 2 | 4, TEXT_BASE, textOffset, textSize, 0, 0, 4, 0);
+    section(SEC_DATA, 1, 1 | 2, DATA_BASE, dataOffset, dataSize, 0, 0, 8, 0);
+    section(SEC_SYMTAB, 2, 0, 0, symtabOffset, symtabSize, SEC_STRTAB, firstGlobalIndex, 8, SYM_SIZE);
+    section(SEC_STRTAB, 3, 0, 0, strtabOffset, strtab.size(), 0, 0, 1, 0);
+    section(SEC_SHSTRTAB, 3, 0, 0, shstrtabOffset, shstrtabSize, 0, 0, 1, 0);
+    if (lines) 
+    {
+        section(SEC_DEBUG_LINE, 1, 0, 0, debugLineOffset, debugLineSize, 0, 0, 1, 0);
+        section(SEC_DEBUG_INFO, 1, 0, 0, debugInfoOffset, debugInfoSize, 0, 0, 1, 0);
+        section(SEC_DEBUG_ABBREV, 1, 0, 0, debugAbbrevOffset, debugAbbrevSize, 0, 0, 1, 0);
+    }
+
+    //ELF header
+    const uint8_t ident[16] = {0x7F, 'E', 'L', 'F', 2 /*64-bit*/, 1 /*little endian*/, 1 /*version*/};
+    copy(ident, ident + 16, out.begin());
+    patchLE(out, 16, 2, 2);            //e_type: ET_EXEC
+    patchLE(out, 18, 243, 2);          //e_machine: EM_RISCV
+    patchLE(out, 20, 1, 4);            //e_version
+    patchLE(out, 24, entry, 8);        //e_entry
+    patchLE(out, 32, EHDR_SIZE, 8);    //e_phoff
+    patchLE(out, 40, shOffset, 8);     //e_shoff
+    patchLE(out, 48, 0, 4);            //e_flags: soft-float ABI
+    patchLE(out, 52, EHDR_SIZE, 2);    //e_ehsize
+    patchLE(out, 54, PHDR_SIZE, 2);    //e_phentsize
+    patchLE(out, 56, 2, 2);            //e_phnum
+    patchLE(out, 58, SHDR_SIZE, 2);    //e_shentsize
+    patchLE(out, 60, sectionCount, 2); //e_shnum
+    patchLE(out, 62, SEC_SHSTRTAB, 2); //e_shstrndx
+
+    //program headers: p_type PT_LOAD, p_flags 1 X, 2 W, 4 R
+    auto segment = [&](size_t at, uint32_t flags, uint64_t offset, uint64_t vaddr, uint64_t size) {
+        patchLE(out, at, 1, 4);
+        patchLE(out, at + 4, flags, 4);
+        patchLE(out, at + 8, offset, 8);
+        patchLE(out, at + 16, vaddr, 8);
+        patchLE(out, at + 24, vaddr, 8);
+        patchLE(out, at + 32, size, 8);
+        patchLE(out, at + 40, size, 8);
+        patchLE(out, at + 48, PAGE, 8);
+    };
+    segment(EHDR_SIZE, 4 | 1, textOffset, TEXT_BASE, textSize);
+    segment(EHDR_SIZE + PHDR_SIZE, 4 | 2, dataOffset, DATA_BASE, dataSize);
+    return out;
+}
+
+bool writeElf(const string& filename, const Image& image, const LabelTable& symbols, size_t globalCount, const LineMap* lines = nullptr) 
+{
+    vector<uint8_t> out = buildElf(image, symbols, globalCount, lines);
+    if (filename == "-") return writeAll(STDOUT_FILENO, out.data(), out.size());
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, out.data(), out.size());
+    return close(fd) == 0 && ok;
+}
+
+//the --line-map and --symbols files, written whole
+bool writeTextFile(const string& filename, const string& text) 
+{
+    int fd = filename == "-" ? STDOUT_FILENO : open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, text.data(), text.size());
+    return (fd == STDOUT_FILENO || close(fd) == 0) && ok;
+}
+
+//what pass 2 writes for each instruction
+enum class OutputFormat 
+{
+    Venus, //address, word, compressed assembly and debug string (default)
+    Hex,   //address and word only
+    Bin,   //address and word as 32 binary digits
+    Raw,   //flat little-endian memory image, .text at 0x0 and .data at 0x10000000
+    Elf    //ELF64 RISC-V executable with .text, .data and .symtab
+};
+
+//synthetic source for --bench / --generate
+struct WorkloadConfig 
+{
+    size_t textLines = 1000000;               //instructions in .text
+    size_t dataLines = 10000;                 //directives in .data
+    array<double, 6> mix = {40, 30, 10, 10, 5, 5}; //weights for R, I, S, SB, U, UJ
+    double labelDensity = 0.1;                //fraction of instructions carrying a label
+    size_t branchDistance = 16;               //max labels between a branch/jump and its target, either way
+    uint64_t seed = 1;
+};
+
+struct Options 
+{
+    string inputFilename = "input.asm";
+    vector<string> inputFilenames;  //every input given; more than one are assembled apart and linked
+    string outputFilename = "output.mc";
+    OutputFormat format = OutputFormat::Venus;
+    int jobs = 1;  //worker threads for pass 1 and pass 2
+    bool quiet = false;  //no progress messages or symbol table dump
+
+    bool bench = false;          //time the phases on a generated workload
+    int benchRuns = 3;
+    string generateFilename;     //write the generated workload here and exit
+    WorkloadConfig workload;
+
+    bool serve = false;          //answer batch requests instead of assembling one file
+    string serveSocket;          //Unix socket for --serve, stdin/stdout if empty
+
+    bool incremental = false;    //reuse the last run's output through cacheFilename
+    string cacheFilename;        //defaults to the output file name + ".cache"
+
+    bool verify = false;         //decode the emitted text again and compare it with the source
+    size_t fuzzCount = 0;        //--fuzz: random instructions per format, 0 = assemble normally
+
+    size_t maxErrors = 20;       //errors printed before the assembly stops, 0 = no limit
+    bool jsonDiagnostics = false; //print warnings and errors as JSON lines instead of text
+
+    bool stats = false;          //print where the time went and what the program held
+    string traceFilename;        //write a Chrome trace of the phases and chunks here
+
+    bool run = false;            //execute the assembled image and report the registers
+    size_t runLimit = 100000000; //instructions --run executes before it gives up
+
+    string lineMapFilename;      //write the .text address -> source line map here
+    string symbolsFilename;      //write the labels sorted by address here
+    bool debugLine = false;      //-g: add DWARF .debug_line to ELF output
+};
+
+void printUsage(const char* program) 
+{
+    cerr << "usage: " << program << " [--format=venus|hex|bin|raw|elf] [-j N] [-q] [--incremental|--cache=FILE] [--verify] [-o output.mc|-] [input.asm ...|-]" << endl;
+    cerr << "           [--max-errors=N] [--diagnostics=text|json] [--stats] [--trace=FILE] [--run] [--run-limit=N]" << endl;
+    cerr << "           [--line-map=FILE] [--symbols=FILE] [-g]" << endl;
+    cerr << "       " << program << " --serve[=SOCKET] [--format=venus|hex|bin|elf] [-j N] [--max-errors=N] [--diagnostics=text|json]" << endl;
+    cerr << "       " << program << " --bench|--generate=FILE [--bench-runs=N] [--bench-lines=N] [--bench-data-lines=N]" << endl;
+    cerr << "           [--bench-mix=R,I,S,SB,U,UJ] [--bench-label-density=F] [--bench-branch-distance=N] [--bench-seed=N]" << endl;
+    cerr << "       " << program << " --fuzz[=N] [-j N] [--bench-seed=N]" << endl;
+}
+
+//whole-string unsigned number, false if anything is left over
+bool parseCount(string_view text, size_t& value) 
+{
+    auto [ptr, ec] = from_chars(text.data(), text.data() + text.size(), value);
+    return ec == errc() && ptr == text.data() + text.size() && !text.empty();
+}
+
+bool parseFraction(string_view text, double& value) 
+{
+    string copy(text);
+    char* end = nullptr;
+    value = strtod(copy.c_str(), &end);
+    return !copy.empty() && *end == '\0' && value >= 0;
+}
+
+//returns false on a bad command line
+bool parseOptions(int argc, char* argv[], Options& options) 
+{
+    for (int i = 1; i < argc; ++i) 
+    {
+        string_view arg = argv[i];
+        //value of a --name=value option
+        auto value = [&](string_view name) { return arg.substr(name.size()); };
+        bool ok = true;
+        size_t count = 0;
+        if (arg.rfind("--format=", 0) == 0) 
+        {
+            string_view format = value("--format=");
+            if (format == "venus") options.format = OutputFormat::Venus;
+            else if (format == "hex") options.format = OutputFormat::Hex;
+            else if (format == "bin") options.format = OutputFormat::Bin;
+            else if (format == "raw") options.format = OutputFormat::Raw;
+            else if (format == "elf") options.format = OutputFormat::Elf;
+            else 
+            {
+                cerr << "Error:unknown output format '" << format << "'" << endl;
+                return false;
+            }
+        }
+        else if (arg.rfind("-j", 0) == 0) 
+        {
+            //-j N or -jN, 0 means one thread per hardware thread
+            string_view jobs = arg.size() > 2 ? arg.substr(2) : (i + 1 < argc ? string_view(argv[++i]) : string_view());
+            if (!parseCount(jobs, count) || count > 4096) 
+            {
+                cerr << "Error:bad thread count '" << jobs << "'" << endl;
+                return false;
+            }
+            options.jobs = count > 0 ? static_cast<int>(count) : max(1, static_cast<int>(thread::hardware_concurrency()));
+        }
+        else if (arg == "-q") options.quiet = true;
+        else if (arg == "--bench") options.bench = true;
+        else if (arg == "--serve") options.serve = true;
+        else if (arg == "--incremental") options.incremental = true;
+        else if (arg == "--verify") options.verify = true;
+        else if (arg == "--stats") options.stats = true;
+        else if (arg == "--run") options.run = true;
+        else if (arg == "-g") options.debugLine = true;
+        else if (arg.rfind("--line-map=", 0) == 0) 
+        {
+            options.lineMapFilename = string(value("--line-map="));
+            ok = !options.lineMapFilename.empty();
+        }
+        else if (arg.rfind("--symbols=", 0) == 0) 
+        {
+            options.symbolsFilename = string(value("--symbols="));
+            ok = !options.symbolsFilename.empty();
+        }
+        else if (arg.rfind("--run-limit=", 0) == 0) ok = parseCount(value("--run-limit="), options.runLimit) && options.runLimit > 0;
+        else if (arg.rfind("--trace=", 0) == 0) 
+        {
+            options.traceFilename = string(value("--trace="));
+            ok = !options.traceFilename.empty();
+        }
+        else if (arg == "--fuzz") options.fuzzCount = 20000;
+        else if (arg.rfind("--fuzz=", 0) == 0) ok = parseCount(value("--fuzz="), options.fuzzCount) && options.fuzzCount > 0;
+        else if (arg.rfind("--max-errors=", 0) == 0) ok = parseCount(value("--max-errors="), options.maxErrors);
+        else if (arg.rfind("--diagnostics=", 0) == 0) 
+        {
+            string_view format = value("--diagnostics=");
+            options.jsonDiagnostics = format == "json";
+            ok = format == "json" || format == "text";
+        }
+        else if (arg.rfind("--cache=", 0) == 0) 
+        {
+            options.incremental = true;
+            options.cacheFilename = string(value("--cache="));
+            ok = !options.cacheFilename.empty();
+        }
+        else if (arg.rfind("--serve=", 0) == 0) 
+        {
+            options.serve = true;
+            options.serveSocket = string(value("--serve="));
+            ok = !options.serveSocket.empty();
+        }
+        else if (arg.rfind("--generate=", 0) == 0) options.generateFilename = string(value("--generate="));
+        else if (arg.rfind("--bench-runs=", 0) == 0) 
+        {
+            ok = parseCount(value("--bench-runs="), count) && count > 0;
+            options.benchRuns = static_cast<int>(count);
+        }
+        else if (arg.rfind("--bench-lines=", 0) == 0) ok = parseCount(value("--bench-lines="), options.workload.textLines);
+        else if (arg.rfind("--bench-data-lines=", 0) == 0) ok = parseCount(value("--bench-data-lines="), options.workload.dataLines);
+        else if (arg.rfind("--bench-branch-distance=", 0) == 0) ok = parseCount(value("--bench-branch-distance="), options.workload.branchDistance);
+        else if (arg.rfind("--bench-seed=", 0) == 0) 
+        {
+            ok = parseCount(value("--bench-seed="), count);
+            options.workload.seed = count;
+        }
+        else if (arg.rfind("--bench-label-density=", 0) == 0) 
+        {
+            ok = parseFraction(value("--bench-label-density="), options.workload.labelDensity) && options.workload.labelDensity <= 1;
+        }
+        else if (arg.rfind("--bench-mix=", 0) == 0) 
+        {
+            //six comma separated weights
+            string_view rest = value("--bench-mix=");
+            double total = 0;
+            for (size_t f = 0; f < options.workload.mix.size() && ok; ++f) 
+            {
+                size_t comma = rest.find(',');
+                ok = (comma == string_view::npos) == (f + 1 == options.workload.mix.size())
+                    && parseFraction(rest.substr(0, comma), options.workload.mix[f]);
+                total += options.workload.mix[f];
+                rest = comma == string_view::npos ? string_view() : rest.substr(comma + 1);
+            }
+            ok = ok && total > 0;
+        }
+        else if (arg == "-o") 
+        {
+            //a missing or empty name is a bad command line, not a file that cannot be opened later
+            string_view output = i + 1 < argc ? string_view(argv[++i]) : string_view();
+            if (output.empty()) 
+            {
+                cerr << "Error:missing output file after '-o'" << endl;
+                return false;
+            }
+            options.outputFilename = string(output);
+        }
+        else if (arg.size() > 1 && arg[0] == '-') 
+        {
+            cerr << "Error:unknown option '" << arg << "'" << endl;
+            return false;
+        }
+        else 
+        {
+            options.inputFilenames.push_back(string(arg));
+            options.inputFilename = options.inputFilenames.front();
+        }
+        if (!ok) 
+        {
+            cerr << "Error:bad value in '" << arg << "'" << endl;
+            return false;
+        }
+    }
+    if (options.serve && options.format == OutputFormat::Raw) 
+    {
+        //the flat image spans DATA_BASE bytes, too much to send per job
+        cerr << "Error:--serve does not support --format=raw" << endl;
+        return false;
+    }
+    if (options.debugLine && options.format != OutputFormat::Elf) 
+    {
+        //the listing formats have nowhere to put a debug section
+        cerr << "Error:-g needs --format=elf" << endl;
+        return false;
+    }
+    if (options.inputFilenames.size() > 1 && (options.incremental || options.verify)) 
+    {
+        //both work on one file's line table, a link has one per file
+        cerr << "Error:--incremental and --verify take a single input file" << endl;
+        return false;
+    }
+    if (options.incremental && options.cacheFilename.empty()) options.cacheFilename = options.outputFilename + ".cache";
+    if (options.incremental && options.outputFilename == "-") 
+    {
+        //the cache points into the previous output file
+        cerr << "Error:--incremental needs an output file" << endl;
+        return false;
+    }
+    return true;
+}
+
+//one encoded instruction of the last run, as stored in the --incremental cache file
+struct CachedLine 
+{
+    uint64_t hash;         //contentHash of the line text, kept for every line
+    uint64_t outputBegin;  //its line in the output file (text formats)
+    int64_t offset;        //branch/jump offset it was encoded with, 0 for other instructions
+    uint32_t word;
+    uint32_t outputLength;
+    uint32_t encoded;      //0 for lines that are not instructions or did not encode
+    uint32_t reserved;
+};
+
+//FNV-1a over the cleaned line: a line with the same text encodes to the same word and
+//prints the same listing after its address, wherever it moved to
+uint64_t contentHash(string_view text) 
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (char c : text) hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001B3ull;
+    return hash;
+}
+
+//--incremental: the last run's words and listing lines, keyed by line content hash
+//pass 1 still runs over the whole input and fixes the new addresses; pass 2 then copies
+//any instruction whose text is unchanged from the old output with its new address in
+//front, and encodes again only edited lines and branches/jumps whose offset moved
+struct IncrementalCache 
+{
+    static constexpr uint32_t NO_MATCH = UINT32_MAX;
+    static constexpr char MAGIC[8] = {'R', 'V', 'A', 'S', 'M', 'I', 'N', '2'};
+    struct Header 
+    {
+        char magic[8];
+        uint32_t format;
+        uint32_t reserved;
+        uint64_t lineCount;
+        uint64_t outputSize;  //size of the output file the records point into
+        uint64_t outputHash;  //and contentHash of it, so an output another run rewrote is not trusted
+    };
+
+    vector<CachedLine> previous;  //records of the last run, empty if there was none
+    SourceBuffer previousOutput;  //the last run's output file (text formats)
+    vector<uint32_t> match;       //line -> previous record with the same text, NO_MATCH if none
+    vector<CachedLine> next;      //records of this run, saved for the next one
+    atomic<size_t> reusedLines{0};
+
+    //read the cache and the output it describes; anything missing or stale means a full assembly
+    void load(const string& filename, OutputFormat format, const string& outputFilename) 
+    {
+        previous.clear();
+        SourceBuffer file;
+        if (!readSource(filename, file)) return;
+        string_view bytes = file.view();
+        Header header;
+        if (bytes.size() < sizeof(header)) return;
+        memcpy(&header, bytes.data(), sizeof(header));
+        bool textOutput = format != OutputFormat::Raw && format != OutputFormat::Elf;
+        if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.format != static_cast<uint32_t>(format)
+            || bytes.size() - sizeof(header) != header.lineCount * sizeof(CachedLine)) return;
+        if (textOutput && (!readSource(outputFilename, previousOutput) || previousOutput.view().size() != header.outputSize
+            || contentHash(previousOutput.view()) != header.outputHash)) return;
+        previous.resize(header.lineCount);
+        memcpy(previous.data(), bytes.data() + sizeof(header), header.lineCount * sizeof(CachedLine));
+    }
+
+    //hash every line and pair each instruction with a previous line of the same text
+    void prepare(const Program& program, int jobs) 
+    {
+        constexpr size_t CHUNK_LINES = 65536;
+        size_t lineCount = program.lines.size();
+        next.assign(lineCount, CachedLine{});
+        match.assign(lineCount, NO_MATCH);
+        parallelFor((lineCount + CHUNK_LINES - 1) / CHUNK_LINES, jobs, [&](size_t chunk) {
+            for (size_t i = chunk * CHUNK_LINES; i < min(lineCount, (chunk + 1) * CHUNK_LINES); ++i) 
+            {
+                next[i].hash = contentHash(program.lines[i].text);
+            }
+        });
+        if (previous.empty()) return;
+
+        //an edit usually leaves a long common prefix and suffix in place
+        size_t prefix = 0;
+        while (prefix < lineCount && prefix < previous.size() && next[prefix].hash == previous[prefix].hash) 
+        {
+            match[prefix] = static_cast<uint32_t>(prefix);
+            ++prefix;
+        }
+        size_t suffix = 0;
+        while (suffix < lineCount - prefix && suffix < previous.size() - prefix
+            && next[lineCount - 1 - suffix].hash == previous[previous.size() - 1 - suffix].hash) 
+        {
+            match[lineCount - 1 - suffix] = static_cast<uint32_t>(previous.size() - 1 - suffix);
+            ++suffix;
+        }
+
+        //lines in between look up the old lines in between by hash, so moved code is found too
+        size_t oldEnd = previous.size() - suffix;
+        size_t tableSize = 64;
+        while (tableSize < (oldEnd - prefix) * 2) tableSize *= 2;
+        vector<pair<uint64_t, uint32_t>> table(oldEnd > prefix ? tableSize : 0, {0, NO_MATCH});
+        size_t mask = table.size() - 1;
+        for (size_t old = prefix; old < oldEnd; ++old) 
+        {
+            if (!previous[old].encoded) continue;
+            size_t slot = previous[old].hash & mask;
+            while (table[slot].second != NO_MATCH && table[slot].first != previous[old].hash) slot = (slot + 1) & mask;
+            table[slot] = {previous[old].hash, static_cast<uint32_t>(old)};
+        }
+        for (size_t i = prefix; i < lineCount - suffix && !table.empty(); ++i) 
+        {
+            if (!program.lines[i].inText || !program.lines[i].info) continue;
+            size_t slot = next[i].hash & mask;
+            while (table[slot].second != NO_MATCH && table[slot].first != next[i].hash) slot = (slot + 1) & mask;
+            match[i] = table[slot].second;
+        }
+    }
+
+    //copy line from the last run if its text and branch offset are unchanged
+    bool reuse(const Program& program, size_t line, bool fillImage, bool binaryOutput, Image& image, string& out) 
+    {
+        if (match[line] == NO_MATCH || !previous[match[line]].encoded) return false;
+        const CachedLine& cached = previous[match[line]];
+        const SourceLine& entry = program.lines[line];
+        //relaxed and %hi/%lo lines are never recorded, and a line that needs relaxing now is encoded again
+        if (entry.relaxation != Relaxation::None || isRelocationLine(entry)) return false;
+        long offset = 0;
+        if (labelOperandIndex(*entry.info) != 0) 
+        {
+            if (entry.targetId == NO_LABEL || program.symbols.addresses[entry.targetId] == UNDEFINED_ADDRESS) return false;
+            offset = program.symbols.addresses[entry.targetId] - entry.address;
+        }
+        if (offset != cached.offset) return false;
+
+        if (fillImage) image.text[(entry.address - TEXT_BASE) / 4] = cached.word;
+        size_t start = out.size();
+        if (!binaryOutput) 
+        {
+            //everything after the address is the same
+            string_view old = previousOutput.view().substr(cached.outputBegin, cached.outputLength);
+            appendHex(out, entry.address);
+            out += old.substr(old.find(' '));
+        }
+        record(line, cached.word, offset, start, out.size() - start);
+        return true;
+    }
+
+    //outputBegin is relative to the chunk buffer until runPass2Text knows where it lands
+    void record(size_t line, uint32_t word, long offset, size_t outputBegin, size_t outputLength) 
+    {
+        CachedLine& entry = next[line];
+        entry.outputBegin = outputBegin;
+        entry.offset = offset;
+        entry.word = word;
+        entry.outputLength = static_cast<uint32_t>(outputLength);
+        entry.encoded = 1;
+    }
+
+    //write this run's records; written to a temporary name first so a failed run never leaves half a cache
+    //outputFilename is the output just written (text formats), read back for its size and hash;
+    //empty for the binary formats, whose records point into no file
+    bool save(const string& filename, OutputFormat format, const string& outputFilename) const 
+    {
+        Header header{};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.format = static_cast<uint32_t>(format);
+        header.lineCount = next.size();
+        if (!outputFilename.empty()) 
+        {
+            SourceBuffer output;
+            if (!readSource(outputFilename, output)) return false;
+            header.outputSize = output.view().size();
+            header.outputHash = contentHash(output.view());
+        }
+        string temporary = filename + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = writeAll(fd, &header, sizeof(header)) && writeAll(fd, next.data(), next.size() * sizeof(CachedLine));
+        ok = close(fd) == 0 && ok;
+        return ok && rename(temporary.c_str(), filename.c_str()) == 0;
+    }
+};
+
+//one listing line: address and word, for venus also the assembly and debug string
+void appendListingLine(string& out, OutputFormat format, long address, uint32_t machineCode, const InstructionInfo& info, const Operands& operands, long offset) 
+{
+    appendHex(out, address);
+    out += ' ';
+    if (format == OutputFormat::Bin) 
+    {
+        appendBits(out, machineCode, 32);
+    }
+    else if (format == OutputFormat::Hex) 
+    {
+        appendHex(out, machineCode, 8);
+    }
+    else 
+    {
+        appendHex(out, machineCode, 8);
+        out += " , ";
+        appendCompressedAssembly(out, info, operands);
+        out += ' ';
+        appendDebugString(out, info, operands, offset);
+    }
+    out += '\n';
+}
+
+//one instruction of a relaxed branch/jump or a pseudo-instruction, its operands spelled
+//out for the listing; operands may point into numbers, so an ExpandedWord is filled in
+//place and never copied
+struct ExpandedWord 
+{
+    const InstructionInfo* info;
+    Operands operands;
+    uint32_t word;
+    long offset;          //for the debug string of branch/jump words
+    char numbers[24];     //immediate operand text
+};
+
+//set a word's instruction and operands, the mnemonic comes from the table
+void setWord(ExpandedWord& word, InstructionId id, initializer_list<string_view> tokens) 
+{
+    word.info = &instructionTable[id];
+    word.operands.count = 0;
+    word.operands.tokens[word.operands.count++] = word.info->name;
+    for (string_view token : tokens) word.operands.tokens[word.operands.count++] = token;
+    word.offset = 0;
+}
+
+//value as operand text kept in the word
+string_view wordNumber(ExpandedWord& word, long value) 
+{
+    char* end = to_chars(word.numbers, word.numbers + sizeof(word.numbers), value).ptr;
+    return string_view(word.numbers, end - word.numbers);
+}
+
+//auipc + `second` reaching target from `from`: the upper 20 bits round so the signed
+//12-bit lower part adds back up; second is jalr rd, lo(temporary) or addi rd, temporary, lo
+void pcRelativePair(const Program& program, ExpandedWord* pair, InstructionId second, long from, long target, string_view rd, string_view temporary, OperandStatus& status) 
+{
+    long delta = target - from;
+    long hi = (delta + 0x800) >> 12;
+    setWord(pair[0], INSN_auipc, {temporary, wordNumber(pair[0], hi)});
+    string_view lo = wordNumber(pair[1], delta - hi * 4096);
+    if (second == INSN_jalr) setWord(pair[1], INSN_jalr, {rd, lo, temporary});
+    else setWord(pair[1], second, {rd, temporary, lo});
+    long unused;
+    for (int k = 0; k < 2; ++k) pair[k].word = assemble(*pair[k].info, pair[k].operands, from + 4 * k, program.symbols, NO_LABEL, unused, status);
+}
+
+//the branch with the opposite condition: funct3 bit 0 flips beq/bne and blt/bge
+const InstructionInfo& invertedBranch(const InstructionInfo& info) 
+{
+    for (const InstructionInfo& other : instructionTable) 
+    {
+        if (other.format == InstructionInfo::Format::SB && other.base == (info.base ^ (1u << 12))) return other;
+    }
+    return info;
+}
+
+//expand a relaxed line into its 2 or 3 words, returns how many
+//status receives the first bad register, like for assemble()
+size_t expandRelaxed(const Program& program, const SourceLine& entry, const Operands& operands, ExpandedWord (&words)[MAX_EXPANDED_WORDS], OperandStatus& status) 
+{
+    long target = program.symbols.addresses[entry.targetId];
+    if (entry.relaxation == Relaxation::FarJump) 
+    {
+        pcRelativePair(program, words, INSN_jalr, entry.address, target, operands[1], registerToInt(operands[1]) == 0 ? "x6" : operands[1], status);
+        return 2;
+    }
+
+    //the inverted branch skips the jump that follows it
+    const InstructionInfo& inverted = invertedBranch(*entry.info);
+    long skip = relaxedSize(entry.relaxation);
+    setWord(words[0], static_cast<InstructionId>(&inverted - instructionTable), {operands[1], operands[2], wordNumber(words[0], skip)});
+    uint32_t rs1 = readRegister(operands[1], status);
+    uint32_t rs2 = readRegister(operands[2], status);
+    words[0].word = encodeSB(inverted, rs1, rs2, skip);
+    words[0].offset = skip;
+    if (entry.relaxation == Relaxation::BranchOverJump) 
+    {
+        setWord(words[1], INSN_jal, {"x0", operands[3]});
+        words[1].word = assemble(*words[1].info, words[1].operands, entry.address + 4, program.symbols, entry.targetId, words[1].offset, status);
+        return 2;
+    }
+    pcRelativePair(program, words + 1, INSN_jalr, entry.address + 4, target, "x0", "x6", status);
+    return 3;
+}
+
+//expand a pseudo-instruction line into the words pass 1 sized it as, returns how many
+//a li value that has no value goes to status and loads 0, same size pass 1 gave it
+size_t expandPseudo(const Program& program, const SourceLine& entry, const Operands& operands, ExpandedWord (&words)[MAX_EXPANDED_WORDS], OperandStatus& status) 
+{
+    long unused;
+    if (entry.pseudo == Pseudo::Li) 
+    {
+        long value = evaluateOperand(program, entry, operands[2], OperandError::BadNumber, status);
+        LiStep steps[MAX_EXPANDED_WORDS];
+        size_t count = liSequence(value, steps);
+        //a value that needed a label was sized as lui + addiw, which only reach 32 bits
+        if (4 * static_cast<long>(count) != entry.size) 
+        {
+            if (value != static_cast<int32_t>(value)) status.failRange(operands[2], value, INT32_MIN, INT32_MAX);
+            long lo = ((value & 0xFFF) ^ 0x800) - 0x800;
+            steps[0] = {INSN_lui, ((value - lo) >> 12) & 0xFFFFF};
+            steps[1] = {INSN_addiw, lo};
+            count = 2;
+        }
+        string_view rd = operands[1];
+        for (size_t k = 0; k < count; ++k) 
+        {
+            string_view imm = wordNumber(words[k], steps[k].imm);
+            if (steps[k].id == INSN_lui) setWord(words[k], INSN_lui, {rd, imm});
+            else setWord(words[k], steps[k].id, {rd, k == 0 ? "x0" : rd, imm});
+            words[k].word = assemble(*words[k].info, words[k].operands, entry.address + 4 * static_cast<long>(k), program.symbols, NO_LABEL, unused, status);
+        }
+        return count;
+    }
+
+    //la/call/tail: an undefined label is reported by the caller and reads as address 0
+    bool defined = entry.targetId != NO_LABEL && program.symbols.addresses[entry.targetId] != UNDEFINED_ADDRESS;
+    long target = defined ? program.symbols.addresses[entry.targetId] : 0;
+    if (entry.pseudo == Pseudo::La) pcRelativePair(program, words, INSN_addi, entry.address, target, operands[1], operands[1], status);
+    else if (entry.pseudo == Pseudo::Call) pcRelativePair(program, words, INSN_jalr, entry.address, target, "x1", "x1", status);
+    else pcRelativePair(program, words, INSN_jalr, entry.address, target, "x0", "x6", status);
+    return 2;
+}
+
+//replace a %hi(sym) / %lo(sym) operand with the number it stands for (0 when sym is
+//undefined): lui takes the upper 20 bits rounded so the signed %lo part adds back up
+//returns true for %hi
+bool resolveRelocation(const Program& program, const SourceLine& entry, Operands& operands, char (&text)[24]) 
+{
+    for (size_t k = 1; k < operands.size(); ++k) 
+    {
+        if (!isRelocation(operands[k])) continue;
+        long address = program.symbols.addresses[entry.targetId];
+        if (address == UNDEFINED_ADDRESS) address = 0;
+        long hi = (address + 0x800) >> 12;
+        bool upper = operands[k][1] == 'h';
+        long value = upper ? hi & 0xFFFFF : address - hi * 4096;
+        operands.tokens[k] = string_view(text, to_chars(text, text + sizeof(text), value).ptr - text);
+        return upper;
+    }
+    return false;
+}
+
+//replace every immediate operand that is an expression (N*4, end-start, 'a') with its
+//value, kept in text, so the encoders, the listing and --verify all see a number; csr
+//names, %hi/%lo and label operands stay as they are; returns whether it replaced any,
+//such a line encodes differently when a constant or label it names changes
+bool resolveExpressions(const Program& program, const SourceLine& entry, Operands& operands, char (&text)[MAX_OPERANDS][24], OperandStatus& status) 
+{
+    using Syntax = InstructionInfo::Syntax;
+    const InstructionInfo& info = *entry.info;
+    if (labelOperandIndex(info) || info.syntax == Syntax::Fence || info.syntax == Syntax::System) return false;
+    bool csr = info.syntax == Syntax::Csr || info.syntax == Syntax::CsrImmediate;
+    bool replaced = false;
+    for (size_t k : {size_t(info.slots.imm), info.syntax == Syntax::CsrImmediate ? size_t(info.slots.rs1) : 0}) 
+    {
+        string_view operand = operands[k];
+        long value;
+        //a register where a number goes stays a bad number
+        if (k == 0 || operand.empty() || stringToLong(operand, value) || isRelocation(operand) || registerToInt(operand) >= 0) continue;
+        OperandStatus name;
+        if (csr && k == info.slots.imm && (readCsr(operand, name), !name.failed())) continue;
+        OperandStatus problem;
+        value = evaluateOperand(program, entry, operand, csr && k == info.slots.imm ? OperandError::BadCsr : OperandError::BadNumber, problem);
+        if (problem.failed()) 
+        {
+            //a lone unknown name where a csr goes is a misspelt csr more likely than anything
+            if (csr && problem.expression == ExpressionError::Undefined && problem.symbol == operand) problem = OperandStatus();
+            if (!problem.failed()) problem.fail(OperandError::BadCsr, operand);
+            //the first bad operand wins, as with the encoders
+            if (!status.failed()) status = problem;
+            continue;
+        }
+        operands.tokens[k] = string_view(text[k], to_chars(text[k], text[k] + sizeof(text[k]), value).ptr - text[k]);
+        replaced = true;
+    }
+    return replaced;
+}
+
+//link mode (relocations given): record the word at address as the linker's to fill in
+//when target is another file's label or sits in .data, whose distance from .text the
+//link decides (a file's .text moves as a whole, so pc-relative references inside it
+//hold), and always for an absolute %hi/%lo; returns whether it did
+bool addRelocation(const Program& program, vector<Relocation>* relocations, RelocationType type, long address, uint32_t target, int lineNo) 
+{
+    if (!relocations || target == NO_LABEL) return false;
+    long at = program.symbols.addresses[target];
+    bool absolute = type == RelocationType::AbsoluteHi || type == RelocationType::AbsoluteLo;
+    if (!absolute && at != UNDEFINED_ADDRESS && at < DATA_BASE) return false;
+    relocations->push_back({address, target, type, lineNo});
+    return true;
+}
+
+//report the operand an encoder could not use, at its column (an undefined name in an
+//expression at the name's)
+void reportOperand(const Program& program, const SourceLine& entry, const OperandStatus& status, Diagnostics& diagnostics) 
+{
+    const char* what = status.error == OperandError::BadRegister ? "bad register '"
+        : status.error == OperandError::BadCsr ? "bad csr '"
+        : status.error == OperandError::BadFence ? "bad fence set '" : "bad number '";
+    string value = to_string(status.value);
+    string range = " out of range " + to_string(status.low) + ".." + to_string(status.high);
+    string message = status.operand.empty() ? "missing operand in '" + string(entry.text) + "'"
+        : status.error == OperandError::Unclosed ? "unclosed '(' in '" + string(entry.text) + "'"
+        : status.error == OperandError::Unexpected ? "unexpected operand '" + string(status.operand) + "'"
+        : status.error == OperandError::BadExpression ? expressionMessage(status.expression, status.operand, status.symbol)
+        : status.error == OperandError::OutOfRange && status.operand == value ? "immediate " + value + range
+        : status.error == OperandError::OutOfRange ? "immediate '" + string(status.operand) + "' (= " + value + ")" + range
+        : what + string(status.operand) + "'";
+    diagnostics.error(entry.lineNo, tokenColumn(program, entry, status.symbol.empty() ? status.operand : status.symbol), move(message));
+}
+
+//encode the text lines [begin, end) of the line table
+//words go to their preallocated image slot when image.text is sized, text formats also
+//append lines to out; undefined labels and bad operands are reported to diagnostics and
+//encode as 0, so every other word still lands where pass 1 put it
+//with incremental, unchanged lines are copied from the last run and every line is recorded
+//with relocations (link mode), references the linker resolves go there instead of
+//being reported as undefined
+void encodeTextLines(const Program& program, size_t begin, size_t end, OutputFormat format, Image& image, string& out, Diagnostics& diagnostics, IncrementalCache* incremental, vector<Relocation>* relocations, [[maybe_unused]] size_t& encodeAllocations) 
+{
+    bool binaryOutput = format == OutputFormat::Raw || format == OutputFormat::Elf;
+    bool fillImage = !image.text.empty();
+    size_t reused = 0;
+    for (size_t i = begin; i < end; ++i) 
+    {
+        const SourceLine& entry = program.lines[i];
+        if (!entry.inText || (!entry.info && entry.pseudo == Pseudo::None)) continue;
+
+        //a relaxed branch/jump or a pseudo-instruction lists every word it became
+        if (entry.relaxation != Relaxation::None || entry.pseudo != Pseudo::None) 
+        {
+            Operands operands = lineOperands(program, entry);
+            ExpandedWord words[MAX_EXPANDED_WORDS];
+            OperandStatus status;
+            size_t count;
+            if (entry.pseudo == Pseudo::None) 
+            {
+                count = expandRelaxed(program, entry, operands, words, status);
+                //the jump after the inverted branch, or the far jump itself
+                bool overJump = entry.relaxation == Relaxation::BranchOverJump;
+                long jump = entry.address + (entry.relaxation == Relaxation::FarJump ? 0 : 4);
+                addRelocation(program, relocations, overJump ? RelocationType::Jump : RelocationType::PcRelative, jump, entry.targetId, entry.lineNo);
+            }
+            else 
+            {
+                size_t target = pseudoLabelIndex(entry.pseudo);
+                bool relocated = target && addRelocation(program, relocations, RelocationType::PcRelative, entry.address, entry.targetId, entry.lineNo);
+                //a missing label is a missing operand, reported once by the expansion
+                if (target && operands[target].empty()) status.fail(OperandError::BadNumber, string_view());
+                else if (target && !relocated && (entry.targetId == NO_LABEL || program.symbols.addresses[entry.targetId] == UNDEFINED_ADDRESS)) 
+                {
+                    diagnostics.error(entry.lineNo, tokenColumn(program, entry, operands[target]), "undefined label '" + string(operands[target]) + "'");
+                }
+                count = expandPseudo(program, entry, operands, words, status);
+            }
+            if (status.failed()) reportOperand(program, entry, status, diagnostics);
+            for (size_t k = 0; k < count; ++k) 
+            {
+                if (fillImage) image.text[(entry.address - TEXT_BASE) / 4 + k] = words[k].word;
+                if (!binaryOutput) appendListingLine(out, format, entry.address + 4 * k, words[k].word, *words[k].info, words[k].operands, words[k].offset);
+            }
+            continue;
+        }
+
+        const InstructionInfo& info = *entry.info;
+        if (incremental && incremental->reuse(program, i, fillImage, binaryOutput, image, out)) 
+        {
+            ++reused;
+            continue;
+        }
+        size_t lineStart = out.size();
+
+        //seperate the instruction operation and operands
+        Operands operands = lineOperands(program, entry);
+        char relocated[24];
+        char evaluated[MAX_OPERANDS][24];
+        bool relocation = isRelocationLine(entry);
+        bool upper = relocation && resolveRelocation(program, entry, operands, relocated);
+        OperandStatus status;
+        bool expression = resolveExpressions(program, entry, operands, evaluated, status);
+
+        //get machine code
+        long offset = 0;
+#ifdef COUNT_ALLOCATIONS
+        size_t before = heapAllocations;
+        uint32_t machineCode = assemble(info, operands, entry.address, program.symbols, entry.targetId, offset, status);
+        encodeAllocations += heapAllocations - before;
+#else
+        uint32_t machineCode = assemble(info, operands, entry.address, program.symbols, entry.targetId, offset, status);
+#endif
+        //an operand out of range was encoded as 0, so it is listed as 0 as well; an expression
+        //is reported as written, not as the number it became
+        if (status.error == OperandError::OutOfRange) 
+        {
+            Operands written = lineOperands(program, entry);
+            for (size_t k = 1; k < operands.size(); ++k) 
+            {
+                if (status.operand.data() != operands[k].data()) continue;
+                if (expression) status.operand = written[k];
+                operands.tokens[k] = "0";
+                break;
+            }
+        }
+        bool linked = false;
+        if (relocations && (labelOperandIndex(info) != 0 || relocation)) 
+        {
+            RelocationType type = relocation ? (upper ? RelocationType::AbsoluteHi : RelocationType::AbsoluteLo)
+                : info.format == InstructionInfo::Format::SB ? RelocationType::Branch : RelocationType::Jump;
+            linked = addRelocation(program, relocations, type, entry.address, entry.targetId, entry.lineNo);
+        }
+        //a branch or jump without its label is a missing operand, not an undefined label
+        bool missingTarget = labelOperandIndex(info) != 0 && operands[labelOperandIndex(info)].empty();
+        if (missingTarget) status.fail(OperandError::BadNumber, string_view());
+        //operands past the ones the instruction takes are not dropped silently
+        if (operands.size() > operandCount(info)) status.fail(OperandError::Unexpected, lineOperands(program, entry)[operandCount(info)]);
+        bool undefinedTarget = !linked && !missingTarget && (labelOperandIndex(info) != 0 || relocation)
+            && (entry.targetId == NO_LABEL || program.symbols.addresses[entry.targetId] == UNDEFINED_ADDRESS);
+        if (undefinedTarget) 
+        {
+            //a %hi/%lo operand was replaced by its number, the source still has it
+            Operands written = relocation ? lineOperands(program, entry) : operands;
+            size_t k = labelOperandIndex(info);
+            while (relocation && k < written.size() && !isRelocation(written[k])) ++k;
+            string_view name = relocation ? program.symbols.names[entry.targetId] : operands[k];
+            diagnostics.error(entry.lineNo, tokenColumn(program, entry, written[k]), "undefined label '" + string(name) + "'");
+        }
+        if (status.failed()) reportOperand(program, entry, status, diagnostics);
+
+        if (fillImage) image.text[(entry.address - TEXT_BASE) / 4] = machineCode;
+
+        //only venus needs the assembly and debug text
+        if (!binaryOutput) appendListingLine(out, format, entry.address, machineCode, info, operands, offset);
+        //a line with an undefined label must be encoded (and reported) again next time,
+        //a %hi/%lo line depends on where its symbol lands and an expression on what it names
+        if (incremental && !undefinedTarget && !relocation && !expression && !status.failed()) incremental->record(i, machineCode, offset, lineStart, out.size() - lineStart);
+    }
+    if (incremental) incremental->reusedLines.fetch_add(reused, memory_order_relaxed);
+}
+
+//pass 2 over the text segment on `jobs` threads
+//pass 1 fixed every address, so each line encodes on its own: the line table is cut
+//into chunks for parallelFor, and text output is produced a window of chunks at a
+//time and written in chunk order to keep memory bounded; diagnostics keep chunk order too,
+//and once they are full no further window is encoded
+//raw/elf always fill image.text, text formats only with fillImage
+//returns the number of heap allocations made while encoding
+size_t runPass2Text(const Program& program, OutputFormat format, int jobs, bool fillImage, Image& image, OutputWriter& output, Diagnostics& diagnostics, IncrementalCache* incremental, vector<Relocation>* relocations) 
+{
+    constexpr size_t CHUNK_LINES = 16384;
+    bool binaryOutput = format == OutputFormat::Raw || format == OutputFormat::Elf;
+    if (binaryOutput || fillImage) image.text.assign((program.textEnd - TEXT_BASE) / 4, 0);
+
+    size_t lineCount = program.lines.size();
+    size_t chunkCount = (lineCount + CHUNK_LINES - 1) / CHUNK_LINES;
+    size_t window = binaryOutput ? max<size_t>(chunkCount, 1) : static_cast<size_t>(jobs) * 4;
+    vector<string> buffers(binaryOutput ? 0 : window);
+    vector<Diagnostics> chunkDiagnostics(window);
+    for (Diagnostics& chunk : chunkDiagnostics) chunk.limit = diagnostics.limit;
+    vector<vector<Relocation>> chunkRelocations(relocations ? window : 0);
+    atomic<size_t> encodeAllocations{0};
+    uint64_t written = 0; //bytes of text output so far
+
+    for (size_t windowStart = 0; windowStart < chunkCount && !diagnostics.full(); windowStart += window) 
+    {
+        size_t windowEnd = min(chunkCount, windowStart + window);
+        parallelFor(windowEnd - windowStart, jobs, [&](size_t i) {
+            size_t chunk = windowStart + i;
+            string scratch; //binary formats never write text
+            string& out = binaryOutput ? scratch : buffers[i];
+            out.clear();
+            size_t allocations = 0;
+            size_t begin = chunk * CHUNK_LINES;
+            TraceSpan span("encode", min(lineCount, begin + CHUNK_LINES) - begin);
+            encodeTextLines(program, begin, min(lineCount, begin + CHUNK_LINES), format, image, out, chunkDiagnostics[i], incremental,
+                relocations ? &chunkRelocations[i] : nullptr, allocations);
+            encodeAllocations.fetch_add(allocations, memory_order_relaxed);
+        });
+
+        for (size_t i = 0; i < windowEnd - windowStart; ++i) 
+        {
+            diagnostics.append(chunkDiagnostics[i]);
+            chunkDiagnostics[i].clear();
+            if (!relocations) continue;
+            relocations->insert(relocations->end(), chunkRelocations[i].begin(), chunkRelocations[i].end());
+            chunkRelocations[i].clear();
+        }
+
+        if (!binaryOutput) 
+        {
+            for (size_t chunk = windowStart; chunk < windowEnd; ++chunk) 
+            {
+                const string& out = buffers[chunk - windowStart];
+                output.write(out);
+                if (incremental) 
+                {
+                    //recorded output positions were relative to the chunk buffer
+                    size_t begin = chunk * CHUNK_LINES;
+                    for (size_t line = begin; line < min(lineCount, begin + CHUNK_LINES); ++line) 
+                    {
+                        incremental->next[line].outputBegin += written;
+                    }
+                }
+                written += out.size();
+            }
+        }
+    }
+    return encodeAllocations.load();
+}
+
+//what an expansion computes, from its decoded words: li loads its value, an auipc pair
+//reaches the label through the register it set, an inverted branch skips to the end of
+//the expansion and a jal over it lands on the label; returns what is wrong, empty if nothing
+string checkExpansion(const Program& program, const SourceLine& entry, const Operands& operands, const Decoded* words, size_t count) 
+{
+    if (entry.pseudo == Pseudo::Li) 
+    {
+        uint64_t value = 0;
+        for (size_t k = 0; k < count; ++k) 
+        {
+            long imm = words[k].imm;
+            switch (words[k].info - instructionTable) 
+            {
+                case INSN_lui: value = static_cast<uint64_t>(signExtend(static_cast<uint32_t>(imm), 20) * 4096); break;
+                case INSN_addiw: value = static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(static_cast<uint32_t>(value + imm)))); break;
+                case INSN_addi: value = (words[k].rs1 ? value : 0) + static_cast<uint64_t>(imm); break;
+                case INSN_slli: value <<= imm; break;
+            }
+        }
+        OperandStatus ignored;
+        long expected = evaluateOperand(program, entry, operands[2], OperandError::BadNumber, ignored);
+        return value == static_cast<uint64_t>(expected) ? string() : "li loading " + Hexa(value);
+    }
+
+    long target = program.symbols.addresses[entry.targetId];
+    bool branch = entry.relaxation == Relaxation::BranchOverJump || entry.relaxation == Relaxation::BranchOverFarJump;
+    if (branch && words[0].imm != relaxedSize(entry.relaxation)) return "an inverted branch that does not skip its jump";
+    if (entry.relaxation == Relaxation::BranchOverJump) 
+    {
+        return words[1].imm == target - (entry.address + 4) ? string() : "a jal that misses '" + string(operands[3]) + "'";
+    }
+    //every other expansion ends in auipc + addi/jalr
+    size_t pair = count - 2;
+    long reached = entry.address + 4 * static_cast<long>(pair) + signExtend(static_cast<uint32_t>(words[pair].imm), 20) * 4096 + words[pair + 1].imm;
+    if (words[pair + 1].rs1 != words[pair].rd) return "an auipc pair through two registers";
+    return reached == target ? string() : "an auipc pair reaching " + Hexa(reached);
+}
+
+//check the text lines [begin, end) against the words image.text holds for them, see
+//verifyText; returns the number of words checked
+size_t verifyTextLines(const Program& program, size_t begin, size_t end, const Image& image, Diagnostics& diagnostics) 
+{
+    size_t checked = 0;
+    auto report = [&](const SourceLine& entry, long address, string_view expected) {
+        uint32_t word = image.text[(address - TEXT_BASE) / 4];
+        string message = "verify: '" + string(entry.text) + "': ";
+        appendHex(message, address);
+        message += " holds ";
+        appendHex(message, word, 8);
+        message += " (";
+        appendDisassembly(message, decodeWord(word));
+        message += "), expected ";
+        message += expected;
+        diagnostics.error(entry.lineNo, tokenColumn(program, entry, entry.text), move(message));
+    };
+    auto expectedText = [](const InstructionInfo& info, const Operands& operands, long offset) {
+        string text = "'";
+        appendCompressedAssembly(text, info, operands);
+        text += '\'';
+        if (labelOperandIndex(info)) text += " (offset " + to_string(offset) + ")";
+        return text;
+    };
+
+    for (size_t i = begin; i < end; ++i) 
+    {
+        const SourceLine& entry = program.lines[i];
+        if (!entry.inText || (!entry.info && entry.pseudo == Pseudo::None)) continue;
+        bool relocation = isRelocationLine(entry);
+        bool labelled = relocation || (entry.info ? labelOperandIndex(*entry.info) : pseudoLabelIndex(entry.pseudo)) != 0;
+        //an undefined label was reported by pass 2 already
+        if (labelled && (entry.targetId == NO_LABEL || program.symbols.addresses[entry.targetId] == UNDEFINED_ADDRESS)) continue;
+        Operands operands = lineOperands(program, entry);
+        size_t first = (entry.address - TEXT_BASE) / 4;
+
+        if (entry.relaxation != Relaxation::None || entry.pseudo != Pseudo::None) 
+        {
+            ExpandedWord words[MAX_EXPANDED_WORDS];
+            Decoded decoded[MAX_EXPANDED_WORDS];
+            OperandStatus ignored;  //bad operands were reported by pass 2
+            size_t count = entry.pseudo == Pseudo::None
+                ? expandRelaxed(program, entry, operands, words, ignored)
+                : expandPseudo(program, entry, operands, words, ignored);
+            bool matched = true;
+            for (size_t k = 0; k < count; ++k) 
+            {
+                decoded[k] = decodeWord(image.text[first + k]);
+                if (decodesTo(decoded[k], *words[k].info, words[k].operands, words[k].offset)) continue;
+                report(entry, entry.address + 4 * static_cast<long>(k), expectedText(*words[k].info, words[k].operands, words[k].offset));
+                matched = false;
+            }
+            string problem = matched ? checkExpansion(program, entry, operands, decoded, count) : string();
+            if (!problem.empty()) diagnostics.error(entry.lineNo, tokenColumn(program, entry, entry.text), "verify: '" + string(entry.text) + "' expands to " + problem);
+            checked += count;
+            continue;
+        }
+
+        char relocated[24];
+        char evaluated[MAX_OPERANDS][24];
+        OperandStatus ignored;
+        if (relocation) resolveRelocation(program, entry, operands, relocated);
+        resolveExpressions(program, entry, operands, evaluated, ignored);
+        long offset = labelOperandIndex(*entry.info) ? program.symbols.addresses[entry.targetId] - entry.address : 0;
+        if (!decodesTo(decodeWord(image.text[first]), *entry.info, operands, offset)) 
+        {
+            report(entry, entry.address, expectedText(*entry.info, operands, offset));
+        }
+        ++checked;
+    }
+    return checked;
+}
+
+//--verify: decode every word of image.text and compare it with the source line it came
+//from (for pseudo-instructions and relaxed branches, with the expansion, plus what the
+//expansion computes); the line table is cut into chunks checked on `jobs` threads, and
+//mismatches become errors in line order. Returns the number of words checked
+size_t verifyText(const Program& program, const Image& image, int jobs, Diagnostics& diagnostics) 
+{
+    constexpr size_t CHUNK_LINES = 16384;
+    size_t lineCount = program.lines.size();
+    size_t chunkCount = (lineCount + CHUNK_LINES - 1) / CHUNK_LINES;
+    vector<Diagnostics> chunkDiagnostics(chunkCount);
+    for (Diagnostics& chunk : chunkDiagnostics) chunk.limit = diagnostics.limit;
+    atomic<size_t> checked{0};
+    parallelFor(chunkCount, jobs, [&](size_t chunk) {
+        size_t begin = chunk * CHUNK_LINES;
+        TraceSpan span("verify", min(lineCount, begin + CHUNK_LINES) - begin);
+        checked.fetch_add(verifyTextLines(program, begin, min(lineCount, begin + CHUNK_LINES), image, chunkDiagnostics[chunk]), memory_order_relaxed);
+    });
+    for (const Diagnostics& chunk : chunkDiagnostics) diagnostics.append(chunk);
+    return checked.load();
+}
+
+//--run: the Venus memory layout, .text at TEXT_BASE (readable, not writable), .data at
+//DATA_BASE followed by heap room, and a stack below STACK_TOP; anything else faults
+constexpr uint64_t STACK_TOP = 0x7FFFFFF0;       //initial sp, as in Venus
+constexpr uint64_t STACK_SIZE = 1 << 20;
+constexpr uint64_t HEAP_SIZE = 1 << 20;          //writable bytes after .data
+constexpr uint64_t GLOBAL_POINTER = 0x10008000;  //initial gp, as in Venus
+
+//little-endian value of `bytes` bytes at p, whatever the host order
+inline uint64_t loadLE(const uint8_t* p, int bytes) 
+{
+    uint64_t value = 0;
+    for (int b = 0; b < bytes; ++b) value |= static_cast<uint64_t>(p[b]) << (8 * b);
+    return value;
+}
+
+inline void storeLE(uint8_t* p, uint64_t value, int bytes) 
+{
+    for (int b = 0; b < bytes; ++b) p[b] = static_cast<uint8_t>(value >> (8 * b));
+}
+
+//the simulated address space, one flat buffer per region
+struct SimulatedMemory 
+{
+    vector<uint8_t> text;
+    vector<uint8_t> data;
+    vector<uint8_t> stack;  //ends at STACK_TOP + 16
+
+    explicit SimulatedMemory(const Image& image) : data(image.data), stack(STACK_SIZE) 
+    {
+        text.reserve(image.text.size() * 4);
+        for (uint32_t word : image.text) putLE(text, word, 4);
+        data.resize(data.size() + HEAP_SIZE);
+    }
+
+    //the `size` bytes at address, nullptr if they are not all in one region (or, for a
+    //store, in .text); the unsigned differences also catch addresses below a region
+    uint8_t* find(uint64_t address, uint64_t size, bool store) 
+    {
+        uint64_t stackBase = STACK_TOP + 16 - STACK_SIZE;
+        if (address - DATA_BASE < data.size() && address - DATA_BASE + size <= data.size()) return &data[address - DATA_BASE];
+        if (address - stackBase < stack.size() && address - stackBase + size <= stack.size()) return &stack[address - stackBase];
+        if (!store && address - TEXT_BASE < text.size() && address - TEXT_BASE + size <= text.size()) return &text[address - TEXT_BASE];
+        return nullptr;
+    }
+};
+
+//what a --run did
+struct RunResult 
+{
+    array<uint64_t, 32> registers{};
+    uint64_t pc = 0;       //address of the last instruction (the fault's, if any), or textEnd
+    uint64_t steps = 0;    //instructions executed
+    array<uint64_t, INSN_COUNT> counts{};  //and per mnemonic
+    string fault;          //empty if the program ran off the end of .text or exited
+    string console;        //what its ecalls printed
+    bool exited = false;   //ended with ecall 10 or 17
+    int64_t exitCode = 0;  //a1 of ecall 17
+};
+
+//one text word decoded before the run starts
+struct PredecodedOp 
+{
+    const void* handler;  //dispatch label of its instruction
+    uint32_t rd;          //32 (a sink register) for x0, so x0 stays 0 without a check
+    uint32_t rs1, rs2;
+    int64_t imm;          //I/S immediate, shamt, csr number, U value already shifted, SB/UJ target op index
+    uint64_t hits;        //times executed
+};
+
+//execute image.text from TEXT_BASE until the pc reaches textEnd, a fault, or stepLimit
+//instructions; every word is decoded once up front into an op holding the address of
+//its handler, so each step is a computed goto straight to the next handler (threaded
+//dispatch) with no decoding on the way; branch and jal targets are op indices already
+//the handler table comes from RISCV_INSTRUCTIONS, so an instruction without a handler
+//does not compile
+//ecall follows Venus: a0 = 1/4/11 prints a1 as an integer/string/character into
+//console, a0 = 10 exits and 17 exits with code a1. The csrs are one flat file with
+//cycle/time/instret reading the step count; a single hart makes every AMO and sc
+//plain read-modify-writes, an sc succeeding if its address is the last lr's
+RunResult runProgram(const Image& image, long textEnd, uint64_t stepLimit) 
+{
+    static const void* const handlers[INSN_COUNT] = {
+#define X(name, fmt, syntax, opcode, funct3, funct7, rs2) &&op_##name,
+        RISCV_INSTRUCTIONS(X)
+#undef X
+    };
+    size_t count = static_cast<size_t>(textEnd - TEXT_BASE) / 4;
+    size_t exitIndex = count, badTargetIndex = count + 1;
+    //static branch/jump targets become op indices, ones off .text the bad target op
+    auto targetIndex = [&](long target) {
+        return target % 4 == 0 && target >= TEXT_BASE && target <= textEnd ? static_cast<size_t>(target - TEXT_BASE) / 4 : badTargetIndex;
+    };
+    vector<PredecodedOp> ops(count + 2);
+    for (size_t i = 0; i < count; ++i) 
+    {
+        Decoded decoded = decodeWord(image.text[i]);
+        PredecodedOp& op = ops[i];
+        if (!decoded.info) 
+        {
+            op.handler = &&illegal;
+            continue;
+        }
+        op.handler = handlers[decoded.info - instructionTable];
+        op.rd = decoded.rd ? decoded.rd : 32;
+        op.rs1 = decoded.rs1;
+        op.rs2 = decoded.rs2;
+        op.imm = decoded.imm;
+        InstructionInfo::Format format = decoded.info->format;
+        if (format == InstructionInfo::Format::U) op.imm = signExtend(static_cast<uint32_t>(decoded.imm << 12), 32);
+        if (format == InstructionInfo::Format::SB || format == InstructionInfo::Format::UJ) op.imm = static_cast<int64_t>(targetIndex(TEXT_BASE + 4 * static_cast<long>(i) + decoded.imm));
+    }
+    ops[exitIndex].handler = &&finished;
+    ops[badTargetIndex].handler = &&badTarget;
+
+    SimulatedMemory memory(image);
+    uint64_t x[33] = {};
+    x[2] = STACK_TOP;
+    x[3] = GLOBAL_POINTER;
+    RunResult result;
+    size_t pc = 0, from = 0;  //op index, and the one the last jump left
+    uint64_t steps = 0, jumpTarget = 0;
+    uint8_t* at = nullptr;
+    uint64_t reservation = ~0ull;  //address of the last lr, none after an sc
+    vector<uint64_t> csrs(4096);
+    const PredecodedOp* op = nullptr;
+    auto address = [&](size_t index) { return static_cast<uint64_t>(TEXT_BASE) + 4 * index; };
+    auto sext32 = [](uint64_t value) { return static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(value))); };
+
+#define RD x[op->rd]
+#define RS1 x[op->rs1]
+#define RS2 x[op->rs2]
+#define DISPATCH() do { op = &ops[pc]; ++ops[pc].hits; ++steps; goto *op->handler; } while (0)
+#define NEXT() do { ++pc; DISPATCH(); } while (0)
+#define JUMP(target) do { from = pc; pc = (target); if (steps >= stepLimit) goto limit; DISPATCH(); } while (0)
+#define LOAD(bytes, extend) do { \
+        if (!(at = memory.find(RS1 + op->imm, bytes, false))) goto badLoad; \
+        RD = extend(loadLE(at, bytes)); NEXT(); } while (0)
+#define STORE(bytes) do { \
+        if (!(at = memory.find(RS1 + op->imm, bytes, true))) goto badStore; \
+        storeLE(at, RS2, bytes); NEXT(); } while (0)
+#define SIGNED(bits) [](uint64_t v) { return static_cast<uint64_t>(signExtend(static_cast<uint32_t>(v), bits)); }
+    //atomics need the natural alignment of their size; old is the memory value, source rs2
+#define ATOMIC(bytes, extend, update) do { \
+        if (RS1 % bytes) goto misaligned; \
+        if (!(at = memory.find(RS1, bytes, true))) goto badStore; \
+        uint64_t old = extend(loadLE(at, bytes)), source = RS2; \
+        storeLE(at, (update), bytes); RD = old; NEXT(); } while (0)
+    //csrs 0xC00 and up are read-only, a write to them faults; the instructions that only
+    //set or clear bits do not write with x0 / a 0 value
+#define CSR(value, update, writes) do { \
+        uint32_t number = static_cast<uint32_t>(op->imm); \
+        uint64_t old = number >= 0xC00 && number <= 0xC02 ? steps - 1 : csrs[number], source = (value); \
+        if (writes) { if (number >= 0xC00) goto readOnlyCsr; csrs[number] = (update); } \
+        RD = old; NEXT(); } while (0)
+
+    DISPATCH();
+op_add:   RD = RS1 + RS2; NEXT();
+op_addw:  RD = sext32(RS1 + RS2); NEXT();
+op_and:   RD = RS1 & RS2; NEXT();
+op_or:    RD = RS1 | RS2; NEXT();
+op_sll:   RD = RS1 << (RS2 & 63); NEXT();
+op_sllw:  RD = sext32(RS1 << (RS2 & 31)); NEXT();
+op_slt:   RD = static_cast<int64_t>(RS1) < static_cast<int64_t>(RS2); NEXT();
+op_sltu:  RD = RS1 < RS2; NEXT();
+op_sra:   RD = static_cast<uint64_t>(static_cast<int64_t>(RS1) >> (RS2 & 63)); NEXT();
+op_sraw:  RD = sext32(static_cast<uint32_t>(static_cast<int32_t>(RS1) >> (RS2 & 31))); NEXT();
+op_srl:   RD = RS1 >> (RS2 & 63); NEXT();
+op_srlw:  RD = sext32(static_cast<uint32_t>(RS1) >> (RS2 & 31)); NEXT();
+op_sub:   RD = RS1 - RS2; NEXT();
+op_subw:  RD = sext32(RS1 - RS2); NEXT();
+op_xor:   RD = RS1 ^ RS2; NEXT();
+op_mul:   RD = RS1 * RS2; NEXT();
+op_mulh:  RD = static_cast<uint64_t>((static_cast<__int128>(static_cast<int64_t>(RS1)) * static_cast<int64_t>(RS2)) >> 64); NEXT();
+op_mulhsu: RD = static_cast<uint64_t>((static_cast<__int128>(static_cast<int64_t>(RS1)) * static_cast<__int128>(RS2)) >> 64); NEXT();
+op_mulhu: RD = static_cast<uint64_t>((static_cast<unsigned __int128>(RS1) * RS2) >> 64); NEXT();
+op_mulw:  RD = sext32(RS1 * RS2); NEXT();
+    //division by zero and the one overflowing case give the values the spec fixes
+op_div: 
+    {
+        int64_t a = static_cast<int64_t>(RS1), b = static_cast<int64_t>(RS2);
+        RD = b == 0 ? ~0ull : (a == INT64_MIN && b == -1) ? static_cast<uint64_t>(a) : static_cast<uint64_t>(a / b);
+        NEXT();
+    }
+op_divu:  RD = RS2 == 0 ? ~0ull : RS1 / RS2; NEXT();
+op_divw: 
+    {
+        int32_t a = static_cast<int32_t>(RS1), b = static_cast<int32_t>(RS2);
+        RD = b == 0 ? ~0ull : (a == INT32_MIN && b == -1) ? sext32(static_cast<uint32_t>(a)) : sext32(static_cast<uint32_t>(a / b));
+        NEXT();
+    }
+op_divuw: 
+    {
+        uint32_t a = static_cast<uint32_t>(RS1), b = static_cast<uint32_t>(RS2);
+        RD = b == 0 ? ~0ull : sext32(a / b);
+        NEXT();
+    }
+op_rem: 
+    {
+        int64_t a = static_cast<int64_t>(RS1), b = static_cast<int64_t>(RS2);
+        RD = b == 0 ? static_cast<uint64_t>(a) : (a == INT64_MIN && b == -1) ? 0 : static_cast<uint64_t>(a % b);
+        NEXT();
+    }
+op_remu:  RD = RS2 == 0 ? RS1 : RS1 % RS2; NEXT();
+op_remw: 
+    {
+        int32_t a = static_cast<int32_t>(RS1), b = static_cast<int32_t>(RS2);
+        RD = b == 0 ? sext32(static_cast<uint32_t>(a)) : (a == INT32_MIN && b == -1) ? 0 : sext32(static_cast<uint32_t>(a % b));
+        NEXT();
+    }
+op_remuw: 
+    {
+        uint32_t a = static_cast<uint32_t>(RS1), b = static_cast<uint32_t>(RS2);
+        RD = sext32(b == 0 ? a : a % b);
+        NEXT();
+    }
+op_addi:  RD = RS1 + op->imm; NEXT();
+op_addiw: RD = sext32(RS1 + op->imm); NEXT();
+op_andi:  RD = RS1 & op->imm; NEXT();
+op_ori:   RD = RS1 | op->imm; NEXT();
+op_xori:  RD = RS1 ^ op->imm; NEXT();
+op_slti:  RD = static_cast<int64_t>(RS1) < op->imm; NEXT();
+op_sltiu: RD = RS1 < static_cast<uint64_t>(op->imm); NEXT();
+op_slli:  RD = RS1 << op->imm; NEXT();
+op_srli:  RD = RS1 >> op->imm; NEXT();
+op_srai:  RD = static_cast<uint64_t>(static_cast<int64_t>(RS1) >> op->imm); NEXT();
+op_slliw: RD = sext32(RS1 << op->imm); NEXT();
+op_srliw: RD = sext32(static_cast<uint32_t>(RS1) >> op->imm); NEXT();
+op_sraiw: RD = sext32(static_cast<uint32_t>(static_cast<int32_t>(RS1) >> op->imm)); NEXT();
+op_lb:    LOAD(1, SIGNED(8));
+op_lh:    LOAD(2, SIGNED(16));
+op_lw:    LOAD(4, SIGNED(32));
+op_ld:    LOAD(8, );
+op_lbu:   LOAD(1, );
+op_lhu:   LOAD(2, );
+op_lwu:   LOAD(4, );
+op_jalr: 
+    {
+        //rd may be rs1, read it first
+        jumpTarget = (RS1 + op->imm) & ~1ull;
+        RD = address(pc + 1);
+        JUMP(targetIndex(static_cast<long>(jumpTarget)));
+    }
+op_ecall: 
+    switch (x[10]) 
+    {
+        case 1: result.console += to_string(static_cast<int64_t>(x[11])); NEXT();
+        case 4: 
+            for (uint64_t byte = x[11]; (at = memory.find(byte, 1, false)) && *at; ++byte) result.console += static_cast<char>(*at);
+            if (!at) 
+            {
+                result.fault = "print of a string at " + Hexa(x[11]) + " running outside .data and the stack";
+                goto trap;
+            }
+            NEXT();
+        case 11: result.console += static_cast<char>(x[11]); NEXT();
+        case 17: result.exitCode = static_cast<int64_t>(x[11]); [[fallthrough]];
+        case 10: result.exited = true; goto done;
+    }
+    result.fault = "ecall " + to_string(x[10]) + " is no Venus environment call";
+    goto trap;
+op_ebreak: 
+    result.fault = "ebreak";
+    goto trap;
+op_fence: NEXT();  //one hart, memory is always in order
+op_sb:    STORE(1);
+op_sh:    STORE(2);
+op_sw:    STORE(4);
+op_sd:    STORE(8);
+op_beq:   if (RS1 == RS2) JUMP(op->imm); NEXT();
+op_bne:   if (RS1 != RS2) JUMP(op->imm); NEXT();
+op_bge:   if (static_cast<int64_t>(RS1) >= static_cast<int64_t>(RS2)) JUMP(op->imm); NEXT();
+op_blt:   if (static_cast<int64_t>(RS1) < static_cast<int64_t>(RS2)) JUMP(op->imm); NEXT();
+op_bgeu:  if (RS1 >= RS2) JUMP(op->imm); NEXT();
+op_bltu:  if (RS1 < RS2) JUMP(op->imm); NEXT();
+op_auipc: RD = address(pc) + op->imm; NEXT();
+op_lui:   RD = op->imm; NEXT();
+op_jal:   RD = address(pc + 1); JUMP(op->imm);
+op_lr_w: 
+    if (RS1 % 4) goto misaligned;
+    if (!(at = memory.find(RS1, 4, false))) goto badLoad;
+    reservation = RS1;
+    RD = sext32(loadLE(at, 4));
+    NEXT();
+op_lr_d: 
+    if (RS1 % 8) goto misaligned;
+    if (!(at = memory.find(RS1, 8, false))) goto badLoad;
+    reservation = RS1;
+    RD = loadLE(at, 8);
+    NEXT();
+op_sc_w: 
+    if (RS1 % 4) goto misaligned;
+    if (!(at = memory.find(RS1, 4, true))) goto badStore;
+    if (reservation == RS1) storeLE(at, RS2, 4);
+    RD = reservation != RS1;
+    reservation = ~0ull;
+    NEXT();
+op_sc_d: 
+    if (RS1 % 8) goto misaligned;
+    if (!(at = memory.find(RS1, 8, true))) goto badStore;
+    if (reservation == RS1) storeLE(at, RS2, 8);
+    RD = reservation != RS1;
+    reservation = ~0ull;
+    NEXT();
+op_amoswap_w: ATOMIC(4, SIGNED(32), source);
+op_amoadd_w:  ATOMIC(4, SIGNED(32), old + source);
+op_amoxor_w:  ATOMIC(4, SIGNED(32), old ^ source);
+op_amoand_w:  ATOMIC(4, SIGNED(32), old & source);
+op_amoor_w:   ATOMIC(4, SIGNED(32), old | source);
+op_amomin_w:  ATOMIC(4, SIGNED(32), static_cast<int32_t>(source) < static_cast<int32_t>(old) ? source : old);
+op_amomax_w:  ATOMIC(4, SIGNED(32), static_cast<int32_t>(source) > static_cast<int32_t>(old) ? source : old);
+op_amominu_w: ATOMIC(4, SIGNED(32), static_cast<uint32_t>(source) < static_cast<uint32_t>(old) ? source : old);
+op_amomaxu_w: ATOMIC(4, SIGNED(32), static_cast<uint32_t>(source) > static_cast<uint32_t>(old) ? source : old);
+op_amoswap_d: ATOMIC(8, , source);
+op_amoadd_d:  ATOMIC(8, , old + source);
+op_amoxor_d:  ATOMIC(8, , old ^ source);
+op_amoand_d:  ATOMIC(8, , old & source);
+op_amoor_d:   ATOMIC(8, , old | source);
+op_amomin_d:  ATOMIC(8, , static_cast<int64_t>(source) < static_cast<int64_t>(old) ? source : old);
+op_amomax_d:  ATOMIC(8, , static_cast<int64_t>(source) > static_cast<int64_t>(old) ? source : old);
+op_amominu_d: ATOMIC(8, , source < old ? source : old);
+op_amomaxu_d: ATOMIC(8, , source > old ? source : old);
+op_csrrw:  CSR(RS1, source, true);
+op_csrrs:  CSR(RS1, old | source, op->rs1 != 0);
+op_csrrc:  CSR(RS1, old & ~source, op->rs1 != 0);
+op_csrrwi: CSR(op->rs1, source, true);
+op_csrrsi: CSR(op->rs1, old | source, op->rs1 != 0);
+op_csrrci: CSR(op->rs1, old & ~source, op->rs1 != 0);
+
+#undef RD
+#undef RS1
+#undef RS2
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef LOAD
+#undef STORE
+#undef SIGNED
+#undef ATOMIC
+#undef CSR
+
+illegal:
+    --steps;
+    result.fault = "illegal instruction " + Hexa(image.text[pc], 8);
+    goto done;
+badLoad:
+    result.fault = "load from " + Hexa(x[op->rs1] + op->imm) + ", outside .data and the stack";
+    goto trap;
+badStore:
+    result.fault = "store to " + Hexa(x[op->rs1] + op->imm) + ", outside .data and the stack";
+    goto trap;
+misaligned:
+    result.fault = "atomic access to " + Hexa(x[op->rs1]) + ", which is not aligned to its size";
+    goto trap;
+readOnlyCsr:
+    result.fault = "write to the read-only csr " + Hexa(static_cast<uint64_t>(op->imm), 3);
+    goto trap;
+trap:
+    //the faulting instruction did not run
+    --steps;
+    --ops[pc].hits;
+    goto done;
+badTarget:
+    //a static target is in the branch's word, a jalr's was computed
+    pc = from;
+    result.fault = "jump to " + Hexa(ops[pc].handler == &&op_jalr ? jumpTarget : address(pc) + decodeWord(image.text[pc]).imm) + ", outside .text";
+    --steps;
+    goto done;
+limit:
+    result.fault = "stopped after " + to_string(steps) + " instructions";
+    pc = from;
+    goto done;
+finished:
+    --steps;
+done:
+    result.pc = address(pc);
+    result.steps = steps;
+    copy_n(x, 32, result.registers.begin());
+    for (size_t i = 0; i < count; ++i) 
+    {
+        if (ops[i].handler == &&illegal) continue;
+        result.counts[decodeWord(image.text[i]).info - instructionTable] += ops[i].hits;
+    }
+    return result;
+}
+
+//source line of the instruction at a .text address, 0 if no line put one there
+int lineOfAddress(const Program& program, uint64_t address) 
+{
+    LineMap lines;
+    lines.add(program, string(), TEXT_BASE);
+    const LineRow* row = lines.find(static_cast<long>(address));
+    return row ? row->line : 0;
+}
+
+//--run report: what the program printed, how far it got, the mnemonics by how often
+//they ran, and every register
+void printRunReport(ostream& out, const RunResult& run, double seconds) 
+{
+    if (!run.console.empty()) 
+    {
+        out << run.console;
+        if (run.console.back() != '\n') out << endl;
+    }
+    out << "Ran " << run.steps << " instructions in " << fixed << setprecision(3) << seconds << " s";
+    if (seconds > 0) out << " (" << setprecision(1) << run.steps / seconds / 1e6 << " M/s)";
+    out << ", last pc " << Hexa(run.pc);
+    if (run.exited) out << ", exit code " << run.exitCode;
+    out << endl;
+
+    vector<size_t> ids;
+    for (size_t id = 0; id < INSN_COUNT; ++id) 
+    {
+        if (run.counts[id]) ids.push_back(id);
+    }
+    stable_sort(ids.begin(), ids.end(), [&](size_t a, size_t b) { return run.counts[a] > run.counts[b]; });
+    out << "Executed:";
+    for (size_t id : ids) out << ' ' << instructionTable[id].name << ' ' << run.counts[id];
+    out << endl;
+
+    const char* abiNames[32] = {};
+#define X(name, num) if (!abiNames[num]) abiNames[num] = #name;
+    RISCV_REGISTER_NAMES(X)
+#undef X
+    out << "Registers:" << endl;
+    for (int r = 0; r < 32; ++r) 
+    {
+        out << "  x" << left << setw(3) << r << setw(5) << abiNames[r] << right << Hexa(run.registers[r], 16)
+             << ' ' << static_cast<int64_t>(run.registers[r]) << endl;
+    }
+}
+
+//phases timed by runAssembler, reported by --bench
+enum Phase { PHASE_READ, PHASE_PASS1, PHASE_PASS2, PHASE_LINK, PHASE_DATA, PHASE_COUNT };
+constexpr const char* phaseNames[PHASE_COUNT] = {"read", "pass 1", "pass 2 text", "link", "data + write"};
+
+struct PhaseStats 
+{
+    array<double, PHASE_COUNT> seconds{};
+    array<size_t, PHASE_COUNT> allocations{};
+};
+
+//times one phase into stats on destruction
+class PhaseTimer 
+{
+public:
+    PhaseTimer(PhaseStats& stats, Phase phase)
+        : stats(stats), phase(phase), start(chrono::steady_clock::now()) 
+    {
+#ifdef COUNT_ALLOCATIONS
+        startAllocations = totalHeapAllocations();
+#endif
+    }
+    ~PhaseTimer() 
+    {
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        stats.seconds[phase] += chrono::duration<double>(end - start).count();
+#ifdef COUNT_ALLOCATIONS
+        stats.allocations[phase] += totalHeapAllocations() - startAllocations;
+#endif
+        if (traceLog.enabled.load(memory_order_relaxed)) traceLog.record(phaseNames[phase], traceThread, start, end, 0);
+    }
+private:
+    PhaseStats& stats;
+    Phase phase;
+    chrono::steady_clock::time_point start;
+    size_t startAllocations = 0;
+};
+
+//phase table shared by --bench and --stats, returns the total seconds
+double printPhaseTable(ostream& out, const PhaseStats& stats) 
+{
+    double total = 0;
+    for (double phase : stats.seconds) total += phase;
+    out << fixed << setprecision(3);
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) 
+    {
+        out << "  " << left << setw(14) << phaseNames[phase] << right << setw(9) << stats.seconds[phase] << " s "
+             << setw(5) << setprecision(1) << 100 * stats.seconds[phase] / max(total, 1e-9) << "%" << setprecision(3);
+        if (COUNTS_ALLOCATIONS) out << " " << setw(10) << stats.allocations[phase] << " allocations";
+        out << endl;
+    }
+    out << "  " << left << setw(14) << "total" << right << setw(9) << total << " s" << endl;
+    return total;
+}
+
+//InstructionInfo::Format order
+constexpr const char* formatNames[] = {"R", "I", "S", "SB", "U", "UJ"};
+
+//--stats: the phase table, the recorded spans summed by name (thread time, so parallel
+//spans add up to more than the phase they ran in) and what the program was made of,
+//summed over the files of a link
+void printStats(ostream& out, const vector<Program>& programs, const PhaseStats& stats) 
+{
+    out << "Stats:" << endl;
+    printPhaseTable(out, stats);
+
+    struct SpanTotal { const char* name; size_t spans; int64_t micros; size_t items; };
+    vector<SpanTotal> totals;
+    {
+        lock_guard<mutex> guard(traceLog.lock);
+        for (const TraceEvent& event : traceLog.events) 
+        {
+            //the phases are in the table already
+            if (find(begin(phaseNames), end(phaseNames), event.name) != end(phaseNames)) continue;
+            auto found = find_if(totals.begin(), totals.end(), [&](const SpanTotal& total) { return strcmp(total.name, event.name) == 0; });
+            if (found == totals.end()) found = totals.insert(totals.end(), {event.name, 0, 0, 0});
+            ++found->spans;
+            found->micros += event.duration;
+            found->items += event.items;
+        }
+    }
+    out << "Spans (thread time, summed over the -j threads):" << endl;
+    for (const SpanTotal& total : totals) 
+    {
+        out << "  " << left << setw(14) << total.name << right << setw(9) << total.micros / 1e6 << " s "
+             << setw(6) << total.spans << " spans";
+        if (total.items) out << setw(12) << total.items << " items";
+        out << endl;
+    }
+
+    array<size_t, size(formatNames)> formats{};
+    size_t statements = 0, pseudo = 0, relaxed = 0, data = 0;
+    size_t sourceLines = 0, labels = 0, relocations = 0;
+    long textBytes = 0, dataBytes = 0;
+    for (const Program& program : programs) 
+    {
+        for (const SourceLine& entry : program.lines) 
+        {
+            if (entry.tokenCount == 0) continue;
+            ++statements;
+            if (!entry.inText) ++data;
+            else if (entry.pseudo != Pseudo::None) ++pseudo;
+            else if (entry.info) ++formats[static_cast<size_t>(entry.info->format)];
+            if (entry.relaxation != Relaxation::None) ++relaxed;
+        }
+        sourceLines += program.lines.empty() ? 0 : program.lines.back().lineNo;
+        labels += program.symbols.size();
+        relocations += program.relocations.size();
+        textBytes += program.textEnd - TEXT_BASE;
+        dataBytes += program.dataEnd - DATA_BASE;
+    }
+    out << "Program:" << endl;
+    if (programs.size() > 1) out << "  " << programs.size() << " files, " << relocations << " relocations" << endl;
+    out << "  " << sourceLines << " source lines, " << statements
+         << " statements, " << labels << " labels" << endl;
+    out << "  instructions:";
+    for (size_t format = 0; format < formats.size(); ++format) out << ' ' << formatNames[format] << ' ' << formats[format];
+    out << ", pseudo " << pseudo << ", relaxed " << relaxed << endl;
+    out << "  " << textBytes / 4 << " text words, " << data << " data directives, "
+         << dataBytes << " data bytes" << endl;
+}
+
+//Chrome trace JSON (chrome://tracing, Perfetto) of every recorded span, one track per
+//parallelFor worker
+string traceJson() 
+{
+    lock_guard<mutex> guard(traceLog.lock);
+    string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    int threads = 0;
+    for (const TraceEvent& event : traceLog.events) 
+    {
+        threads = max(threads, event.thread + 1);
+        out += "{\"name\":";
+        appendJsonString(out, event.name);
+        out += ",\"ph\":\"X\",\"pid\":1,\"tid\":" + to_string(event.thread) + ",\"ts\":" + to_string(event.begin)
+            + ",\"dur\":" + to_string(event.duration);
+        if (event.items) out += ",\"args\":{\"items\":" + to_string(event.items) + '}';
+        out += "},\n";
+    }
+    for (int thread = 0; thread < threads; ++thread) 
+    {
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + to_string(thread) + ",\"args\":{\"name\":\""
+            + (thread ? "worker " + to_string(thread) : string("main")) + "\"}}";
+        out += thread + 1 < threads ? ",\n" : "\n";
+    }
+    out += "]}\n";
+    return out;
+}
+
+//the listing line between the text and the data segment
+void appendTextEndMarker(string& out, OutputFormat format, long textEnd) 
+{
+    appendHex(out, textEnd);
+    out += " 0xENDDC0DE";
+    if (format == OutputFormat::Venus) out += " End of text segment";
+    out += '\n';
+}
+
+//listing of one data line whose `size` bytes are at bytes, placed at address
+void appendDataListing(OutputWriter& output, OutputFormat format, const SourceLine& entry, string_view directive, const uint8_t* bytes, long size, long address) 
+{
+    string& out = output.buffer();
+    long dataAddress = address;
+    
+    //print data based on directive; an .asciz pass 1 could not size was reported there
+    if (directive == ".asciz" && size > 0) 
+    {
+        appendHex(out, dataAddress);
+        out += ' ';
+        string_view strData;
+        if (quotedText(entry, strData)) 
+        {
+            //null char at the end of string
+            out += '"';
+            out += strData;
+            out += "\\0\""; // Show string
+        }
+        out += '\n';
+        output.flushIfFull();
+        return;
+    }
+
+    //one line per value; .incbin lists its bytes, padding (.zero/.space/.align) is not listed
+    int width = directive == ".incbin" ? 1 : dataValueWidth(directive);
+    for (long at = 0; width > 0 && at < size; at += width) 
+    {
+        uint64_t value = 0;
+        for (int b = 0; b < width; ++b) value |= static_cast<uint64_t>(bytes[at + b]) << (8 * b);
+        appendHex(out, dataAddress + at);
+        out += ' ';
+        if (format == OutputFormat::Bin) 
+        {
+            appendBits(out, value, width * 8);
+        }
+        else 
+        {
+            appendHex(out, value, width * 2);
+        }
+        out += '\n';
+        output.flushIfFull();
+    }
+}
+
+//result of one Assembler::assemble call
+struct AssemblyResult 
+{
+    Image image;                         //encoded text words and data bytes
+    string output;                       //venus/hex/bin listing or the ELF file, empty for raw (use image)
+    vector<pair<string, long>> symbols;  //defined labels, sorted by name
+    LineMap lines;                       //.text address -> source line, file 0 is "<source>"
+    Diagnostics diagnostics;
+
+    bool ok() const { return diagnostics.errors == 0; }
+};
+
+//reentrant assembler: everything an assembly touches lives in the Program it works on,
+//so one Assembler can be shared by any number of threads
+class Assembler 
+{
+public:
+    //maxErrors: errors kept in a program's diagnostics before the rest are dropped, 0 keeps all
+    explicit Assembler(OutputFormat format = OutputFormat::Venus, int jobs = 1, size_t maxErrors = 0)
+        : format(format), jobs(jobs), maxErrors(maxErrors) {}
+
+    //pass 1: line table, addresses and program.symbols; returns the tokenize allocations
+    size_t layout(Program& program) const 
+    {
+        program.diagnostics.limit = maxErrors;
+        return runPass1(program, jobs);
+    }
+
+    //pass 2 over the text segment, see runPass2Text; returns the encode allocations
+    //incremental, if given, must have been prepared for program
+    size_t encodeText(Program& program, bool fillImage, Image& image, OutputWriter& output, IncrementalCache* incremental = nullptr) const 
+    {
+        return runPass2Text(program, format, jobs, fillImage, image, output, program.diagnostics, incremental,
+            program.relocatable ? &program.relocations : nullptr);
+    }
+
+    //end of text marker and data segment: text formats list it, raw/elf (or fillImage) store its bytes
+    //values that are not numbers are reported to program.diagnostics and stored as 0
+    void encodeData(Program& program, bool fillImage, Image& image, OutputWriter& output) const;
+
+    //whole assembly of an in-memory source; workspace is reset and its storage reused,
+    //so a caller assembling many sources keeps one workspace per thread
+    AssemblyResult assemble(string source, Program& workspace) const;
+    AssemblyResult assemble(string source) const 
+    {
+        Program workspace;
+        return assemble(move(source), workspace);
+    }
+
+    OutputFormat outputFormat() const { return format; }
+
+private:
+    OutputFormat format;
+    int jobs;  //threads for each pass
+    size_t maxErrors;
+};
+
+void Assembler::encodeData(Program& program, bool fillImage, Image& image, OutputWriter& output) const 
+{
+    TraceSpan span("data");
+    bool binaryOutput = format == OutputFormat::Raw || format == OutputFormat::Elf;
+    vector<uint8_t> scratch; //bytes of the current data line when the image is not kept
+    string& out = output.buffer();
+
+    if (!binaryOutput) appendTextEndMarker(out, format, program.textEnd);
+
+    //the whole segment is one zeroed buffer, every line parses its values straight into it
+    bool keepImage = binaryOutput || fillImage;
+    if (keepImage) image.data.assign(program.dataEnd - DATA_BASE, 0);
+
+    //now we will work on the data segment
+    bool wroteDataHeader = false;
+    for (const SourceLine& entry : program.lines) 
+    {
+        if (entry.inText || entry.tokenCount == 0) continue;
+        string_view directive = program.tokens[entry.firstToken];
+        long size = dataLineSize(entry, directive);
+        uint8_t* bytes;
+        if (keepImage) bytes = image.data.data() + (entry.address - DATA_BASE);
+        else 
+        {
+            scratch.assign(size, 0);
+            bytes = scratch.data();
+        }
+        OperandStatus status;
+        if (!emitDataBytes(program, entry, directive, bytes, status)) 
+        {
+            string message = status.error == OperandError::BadExpression ? expressionMessage(status.expression, status.operand, status.symbol)
+                : status.error == OperandError::OutOfRange ? "value '" + string(status.operand) + "' out of range "
+                    + to_string(status.low) + ".." + to_string(status.high) + " for " + string(directive)
+                : "bad value '" + string(status.operand) + "' in " + string(directive);
+            program.diagnostics.error(entry.lineNo, tokenColumn(program, entry, status.symbol.empty() ? status.operand : status.symbol), move(message));
+        }
+        if (binaryOutput) continue;
+
+        //add a line to separate text and data segment
+        if (!wroteDataHeader) 
+        {
+            out += '\n'; // Add a blank line for spacing
+            wroteDataHeader = true;
+        }
+
+        appendDataListing(output, format, entry, directive, bytes, size, entry.address);
+    }
+}
+
+AssemblyResult Assembler::assemble(string source, Program& workspace) const 
+{
+    workspace.reset();
+    workspace.source.owned = move(source);
+    AssemblyResult result;
+    layout(workspace);
+    OutputWriter output;
+    //past the error limit there is nothing left worth encoding
+    if (!workspace.diagnostics.full()) 
+    {
+        encodeText(workspace, true, result.image, output);
+        encodeData(workspace, true, result.image, output);
+    }
+
+    result.lines.add(workspace, "<source>", TEXT_BASE);
+    if (format == OutputFormat::Elf) 
+    {
+        vector<uint8_t> elf = buildElf(result.image, workspace.symbols, 0);
+        result.output.assign(elf.begin(), elf.end());
+    }
+    else if (format != OutputFormat::Raw) 
+    {
+        result.output = output.take();
+    }
+    for (uint32_t id : definedLabelsByName(workspace.symbols)) 
+    {
+        result.symbols.emplace_back(string(workspace.symbols.names[id]), workspace.symbols.addresses[id]);
+    }
+    result.diagnostics = workspace.diagnostics;
+    return result;
+}
+
+//--symbols and --line-map files of an assembly or a link, false (reported) if one cannot be written
+bool writeSymbolsAndLines(const Options& options, const LabelTable& symbols, size_t globalCount, long textEnd, long dataEnd, const LineMap& lines) 
+{
+    if (!options.symbolsFilename.empty() && !writeTextFile(options.symbolsFilename, symbolFileText(symbols, globalCount, textEnd, dataEnd))) 
+    {
+        cerr << "Error:cant write symbol file " << options.symbolsFilename << endl;
+        return false;
+    }
+    if (!options.lineMapFilename.empty() && !writeTextFile(options.lineMapFilename, lineMapText(lines))) 
+    {
+        cerr << "Error:cant write line map " << options.lineMapFilename << endl;
+        return false;
+    }
+    return true;
+}
+
+//one full assembly of options.inputFilename into options.outputFilename, in program
+int assembleFile(const Options& options, Program& program, PhaseStats& stats) 
+{
+    const string& inputFilename = options.inputFilename;
+    const string& outputFilename = options.outputFilename;
+    Assembler assembler(options.format, options.jobs, options.maxErrors);
+    //with the output on stdout, progress messages move to stderr
+    bool toStdout = outputFilename == "-";
+    ostream quietLog(nullptr); //discards everything
+    ostream& log = options.quiet ? quietLog : toStdout ? cerr : cout;
+
+    //read and tokenize the input once
+    {
+        PhaseTimer timer(stats, PHASE_READ);
+        if (!readSource(inputFilename, program.source)) 
+        {
+            cerr << "Error:Could not open input file " << inputFilename << endl;
+            return 1;
+        }
+    }
+    //messages reported since the last call, the error count stays
+    string sourceName = inputFilename == "-" ? "<stdin>" : inputFilename;
+    auto printDiagnostics = [&]() {
+        cerr << formatDiagnostics(program.diagnostics, sourceName, options.jsonDiagnostics);
+        program.diagnostics.entries.clear();
+    };
+
+    //build symbol table
+    log << "Starting Pass 1: Building Symbol Table..." << endl;
+    {
+        PhaseTimer timer(stats, PHASE_PASS1);
+        assembler.layout(program);
+        //one program per process, so pass 1's scratch goes back before pass 2 runs
+        program.chunkArenas.clear();
+    }
+    //at the error limit already, pass 2 would only add errors nobody sees
+    if (program.diagnostics.full()) 
+    {
+        printDiagnostics();
+        return 1;
+    }
+    log << "Tokenized " << program.lines.size() << " lines" << endl;
+    if (program.relaxedBranches) log << "Relaxed " << program.relaxedBranches << " out of range branches/jumps" << endl;
+    if (!options.quiet) 
+    {
+        log << "Pass 1 complete. Symbol Table:" << endl;
+        for (uint32_t id : definedLabelsByName(program.symbols)) {
+            log << "  " << program.symbols.names[id] << ": " << Hexa(program.symbols.addresses[id], 0) << endl;
+        }
+    }
+
+    //generate machine Code
+    log << "Starting Pass 2: Generating Machine Code..." << endl;
+    //raw and elf collect the segments in memory and write them in one go at the end
+    bool binaryOutput = options.format == OutputFormat::Raw || options.format == OutputFormat::Elf;
+    Image image;
+    //the incremental run reads the old output while writing the new one next to it
+    unique_ptr<IncrementalCache> incremental;
+    string textOutputFilename = outputFilename;
+    if (options.incremental) 
+    {
+        incremental = make_unique<IncrementalCache>();
+        incremental->load(options.cacheFilename, options.format, outputFilename);
+        if (!binaryOutput) textOutputFilename += ".tmp";
+    }
+    int outputFd = toStdout ? STDOUT_FILENO : -1;
+    if (!binaryOutput && !toStdout) 
+    {
+        outputFd = open(textOutputFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFd < 0) {
+            printDiagnostics();
+            cerr << "Error:cant open output file for Pass 2" << endl;
+            return 1;
+        }
+    }
+    //raw and elf never write text, so their writer keeps its (empty) buffer
+    OutputWriter output(binaryOutput ? -1 : outputFd);
+
+    {
+        PhaseTimer timer(stats, PHASE_PASS2);
+        if (incremental) 
+        {
+            TraceSpan span("cache", program.lines.size());
+            incremental->prepare(program, options.jobs);
+        }
+        assembler.encodeText(program, options.verify || options.run, image, output, incremental.get());
+    }
+    //lines with errors would only show up again as mismatches
+    if (options.verify && program.diagnostics.errors == 0) 
+    {
+        size_t words = verifyText(program, image, options.jobs, program.diagnostics);
+        size_t mismatches = program.diagnostics.errors;
+        log << "Verified " << words << " words against the source, " << mismatches << " mismatches" << endl;
+    }
+    if (incremental) 
+    {
+        log << "Reused " << incremental->reusedLines.load() << " encoded lines from " << options.cacheFilename << endl;
+    }
+    PhaseTimer timer(stats, PHASE_DATA);
+    assembler.encodeData(program, options.run, image, output);
+    //pass 1, pass 2 and the data in one batch, so they come out in source order together
+    printDiagnostics();
+
+    LineMap lines;
+    if (options.debugLine || !options.lineMapFilename.empty()) lines.add(program, sourceName, TEXT_BASE);
+    if (binaryOutput) 
+    {
+        bool written = options.format == OutputFormat::Raw
+            ? writeFlatImage(outputFilename, image)
+            : writeElf(outputFilename, image, program.symbols, 0, options.debugLine ? &lines : nullptr);
+        if (!written) 
+        {
+            cerr << "Error:cant write output file " << outputFilename << endl;
+            return 1;
+        }
+    }
+    else 
+    {
+        bool written = output.flush();
+        if (!toStdout) written = close(outputFd) == 0 && written;
+        if (written && textOutputFilename != outputFilename) written = rename(textOutputFilename.c_str(), outputFilename.c_str()) == 0;
+        if (!written) 
+        {
+            cerr << "Error:cant write output file " << outputFilename << endl;
+            return 1;
+        }
+    }
+    if (incremental && !incremental->save(options.cacheFilename, options.format, binaryOutput ? string() : outputFilename)) 
+    {
+        cerr << "Error:cant write cache file " << options.cacheFilename << endl;
+        return 1;
+    }
+    if (!writeSymbolsAndLines(options, program.symbols, 0, program.textEnd, program.dataEnd, lines)) return 1;
+
+    log << "Pass 2 complete. Output written to " << outputFilename << endl;
+    //a program with errors has holes in it, there is nothing meaningful to run
+    if (options.run && program.diagnostics.errors == 0) 
+    {
+        TraceSpan span("run");
+        auto start = chrono::steady_clock::now();
+        RunResult run = runProgram(image, program.textEnd, options.runLimit);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        span.items = run.steps;
+        if (!run.fault.empty()) 
+        {
+            program.diagnostics.error(lineOfAddress(program, run.pc), 0, "run: " + run.fault + " at pc " + Hexa(run.pc));
+            printDiagnostics();
+        }
+        printRunReport(toStdout ? cerr : cout, run, seconds);
+    }
+    if (program.diagnostics.errors) log << program.diagnostics.errors << " errors" << endl;
+    return program.diagnostics.errors == 0 ? 0 : 1;
+}
+
+//one input file of a link: its own assembly and where the link put its sections
+struct LinkInput 
+{
+    Image image;        //text and data as assembled at TEXT_BASE/DATA_BASE
+    long textBase = 0;  //where its .text and .data start in the linked image
+    long dataBase = 0;
+    long dataAlignment = 8;  //largest boundary its .data aligns to
+    vector<pair<uint32_t, int>> exports;  //.globl labels it defines, with the .globl line
+};
+
+//address of one of input's labels in the linked image
+long linkedAddress(const LinkInput& input, long address) 
+{
+    return address >= DATA_BASE ? address - DATA_BASE + input.dataBase : address - TEXT_BASE + input.textBase;
+}
+
+//what the linker needs from a file besides its words: the labels it exports with
+//.globl/.global (a name it does not define there is an import and needs nothing) and
+//the largest .align/.balign boundary in its .data, which its data must start on
+void scanLinkInput(const Program& program, LinkInput& input) 
+{
+    for (const SourceLine& entry : program.lines) 
+    {
+        if (entry.tokenCount == 0) continue;
+        string_view directive = program.tokens[entry.firstToken];
+        if (!entry.inText && isAlignDirective(directive) && entry.size != BAD_DIRECTIVE) input.dataAlignment = max(input.dataAlignment, entry.size);
+        if (directive != ".globl" && directive != ".global") continue;
+        //the names are read from the text, a generated file may list more than MAX_OPERANDS
+        string_view names = directiveArguments(entry, directive);
+        size_t at = 0;
+        while (at < names.size()) 
+        {
+            while (at < names.size() && isValueSeparator(names[at])) ++at;
+            size_t end = at;
+            while (end < names.size() && !isValueSeparator(names[end])) ++end;
+            uint32_t id = end > at ? program.symbols.find(names.substr(at, end - at)) : NO_LABEL;
+            if (id != NO_LABEL && program.symbols.addresses[id] != UNDEFINED_ADDRESS) input.exports.emplace_back(id, entry.lineNo);
+            at = end;
+        }
+    }
+}
+
+//patch every relocation of one file into its own words, in one sweep: a label the file
+//defines is where the link put it, any other name must be a global of some file
+//a branch or jal that no longer reaches its target is an error, like an undefined name
+void applyRelocations(Program& program, LinkInput& input, const LabelTable& globals) 
+{
+    for (const Relocation& relocation : program.relocations) 
+    {
+        string_view name = program.symbols.names[relocation.symbol];
+        long target = program.symbols.addresses[relocation.symbol];
+        if (target != UNDEFINED_ADDRESS) target = linkedAddress(input, target);
+        else 
+        {
+            uint32_t id = globals.find(name);
+            target = id == NO_LABEL ? UNDEFINED_ADDRESS : globals.addresses[id];
+        }
+        if (target == UNDEFINED_ADDRESS) 
+        {
+            program.diagnostics.error(relocation.lineNo, 0, "undefined symbol '" + string(name) + "'");
+            continue;
+        }
+
+        uint32_t* words = input.image.text.data() + (relocation.address - TEXT_BASE) / 4;
+        long delta = target - linkedAddress(input, relocation.address);
+        long hi = (delta + 0x800) >> 12;
+        long absoluteHi = (target + 0x800) >> 12;
+        switch (relocation.type) 
+        {
+            case RelocationType::Branch:
+            case RelocationType::Jump:
+                if (relocation.type == RelocationType::Branch ? !fitsSB(delta) : !fitsUJ(delta)) 
+                {
+                    program.diagnostics.error(relocation.lineNo, 0, "'" + string(name) + "' is out of reach once linked (" + to_string(delta) + " bytes away)");
+                    continue;
+                }
+                words[0] = withImmediate(words[0], delta);
+                break;
+            case RelocationType::PcRelative:
+                words[0] = withImmediate(words[0], hi);
+                words[1] = withImmediate(words[1], delta - hi * 4096);
+                break;
+            case RelocationType::AbsoluteHi:
+                words[0] = withImmediate(words[0], absoluteHi);
+                break;
+            case RelocationType::AbsoluteLo:
+                words[0] = withImmediate(words[0], target - absoluteHi * 4096);
+                break;
+        }
+    }
+}
+
+//listing line of a linked word; its operands are read back from the word, since the
+//source's labels and register names say nothing about where a link put things
+void appendLinkedListingLine(string& out, OutputFormat format, long address, uint32_t word) 
+{
+    Decoded decoded = decodeWord(word);
+    if (!decoded.info) return;
+    const InstructionInfo& info = *decoded.info;
+    char text[MAX_OPERANDS][24];
+    Operands operands = decodedOperands(decoded, text);
+    appendListingLine(out, format, address, word, info, operands, labelOperandIndex(info) ? decoded.imm : 0);
+}
+
+//several input files assembled apart and linked into options.outputFilename
+//every file runs pass 1 and pass 2 on its own (files in parallel, the -j threads shared
+//out between them) at TEXT_BASE/DATA_BASE, as if it were the whole program; what pass 2
+//cannot know goes into the file's relocations: references to labels it does not define,
+//pc-relative ones from .text into .data and every %hi/%lo. The link then lays the
+//files out one after the other in argument order, merges the .globl labels into one
+//table and patches each file's relocations in one sweep per file; labels without .globl
+//stay local to their file, so two files may both have a `loop`
+int linkFiles(const Options& options, vector<Program>& programs, PhaseStats& stats) 
+{
+    const vector<string>& inputFilenames = options.inputFilenames;
+    size_t fileCount = programs.size();
+    //with the output on stdout, progress messages move to stderr
+    bool toStdout = options.outputFilename == "-";
+    ostream quietLog(nullptr); //discards everything
+    ostream& log = options.quiet ? quietLog : toStdout ? cerr : cout;
+    int jobs = options.jobs;
+    int fileJobs = max(1, jobs / static_cast<int>(fileCount));
+    //each file encodes into its image only, the listing comes from the linked words
+    Assembler assembler(OutputFormat::Raw, fileJobs, options.maxErrors);
+    vector<LinkInput> inputs(fileCount);
+
+    auto sourceName = [&](size_t file) { return inputFilenames[file] == "-" ? string("<stdin>") : inputFilenames[file]; };
+    //messages reported since the last call, in file order
+    auto printDiagnostics = [&]() {
+        for (size_t file = 0; file < fileCount; ++file) 
+        {
+            cerr << formatDiagnostics(programs[file].diagnostics, sourceName(file), options.jsonDiagnostics);
+            programs[file].diagnostics.entries.clear();
+        }
+    };
+    auto errors = [&]() {
+        size_t count = 0;
+        for (const Program& program : programs) count += program.diagnostics.errors;
+        return count;
+    };
+
+    {
+        PhaseTimer timer(stats, PHASE_READ);
+        vector<char> opened(fileCount);
+        parallelFor(fileCount, jobs, [&](size_t file) { opened[file] = readSource(inputFilenames[file], programs[file].source); });
+        for (size_t file = 0; file < fileCount; ++file) 
+        {
+            if (!opened[file]) 
+            {
+                cerr << "Error:Could not open input file " << inputFilenames[file] << endl;
+                return 1;
             }
+        }
+    }
 
-            //separate the directive and operands
-            vector<string> operands = parseOperands(cleaned);
+    log << "Assembling " << fileCount << " files..." << endl;
+    {
+        PhaseTimer timer(stats, PHASE_PASS1);
+        parallelFor(fileCount, jobs, [&](size_t file) {
+            Program& program = programs[file];
+            program.relocatable = true;
+            assembler.layout(program);
+            program.chunkArenas.clear();
+            scanLinkInput(program, inputs[file]);
+        });
+    }
+    {
+        PhaseTimer timer(stats, PHASE_PASS2);
+        parallelFor(fileCount, jobs, [&](size_t file) {
+            Program& program = programs[file];
+            //past the error limit there is nothing left worth encoding
+            if (program.diagnostics.full()) return;
+            OutputWriter discard;
+            assembler.encodeText(program, true, inputs[file].image, discard);
+            assembler.encodeData(program, true, inputs[file].image, discard);
+        });
+    }
+    printDiagnostics();
+    size_t lineCount = 0, relocationCount = 0;
+    for (const Program& program : programs) 
+    {
+        lineCount += program.lines.size();
+        relocationCount += program.relocations.size();
+    }
+    log << "Assembled " << lineCount << " lines, " << relocationCount << " relocations" << endl;
+    if (errors()) 
+    {
+        log << errors() << " errors" << endl;
+        return 1;
+    }
+
+    //lay out the sections, merge the globals and patch
+    Image linked;
+    LabelTable globals;
+    long textEnd = TEXT_BASE, dataEnd = DATA_BASE;
+    {
+        PhaseTimer timer(stats, PHASE_LINK);
+        TraceSpan layout("layout", fileCount);
+        for (size_t file = 0; file < fileCount; ++file) 
+        {
+            LinkInput& input = inputs[file];
+            input.textBase = textEnd;
+            textEnd += programs[file].textEnd - TEXT_BASE;
+            input.dataBase = (dataEnd + input.dataAlignment - 1) / input.dataAlignment * input.dataAlignment;
+            dataEnd = input.dataBase + programs[file].dataEnd - DATA_BASE;
+        }
+        if (textEnd > DATA_BASE) 
+        {
+            cerr << "Error:linked .text runs into .data at " << Hexa(DATA_BASE) << endl;
+            return 1;
+        }
+        layout.finish();
 
-            if (operands.empty()) continue;
-            string directive = operands[0];
-            
-            //print data based on directive
-            if (directive == ".asciz") 
+        //a global defined twice keeps its first definition
+        TraceSpan merge("merge globals");
+        vector<size_t> owner;
+        for (size_t file = 0; file < fileCount; ++file) 
+        {
+            Program& program = programs[file];
+            for (const auto& [id, lineNo] : inputs[file].exports) 
             {
-                outputFile << Hexa(dataAddress, 0) << " ";
-                size_t fq = line.find('\"'), lq = line.rfind('\"');
-                if (fq != string::npos && lq != string::npos && fq != lq) 
+                uint32_t global = globals.intern(program.symbols.names[id]);
+                if (global == owner.size()) owner.push_back(file);
+                if (globals.addresses[global] == UNDEFINED_ADDRESS) globals.addresses[global] = linkedAddress(inputs[file], program.symbols.addresses[id]);
+                else if (owner[global] != file) 
                 {
-                    string strData = line.substr(fq + 1, lq - fq - 1);
+                    program.diagnostics.error(lineNo, 0, "duplicate global symbol '" + string(program.symbols.names[id]) + "', also defined in " + sourceName(owner[global]));
+                }
+            }
+        }
+        merge.items = globals.size();
+        merge.finish();
+
+        parallelFor(fileCount, jobs, [&](size_t file) {
+            TraceSpan span("relocate", programs[file].relocations.size());
+            applyRelocations(programs[file], inputs[file], globals);
+        });
+        linked.text.resize((textEnd - TEXT_BASE) / 4);
+        linked.data.assign(dataEnd - DATA_BASE, 0);
+        parallelFor(fileCount, jobs, [&](size_t file) {
+            const LinkInput& input = inputs[file];
+            copy(input.image.text.begin(), input.image.text.end(), linked.text.begin() + (input.textBase - TEXT_BASE) / 4);
+            copy(input.image.data.begin(), input.image.data.end(), linked.data.begin() + (input.dataBase - DATA_BASE));
+        });
+    }
+    printDiagnostics();
+    if (errors()) 
+    {
+        log << errors() << " errors" << endl;
+        return 1;
+    }
+
+    //every global, and each local label whose name no other file defines, for the
+    //symbol dump and the ELF symbol table
+    LabelTable symbols;
+    for (uint32_t id = 0; id < globals.size(); ++id) symbols.addresses[symbols.intern(globals.names[id])] = globals.addresses[id];
+    size_t globalCount = symbols.size();
+    vector<bool> ambiguous;
+    for (size_t file = 0; file < fileCount; ++file) 
+    {
+        const LabelTable& labels = programs[file].symbols;
+        for (uint32_t id = 0; id < labels.size(); ++id) 
+        {
+            if (labels.addresses[id] == UNDEFINED_ADDRESS) continue;
+            uint32_t symbol = symbols.intern(labels.names[id]);
+            if (symbol < globalCount) continue;
+            ambiguous.resize(symbols.size());
+            if (symbols.addresses[symbol] != UNDEFINED_ADDRESS || ambiguous[symbol]) 
+            {
+                ambiguous[symbol] = true;
+                symbols.addresses[symbol] = UNDEFINED_ADDRESS;
+            }
+            else symbols.addresses[symbol] = linkedAddress(inputs[file], labels.addresses[id]);
+        }
+    }
+    log << "Linked " << fileCount << " files, " << globals.size() << " global symbols." << endl;
+    if (!options.quiet) 
+    {
+        log << "Symbol Table:" << endl;
+        for (uint32_t id : definedLabelsByName(symbols)) log << "  " << symbols.names[id] << ": " << Hexa(symbols.addresses[id], 0) << endl;
+    }
 
-                    //null char at the end of string
-                    outputFile << "\"" << strData << "\\0\""; // Show string
-                    dataAddress += strData.length() + 1;
+    PhaseTimer timer(stats, PHASE_DATA);
+    LineMap lines;
+    if (options.debugLine || !options.lineMapFilename.empty()) 
+    {
+        for (size_t file = 0; file < fileCount; ++file) lines.add(programs[file], sourceName(file), inputs[file].textBase);
+    }
+    const string& outputFilename = options.outputFilename;
+    bool written;
+    if (options.format == OutputFormat::Raw) written = writeFlatImage(outputFilename, linked);
+    else if (options.format == OutputFormat::Elf) written = writeElf(outputFilename, linked, symbols, globalCount, options.debugLine ? &lines : nullptr);
+    else 
+    {
+        int outputFd = toStdout ? STDOUT_FILENO : open(outputFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFd < 0) 
+        {
+            cerr << "Error:cant open output file " << outputFilename << endl;
+            return 1;
+        }
+        OutputWriter output(outputFd);
+        //files are listed a window at a time on the -j threads and written in order
+        size_t window = static_cast<size_t>(jobs) * 4;
+        vector<string> buffers(window);
+        for (size_t windowStart = 0; windowStart < fileCount; windowStart += window) 
+        {
+            size_t windowEnd = min(fileCount, windowStart + window);
+            parallelFor(windowEnd - windowStart, jobs, [&](size_t i) {
+                const LinkInput& input = inputs[windowStart + i];
+                TraceSpan span("list", input.image.text.size());
+                string& out = buffers[i];
+                out.clear();
+                size_t first = (input.textBase - TEXT_BASE) / 4;
+                for (size_t k = 0; k < input.image.text.size(); ++k) 
+                {
+                    appendLinkedListingLine(out, options.format, input.textBase + 4 * static_cast<long>(k), linked.text[first + k]);
                 }
-                outputFile << endl;
-            } 
-            else 
-            { 
-                string valueStr = operands[1];
-                long value = stringToLong(valueStr);
-                outputFile << Hexa(dataAddress, 0) << " ";
-
-                if (directive == ".byte")
-                 {
-                    outputFile << Hexa(static_cast<uint32_t>(value & 0xFF), 2);
-                    dataAddress += 1;
-                } 
-                else if (directive == ".half")
-                 {
-                    outputFile << Hexa(static_cast<uint32_t>(value & 0xFFFF), 4);
-                    dataAddress += 2;
-                } 
-                else if (directive == ".word")
-                 {
-                    outputFile << Hexa(static_cast<uint32_t>(value & 0xFFFFFFFF), 8);
-                    dataAddress += 4;
-                } 
-                else if (directive == ".dword")
-             {
-                    outputFile << Hexa(static_cast<uint64_t>(value), 16);
-                    dataAddress += 8;
+            });
+            for (size_t i = 0; i < windowEnd - windowStart; ++i) output.write(buffers[i]);
+        }
+
+        appendTextEndMarker(output.buffer(), options.format, textEnd);
+        bool wroteDataHeader = false;
+        for (size_t file = 0; file < fileCount; ++file) 
+        {
+            const Program& program = programs[file];
+            for (const SourceLine& entry : program.lines) 
+            {
+                if (entry.inText || entry.tokenCount == 0) continue;
+                if (!wroteDataHeader) output.buffer() += '\n';
+                wroteDataHeader = true;
+                string_view directive = program.tokens[entry.firstToken];
+                long address = linkedAddress(inputs[file], entry.address);
+                appendDataListing(output, options.format, entry, directive, linked.data.data() + (address - DATA_BASE), dataLineSize(entry, directive), address);
+            }
+        }
+        written = output.flush();
+        if (!toStdout) written = close(outputFd) == 0 && written;
+    }
+    if (!written) 
+    {
+        cerr << "Error:cant write output file " << outputFilename << endl;
+        return 1;
+    }
+    log << "Output written to " << outputFilename << endl;
+    if (!writeSymbolsAndLines(options, symbols, globalCount, textEnd, dataEnd, lines)) return 1;
+
+    if (options.run) 
+    {
+        TraceSpan span("run");
+        auto start = chrono::steady_clock::now();
+        RunResult run = runProgram(linked, textEnd, options.runLimit);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        span.items = run.steps;
+        if (!run.fault.empty()) 
+        {
+            //the file whose .text holds the pc
+            size_t file = 0;
+            while (file + 1 < fileCount && inputs[file + 1].textBase <= static_cast<long>(run.pc)) ++file;
+            long address = static_cast<long>(run.pc) - inputs[file].textBase + TEXT_BASE;
+            programs[file].diagnostics.error(lineOfAddress(programs[file], address), 0, "run: " + run.fault + " at pc " + Hexa(run.pc));
+            printDiagnostics();
+        }
+        printRunReport(toStdout ? cerr : cout, run, seconds);
+    }
+    if (errors()) log << errors() << " errors" << endl;
+    return errors() == 0 ? 0 : 1;
+}
+
+//assembleFile (linkFiles for several inputs), followed by the --stats summary and the --trace file
+int runAssembler(const Options& options, PhaseStats& stats) 
+{
+    bool tracing = options.stats || !options.traceFilename.empty();
+    if (tracing) 
+    {
+        traceLog.events.clear();
+        traceLog.events.reserve(4096);
+        traceLog.enabled = true;
+    }
+    vector<Program> programs(max<size_t>(options.inputFilenames.size(), 1));
+    int status = programs.size() > 1 ? linkFiles(options, programs, stats) : assembleFile(options, programs[0], stats);
+    traceLog.enabled = false;
+    if (options.stats) printStats(cerr, programs, stats);
+    if (!options.traceFilename.empty()) 
+    {
+        string trace = traceJson();
+        int fd = open(options.traceFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !writeAll(fd, trace.data(), trace.size()) || close(fd) != 0) 
+        {
+            cerr << "Error:cant write trace file " << options.traceFilename << endl;
+            return 1;
+        }
+    }
+    return status;
+}
+
+//splitmix64, so a seed always gives the same workload
+struct WorkloadRandom 
+{
+    uint64_t state;
+    uint64_t next() 
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    long between(long low, long high) { return low + static_cast<long>(next() % static_cast<uint64_t>(high - low + 1)); }
+};
+
+//operands of info in source order, rs1 in parentheses where it is a memory base (after
+//the offset of a load or store, as the last operand of an atomic); operand(i) appends
+//operand i, which OperandSlots says the field of
+template <typename Operand>
+void appendOperandList(string& out, const InstructionInfo& info, Operand operand) 
+{
+    const OperandSlots& slots = info.slots;
+    for (size_t i = 1; i <= 3; ++i) 
+    {
+        if (i != slots.rd && i != slots.rs1 && i != slots.rs2 && i != slots.imm) continue;
+        bool base = hasMemoryOperand(info) && i == slots.rs1;
+        out += i == 1 ? " " : base && i - 1 == slots.imm ? "(" : base ? ",(" : ",";
+        operand(i);
+        if (base) out += ')';
+    }
+}
+
+//assembly source with the instruction mix, label density and branch distances of config
+string generateWorkload(const WorkloadConfig& config) 
+{
+    using Format = InstructionInfo::Format;
+    //mnemonics of each format, in table order
+    array<vector<const InstructionInfo*>, 6> byFormat;
+    for (const InstructionInfo& info : instructionTable) byFormat[static_cast<size_t>(info.format)].push_back(&info);
+
+    size_t labelEvery = config.labelDensity > 0 ? max<size_t>(1, static_cast<size_t>(1 / config.labelDensity + 0.5)) : 0;
+    long labelCount = labelEvery ? static_cast<long>((config.textLines + labelEvery - 1) / labelEvery) : 0;
+    array<double, 6> mix = config.mix;
+    if (labelCount == 0) mix[static_cast<size_t>(Format::SB)] = mix[static_cast<size_t>(Format::UJ)] = 0; //nothing to branch to
+    double total = 0;
+    for (double weight : mix) total += weight;
+
+    WorkloadRandom random{config.seed};
+    string source;
+    source.reserve(config.textLines * 24 + config.dataLines * 32);
+    auto appendRegister = [&]() {
+        source += 'x';
+        source += to_string(random.between(0, 31));
+    };
+
+    source += ".text\n";
+    long label = -1; //last label placed
+    for (size_t line = 0; line < config.textLines; ++line) 
+    {
+        if (labelEvery && line % labelEvery == 0) 
+        {
+            source += 'L';
+            source += to_string(++label);
+            source += ":\n";
+        }
+
+        //weighted pick of the format, then any mnemonic of it
+        double pick = static_cast<double>(random.next() >> 11) * 0x1.0p-53 * total;
+        size_t format = 0;
+        while (format + 1 < mix.size() && (pick >= mix[format] || mix[format] == 0)) pick -= mix[format++];
+        if (total == 0) format = static_cast<size_t>(Format::R);
+        const vector<const InstructionInfo*>& choices = byFormat[format];
+        const InstructionInfo& info = *choices[random.next() % choices.size()];
+
+        source += "    ";
+        source += info.name;
+        appendOperandList(source, info, [&](size_t i) {
+            using Syntax = InstructionInfo::Syntax;
+            if (i != info.slots.imm) 
+            {
+                if (i == info.slots.rs1 && info.syntax == Syntax::CsrImmediate) source += to_string(random.between(0, 31));
+                else appendRegister();
+                return;
+            }
+            if (labelOperandIndex(info)) 
+            {
+                long distance = static_cast<long>(config.branchDistance);
+                long target = min(labelCount - 1, max(0L, label + random.between(-distance, distance)));
+                source += 'L';
+                source += to_string(target);
+            }
+            else if (hasMemoryOperand(info)) source += to_string(random.between(-32, 31) * 8);
+            else if (info.syntax == Syntax::Shift) source += to_string(random.between(0, 63));
+            else if (info.syntax == Syntax::ShiftWord) source += to_string(random.between(0, 31));
+            else if (info.syntax == Syntax::Fence) source += "rw,rw";
+            else if (info.syntax == Syntax::Csr || info.syntax == Syntax::CsrImmediate) source += to_string(random.between(0x340, 0x344));
+            else if (info.format == Format::U) source += to_string(random.between(0, 0xFFFFF));
+            else source += to_string(random.between(-2048, 2047));
+        });
+        source += '\n';
+    }
+
+    //data segment, a label on every fourth line
+    static constexpr const char* directives[] = {".byte", ".half", ".word", ".dword", ".asciz"};
+    source += ".data\n";
+    for (size_t line = 0; line < config.dataLines; ++line) 
+    {
+        if (line % 4 == 0) 
+        {
+            source += 'D';
+            source += to_string(line / 4);
+            source += ": ";
+        }
+        const char* directive = directives[random.next() % size(directives)];
+        source += directive;
+        source += ' ';
+        if (directive[1] == 'a') 
+        {
+            source += "\"s";
+            source += to_string(random.next() % 100000);
+            source += '"';
+        }
+        else 
+        {
+            source += to_string(random.between(0, 127));
+        }
+        source += '\n';
+    }
+    return source;
+}
+
+//--fuzz's allocation check: a generated workload assembled again and again into one
+//workspace must not allocate in pass 1 or pass 2 once it is warm, per line or otherwise;
+//the first run sizes the arenas and the label table, the second merges each arena's
+//blocks into one
+bool checkSteadyStateAllocations(const Options& options) 
+{
+    if (!COUNTS_ALLOCATIONS) 
+    {
+        cout << "allocations: not counted, build with -DCOUNT_ALLOCATIONS to check them" << endl;
+        return true;
+    }
+    WorkloadConfig config = options.workload;
+    config.textLines = 200000;
+    config.dataLines = 2000;
+    string source = generateWorkload(config);
+    Assembler assembler(OutputFormat::Hex, options.jobs);
+    Program workspace;
+    size_t tokenizeAllocations = 0, encodeAllocations = 0;
+    for (int run = 0; run < 3; ++run) 
+    {
+        workspace.reset();
+        workspace.source.owned = source;
+        tokenizeAllocations = assembler.layout(workspace);
+        Image image;
+        OutputWriter output;
+        output.buffer().reserve(config.textLines * 64);
+        encodeAllocations = assembler.encodeText(workspace, false, image, output);
+    }
+    size_t lines = workspace.lines.size();
+    bool ok = tokenizeAllocations == 0 && encodeAllocations == 0 && workspace.diagnostics.errors == 0;
+    cout << "allocations: " << lines << " lines, " << tokenizeAllocations << " in pass 1, " << encodeAllocations
+         << " in pass 2, " << (ok ? "none per line" : "FAILED") << endl;
+    if (!ok) cerr << "Error:fuzz: a steady-state assembly of " << lines << " lines made heap allocations" << endl;
+    return ok;
+}
+
+//--fuzz: property test of assemble() against decodeWord(), for each instruction format
+//`count` random instructions (any registers, spelled as xN or by ABI name, immediates
+//over their whole field in decimal or hex, branches and jumps to random labels in reach)
+//are assembled and every word must decode to the fields it was written with; then the
+//disassembly of the words, assembled again, must give the same words
+//returns 0 if every format round-trips and checkSteadyStateAllocations passes
+int runFuzz(const Options& options) 
+{
+    using Format = InstructionInfo::Format;
+    const char* abiNames[32] = {};
+#define X(name, num) abiNames[num] = #name;
+    RISCV_REGISTER_NAMES(X)
+#undef X
+    static constexpr pair<const char*, long> csrNames[] = {
+#define X(name, num) {#name, num},
+        RISCV_CSR_NAMES(X)
+#undef X
+    };
+    WorkloadRandom random{options.workload.seed};
+    Assembler assembler(OutputFormat::Raw, options.jobs);
+    Program workspace;
+    size_t count = options.fuzzCount;
+    int failedFormats = 0;
+
+    for (size_t format = 0; format < size(formatNames); ++format) 
+    {
+        vector<const InstructionInfo*> choices;
+        for (const InstructionInfo& info : instructionTable) 
+        {
+            if (static_cast<size_t>(info.format) == format) choices.push_back(&info);
+        }
+        //label of the line a branch/jump offset lands on
+        auto label = [](string& out, size_t line, long offset) {
+            out += 'L';
+            out += to_string(static_cast<long>(line) + offset / 4);
+        };
+
+        vector<Decoded> expected(count);
+        string source = ".text\n";
+        for (size_t k = 0; k < count; ++k) 
+        {
+            Decoded& decoded = expected[k];
+            const InstructionInfo& info = *choices[random.next() % choices.size()];
+            decoded.info = &info;
+            auto reg = [&](uint32_t& field) {
+                field = static_cast<uint32_t>(random.between(0, 31));
+                if (random.next() & 1) source += abiNames[field];
+                else source += 'x' + to_string(field);
+            };
+            auto number = [&](long low, long high) {
+                long value = random.between(low, high);
+                if (random.next() & 1) 
+                {
+                    source += to_string(value);
+                    return value;
+                }
+                if (value < 0) source += '-';
+                appendHex(source, static_cast<uint64_t>(value < 0 ? -value : value));
+                return value;
+            };
+            auto imm = [&](long low, long high) { decoded.imm = number(low, high); };
+            //branches stay in reach of a 13-bit offset, so nothing is relaxed
+            auto target = [&]() {
+                long line = max(0L, min(static_cast<long>(count) - 1, static_cast<long>(k) + random.between(-1000, 1000)));
+                decoded.imm = (line - static_cast<long>(k)) * 4;
+                label(source, k, decoded.imm);
+            };
+
+            label(source, k, 0);
+            source += ": ";
+            source += info.name;
+            appendOperandList(source, info, [&](size_t i) {
+                using Syntax = InstructionInfo::Syntax;
+                if (i == info.slots.rd) reg(decoded.rd);
+                else if (i == info.slots.rs2) reg(decoded.rs2);
+                else if (i == info.slots.rs1 && info.syntax == Syntax::CsrImmediate) decoded.rs1 = static_cast<uint32_t>(number(0, 31));
+                else if (i == info.slots.rs1) reg(decoded.rs1);
+                else if (labelOperandIndex(info)) target();
+                else if (info.syntax == Syntax::Shift) imm(0, 63);
+                else if (info.syntax == Syntax::ShiftWord) imm(0, 31);
+                else if (info.syntax == Syntax::Fence) 
+                {
+                    long pred = random.between(0, 15), succ = random.between(0, 15);
+                    char text[12];
+                    char* at = writeFenceSet(text, pred);
+                    *at++ = ',';
+                    source.append(text, writeFenceSet(at, succ) - text);
+                    decoded.imm = pred << 4 | succ;
+                }
+                else if ((info.syntax == Syntax::Csr || info.syntax == Syntax::CsrImmediate) && (random.next() & 1)) 
+                {
+                    const auto& csr = csrNames[random.next() % size(csrNames)];
+                    source += csr.first;
+                    decoded.imm = csr.second;
                 }
-                outputFile << endl;
+                else if (info.syntax == Syntax::Csr || info.syntax == Syntax::CsrImmediate) imm(0, 4095);
+                else if (info.format == Format::U) imm(0, 0xFFFFF);
+                else imm(-2048, 2047);
+            });
+            if (info.syntax == InstructionInfo::Syntax::System) decoded.imm = info.base >> 20;
+            source += '\n';
+        }
+
+        size_t failures = 0;
+        auto fail = [&](const string& message) {
+            if (failures++ < 5) cerr << "Error:fuzz " << formatNames[format] << ": " << message << endl;
+        };
+        AssemblyResult first = assembler.assemble(source, workspace);
+        if (!first.ok() || first.image.text.size() != count) 
+        {
+            fail("the generated source did not assemble\n" + formatDiagnostics(first.diagnostics, "fuzz", false));
+        }
+        string again = ".text\n";
+        for (size_t k = 0; k < count && failures == 0; ++k) 
+        {
+            uint32_t word = first.image.text[k];
+            Decoded decoded = decodeWord(word);
+            const Decoded& want = expected[k];
+            if (decoded.info != want.info || decoded.rd != want.rd || decoded.rs1 != want.rs1 || decoded.rs2 != want.rs2 || decoded.imm != want.imm) 
+            {
+                string message;
+                appendHex(message, word, 8);
+                message += " decodes to '";
+                appendDisassembly(message, decoded);
+                message += "', written as '";
+                appendDisassembly(message, want);
+                message += '\'';
+                fail(message);
+            }
+            label(again, k, 0);
+            again += ": ";
+            appendDisassembly(again, decoded);
+            //the disassembly gives branch/jump targets as offsets, the source needs a label
+            if (labelOperandIndex(*want.info)) 
+            {
+                again.resize(again.rfind(',') + 1);
+                label(again, k, decoded.imm);
             }
+            again += '\n';
+        }
+        if (failures == 0) 
+        {
+            AssemblyResult second = assembler.assemble(move(again), workspace);
+            if (!second.ok() || second.image.text != first.image.text) fail("the disassembly assembled to different words");
         }
+
+        if (failures) ++failedFormats;
+        cout << formatNames[format] << ": " << count << " instructions, " << (failures ? "FAILED" : "round-tripped") << endl;
+    }
+    return failedFormats == 0 && checkSteadyStateAllocations(options) ? 0 : 1;
+}
+
+//peak resident set size of this process in bytes
+size_t peakResidentBytes() 
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+//a temporary file holding data, its name in path
+bool writeTempFile(string& path, const string& data) 
+{
+    path = "/tmp/assembler-bench-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) return false;
+    bool written = writeAll(fd, data.data(), data.size());
+    return close(fd) == 0 && written;
+}
+
+//assemble a generated workload options.benchRuns times and report the fastest run per phase
+int runBenchmark(const Options& options) 
+{
+    string source = generateWorkload(options.workload);
+    Options run = options;
+    run.quiet = true;
+    run.stats = false;
+    run.traceFilename.clear();
+    run.inputFilenames.clear();
+    if (!writeTempFile(run.inputFilename, source) || !writeTempFile(run.outputFilename, string())) 
+    {
+        cerr << "Error:cant create benchmark files in /tmp" << endl;
+        return 1;
     }
+    size_t lineCount = options.workload.textLines + options.workload.dataLines;
+    cout << "Benchmark: " << options.workload.textLines << " text lines, " << options.workload.dataLines
+         << " data lines, " << source.size() << " bytes, " << options.jobs << " thread(s), seed "
+         << options.workload.seed << endl;
 
-    inputFile_pass2.close();
-    outputFile.close();
+    int status = 0;
+    PhaseStats best;
+    double bestSeconds = 0;
+    for (int r = 0; r < options.benchRuns && status == 0; ++r) 
+    {
+        PhaseStats stats;
+        status = runAssembler(run, stats);
+        double seconds = 0;
+        for (double phase : stats.seconds) seconds += phase;
+        cout << "  run " << r + 1 << ": " << fixed << setprecision(3) << seconds << " s" << endl;
+        if (r == 0 || seconds < bestSeconds) 
+        {
+            best = stats;
+            bestSeconds = seconds;
+        }
+    }
+    unlink(run.inputFilename.c_str());
+    unlink(run.outputFilename.c_str());
+    if (status != 0) return status;
 
-    cout << "Pass 2 complete. Output written to " << outputFilename << endl;
+    cout << "Fastest run:" << endl;
+    printPhaseTable(cout, best);
+    cout << "  " << setprecision(0) << lineCount / max(bestSeconds, 1e-9) << " lines/s, "
+         << setprecision(1) << source.size() / max(bestSeconds, 1e-9) / 1e6 << " MB/s, peak RSS "
+         << peakResidentBytes() / (1024 * 1024) << " MB" << endl;
     return 0;
-}
\ No newline at end of file
+}
+
+//buffered reads from a file descriptor for the --serve protocol
+class FdReader 
+{
+public:
+    explicit FdReader(int fd) : fd(fd) {}
+
+    //next line without its '\n', false at end of input
+    bool readLine(string& line) 
+    {
+        line.clear();
+        for (;;) 
+        {
+            if (begin == end && !fill()) return !line.empty();
+            const char* newline = static_cast<const char*>(memchr(buffer.data() + begin, '\n', end - begin));
+            size_t stop = newline ? newline - buffer.data() : end;
+            line.append(buffer.data() + begin, stop - begin);
+            begin = newline ? stop + 1 : stop;
+            if (newline) return true;
+        }
+    }
+
+    //exactly size bytes, false if the input ends first
+    bool readExact(string& data, size_t size) 
+    {
+        data.clear();
+        data.reserve(size);
+        while (data.size() < size) 
+        {
+            if (begin == end && !fill()) return false;
+            size_t take = min(size - data.size(), end - begin);
+            data.append(buffer.data() + begin, take);
+            begin += take;
+        }
+        return true;
+    }
+
+private:
+    bool fill() 
+    {
+        ssize_t got;
+        do got = read(fd, buffer.data(), buffer.size());
+        while (got < 0 && errno == EINTR);
+        begin = 0;
+        end = got > 0 ? static_cast<size_t>(got) : 0;
+        return got > 0;
+    }
+
+    int fd;
+    array<char, 1 << 16> buffer;
+    size_t begin = 0, end = 0;
+};
+
+//one request of a --serve session
+struct BatchJob 
+{
+    string name;
+    string source;
+    string response;
+    bool done = false;
+};
+
+//answer --serve requests read from in on `jobs` worker threads, writing the
+//responses to out in request order
+//request:  "<name> <size>\n" followed by size bytes of source
+//response: "<name> ok|error <output size> <diagnostics size>\n" followed by the
+//          output (listing or ELF file) and the diagnostics
+//each worker keeps its own Program, so after the first few jobs the line table,
+//token pool and label table are reused instead of allocated again
+//diagnostics are named after the job, as text or (json) JSON lines
+//false if the stream broke the protocol (a bad header or a request cut short); the
+//requests before it are still answered
+bool serveStream(int in, int out, const Assembler& assembler, int jobs, bool json) 
+{
+    mutex lock;
+    condition_variable changed;
+    deque<BatchJob> queue;   //in request order, popped once answered
+    size_t unclaimed = 0;    //jobs at the back of queue no worker has taken yet
+    bool closed = false;     //no more requests
+    size_t maxInFlight = static_cast<size_t>(jobs) * 4;
+
+    auto worker = [&]() {
+        Program workspace;
+        unique_lock<mutex> guard(lock);
+        for (;;) 
+        {
+            changed.wait(guard, [&]() { return unclaimed > 0 || closed; });
+            if (unclaimed == 0) return;
+            BatchJob& job = queue[queue.size() - unclaimed--];
+            guard.unlock();
+
+            AssemblyResult result = assembler.assemble(move(job.source), workspace);
+            string diagnostics = formatDiagnostics(result.diagnostics, job.name, json);
+            string response = job.name + (result.ok() ? " ok " : " error ") + to_string(result.output.size())
+                + ' ' + to_string(diagnostics.size()) + '\n';
+            response += result.output;
+            response += diagnostics;
+
+            guard.lock();
+            job.response = move(response);
+            job.done = true;
+            changed.notify_all();
+        }
+    };
+    auto writer = [&]() {
+        unique_lock<mutex> guard(lock);
+        for (;;) 
+        {
+            changed.wait(guard, [&]() { return (!queue.empty() && queue.front().done) || (closed && queue.empty()); });
+            if (queue.empty()) return;
+            string response = move(queue.front().response);
+            queue.pop_front();
+            changed.notify_all();
+            guard.unlock();
+            writeAll(out, response.data(), response.size());
+            guard.lock();
+        }
+    };
+    vector<thread> threads;
+    for (int t = 0; t < jobs; ++t) threads.emplace_back(worker);
+    threads.emplace_back(writer);
+
+    FdReader reader(in);
+    string header, source;
+    bool ok = true;
+    while (reader.readLine(header)) 
+    {
+        if (header.empty()) continue;
+        size_t space = header.rfind(' ');
+        size_t size = 0;
+        if (space == string::npos || space == 0 || !parseCount(string_view(header).substr(space + 1), size)) 
+        {
+            cerr << "Error:bad request header '" << header << "'" << endl;
+            ok = false;
+            break;
+        }
+        if (!reader.readExact(source, size)) 
+        {
+            cerr << "Error:request '" << header << "' ends early" << endl;
+            ok = false;
+            break;
+        }
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&]() { return queue.size() < maxInFlight; });
+        queue.push_back({header.substr(0, space), move(source), string(), false});
+        ++unclaimed;
+        changed.notify_all();
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        changed.notify_all();
+    }
+    for (thread& t : threads) t.join();
+    return ok;
+}
+
+//--serve: requests on stdin, or on every connection to a Unix socket at socketPath
+int runServer(const Options& options) 
+{
+    //a client that goes away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    Assembler assembler(options.format, 1, options.maxErrors);
+    bool json = options.jsonDiagnostics;
+    if (options.serveSocket.empty()) 
+    {
+        return serveStream(STDIN_FILENO, STDOUT_FILENO, assembler, options.jobs, json) ? 0 : 1;
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (options.serveSocket.size() >= sizeof(address.sun_path)) 
+    {
+        cerr << "Error:socket path too long " << options.serveSocket << endl;
+        return 1;
+    }
+    strcpy(address.sun_path, options.serveSocket.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(options.serveSocket.c_str());
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) 
+    {
+        cerr << "Error:cant listen on " << options.serveSocket << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    for (;;) 
+    {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) 
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            cerr << "Error:accept failed: " << strerror(errno) << endl;
+            return 1;
+        }
+        //every connection is its own session with its own workers
+        thread([connection, &assembler, jobs = options.jobs, json]() {
+            serveStream(connection, connection, assembler, jobs, json);
+            close(connection);
+        }).detach();
+    }
+}
+
+int main(int argc, char* argv[]) 
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) 
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    ios::sync_with_stdio(false);
+
+    if (!options.generateFilename.empty()) 
+    {
+        string source = generateWorkload(options.workload);
+        int fd = options.generateFilename == "-" ? STDOUT_FILENO : open(options.generateFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !writeAll(fd, source.data(), source.size()) || (fd != STDOUT_FILENO && close(fd) != 0)) 
+        {
+            cerr << "Error:cant write " << options.generateFilename << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (options.bench) return runBenchmark(options);
+    if (options.fuzzCount) return runFuzz(options);
+    if (options.serve) return runServer(options);
+
+    PhaseStats stats;
+    return runAssembler(options, stats);
+}